@@ -109,6 +109,10 @@ DEFINE_ACTION_STRING     ("limit-connect",              ACTION_LIMIT_CONNECT,
 DEFINE_CGI_PARAM_NO_RADIO("limit-connect",              ACTION_LIMIT_CONNECT,   ACTION_STRING_LIMIT_CONNECT,  "443")
 DEFINE_ACTION_STRING     ("limit-cookie-lifetime",      ACTION_LIMIT_COOKIE_LIFETIME, ACTION_STRING_LIMIT_COOKIE_LIFETIME)
 DEFINE_CGI_PARAM_CUSTOM  ("limit-cookie-lifetime",      ACTION_LIMIT_COOKIE_LIFETIME, ACTION_STRING_LIMIT_COOKIE_LIFETIME, "60")
+DEFINE_ACTION_STRING     ("media-mode",                 ACTION_MEDIA_MODE,      ACTION_STRING_MEDIA_MODE)
+DEFINE_CGI_PARAM_RADIO   ("media-mode",                 ACTION_MEDIA_MODE,      ACTION_STRING_MEDIA_MODE,    "accelerate", 1)
+DEFINE_CGI_PARAM_RADIO   ("media-mode",                 ACTION_MEDIA_MODE,      ACTION_STRING_MEDIA_MODE,    "stream", 0)
+DEFINE_CGI_PARAM_RADIO   ("media-mode",                 ACTION_MEDIA_MODE,      ACTION_STRING_MEDIA_MODE,    "download", 2)
 DEFINE_ACTION_STRING     ("overwrite-last-modified",    ACTION_OVERWRITE_LAST_MODIFIED, ACTION_STRING_LAST_MODIFIED)
 DEFINE_CGI_PARAM_RADIO   ("overwrite-last-modified",    ACTION_OVERWRITE_LAST_MODIFIED, ACTION_STRING_LAST_MODIFIED, "block", 0)
 DEFINE_CGI_PARAM_RADIO   ("overwrite-last-modified",    ACTION_OVERWRITE_LAST_MODIFIED, ACTION_STRING_LAST_MODIFIED, "reset-to-request-time", 1)
@@ -103,6 +103,8 @@ extern privoxy_mutex_t rand_mutex;
 
 /* Functions */
 
+extern int request_is_accelerated(const struct client_state *csp);
+
 #ifdef __MINGW32__
 int real_main(int argc, char **argv);
 #else
@@ -505,6 +505,8 @@ struct iob
 #define ACTION_HIDE_ACCEPT_LANGUAGE                  0x04000000UL
 /** Action bitmap: Limit the cookie lifetime */
 #define ACTION_LIMIT_COOKIE_LIFETIME                 0x08000000UL
+/** Action bitmap: Choose how the proxy interface gets the content */
+#define ACTION_MEDIA_MODE                            0x10000000UL
 
 
 /** Action string index: How to deanimate GIFs */
@@ -545,8 +547,10 @@ struct iob
 #define ACTION_STRING_CHANGE_X_FORWARDED_FOR 17
 /** Action string index: how many minutes cookies should be valid. */
 #define ACTION_STRING_LIMIT_COOKIE_LIFETIME 18
+/** Action string index: how the proxy interface gets the content. */
+#define ACTION_STRING_MEDIA_MODE           19
 /** Number of string actions. */
-#define ACTION_STRING_COUNT                19
+#define ACTION_STRING_COUNT                20
 
 
 /* To make the ugly hack in sed easier to understand */
@@ -1352,6 +1356,33 @@ struct configuration_spec
    int compression_level;
 #endif
 
+   /** Size in bytes of the first window of a media download, 0 for no slow start. */
+   unsigned int media_first_window_size;
+
+   /** Growth of each media download window over the previous one. */
+   unsigned int media_window_growth;
+
+   /** Size limit in bytes of all the media download buffers, 0 for none. */
+   unsigned long long media_memory_limit;
+
+   /** Nonzero to allocate the media download buffers at start. */
+   int media_memory_prefault;
+
+   /** Nonzero to lock the media download buffers in memory. */
+   int media_memory_lock;
+
+   /** Bytes of media downloaded ahead of the client, 0 for no limit. */
+   unsigned int media_read_ahead;
+
+   /** Directory the large downloads are kept in, NULL to disable them. */
+   char *download_directory;
+
+   /** Directory the media contents are cached in, NULL to disable the cache. */
+   char *media_cache_directory;
+
+   /** Size limit in bytes of the media cache on disk, 0 for none. */
+   unsigned long long media_cache_size;
+
    /** All options from the config file, HTML-formatted. */
    char *proxy_args;
 
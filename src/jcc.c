@@ -146,6 +146,7 @@ static jb_err receive_client_request(struct client_state *csp);
 static jb_err parse_client_request(struct client_state *csp);
 static void build_request_line(struct client_state *csp, const struct forward_spec *fwd, char **request_line);
 static jb_err change_request_destination(struct client_state *csp);
+static int send_server_request(struct client_state *csp, const struct forward_spec *fwd);
 static void chat(struct client_state *csp);
 static void serve(struct client_state *csp);
 #if !defined(_WIN32) || defined(_WIN_CONSOLE)
@@ -1112,7 +1113,7 @@ void save_connection_destination(jb_socket sfd,
  *
  * Description : Checks if we already got the whole client requests
  *               and sets CSP_FLAG_CLIENT_REQUEST_COMPLETELY_READ if
- *               we do.
+ *               we do. A chunked body is left to chat().
  *
  *               Data that doesn't belong to the current request is
  *               either thrown away to let the client retry on a clean
@@ -1130,6 +1131,21 @@ static void verify_request_length(struct client_state *csp)
    unsigned long long buffered_request_bytes =
       (unsigned long long)(csp->client_iob->eod - csp->client_iob->cur);
 
+   if ((csp->flags & CSP_FLAG_CHUNKED_CLIENT_BODY)
+      && strcmpic(csp->http->gpc, "GET")
+      && strcmpic(csp->http->gpc, "HEAD"))
+   {
+      /*
+       * The end of a chunked body is only found while chat()
+       * decodes it, upload_client_body() marks the request as
+       * completely read then. Whatever came with the headers,
+       * if anything, is the start of the body.
+       */
+      csp->flags &= ~CSP_FLAG_CLIENT_REQUEST_COMPLETELY_READ;
+      log_error(LOG_LEVEL_CONNECT, "Expecting the chunked client body.");
+      return;
+   }
+
    if ((csp->expected_client_content_length != 0)
       && (buffered_request_bytes != 0))
    {
@@ -1322,145 +1338,217 @@ static char *get_request_line(struct client_state *csp)
 
 }
 
-enum chunk_status
+/*
+ * Where the decoding of a chunked client body is.
+ */
+enum chunk_state
+{
+   CHUNK_STATE_SIZE,     /* Reading the chunk-size line */
+   CHUNK_STATE_DATA,     /* Passing on the chunk-data */
+   CHUNK_STATE_DATA_END, /* Expecting the "\r\n" after the chunk-data */
+   CHUNK_STATE_TRAILER,  /* Skipping the trailer lines */
+   CHUNK_STATE_DONE      /* The last chunk and the trailer are read */
+};
+
+struct chunk_decoder
 {
-   CHUNK_STATUS_MISSING_DATA,
-   CHUNK_STATUS_BODY_COMPLETE,
-   CHUNK_STATUS_PARSE_ERROR
+   enum chunk_state state;
+   unsigned long long chunk_left; /* chunk-data bytes not passed on yet */
+   unsigned int digits;           /* chunk-size digits read so far */
+   int in_extension;              /* past the chunk-size digits */
+   size_t line_length;            /* length of the trailer line so far */
 };
 
 
 /*********************************************************************
  *
- * Function    :  chunked_body_is_complete
+ * Function    :  decode_chunks
  *
- * Description :  Figures out whether or not a chunked body is complete.
- *
- *                Currently it always starts at the beginning of the
- *                buffer which is somewhat wasteful and prevents Privoxy
- *                from starting to forward the correctly parsed chunks
- *                as soon as theoretically possible.
- *
- *                Should be modified to work with a common buffer,
- *                and allow the caller to skip already parsed chunks.
- *
- *                This would allow the function to be used for unbuffered
- *                response bodies as well.
+ * Description :  Decodes the next part of a chunked client body
+ *                in place. Unlike the old approach of waiting
+ *                for the whole body, the chunks can be passed on
+ *                as soon as they arrive and nothing is buffered.
  *
  * Parameters  :
- *          1  :  iob = Buffer with the body to check.
- *          2  :  length = Length of complete body
+ *          1  :  decoder = State of the decoding, zeroed for a new body
+ *          2  :  buf = The chunked data, the chunk-data ends up at
+ *                      its beginning
+ *          3  :  length = Length of buf, set to the number of bytes
+ *                         used. It's only less than before once the
+ *                         body is complete and buf goes on with the
+ *                         next request.
  *
- * Returns     :  Enum with the result of the check.
+ * Returns     :  Number of chunk-data bytes at the beginning of buf,
+ *                or -1 if the body isn't validly chunked.
  *
  *********************************************************************/
-static enum chunk_status chunked_body_is_complete(struct iob *iob, size_t *length)
+static long decode_chunks(struct chunk_decoder *decoder, char *buf, size_t *length)
 {
-   unsigned int chunksize;
-   char *p = iob->cur;
+   size_t in = 0;
+   size_t out = 0;
+   size_t n;
+   int digit;
+   char c;
 
-   do
+   while ((in < *length) && (decoder->state != CHUNK_STATE_DONE))
    {
-      /*
-       * We need at least a single digit, followed by "\r\n",
-       * followed by an unknown amount of data, followed by "\r\n".
-       */
-      if (p + 5 > iob->eod)
-      {
-         return CHUNK_STATUS_MISSING_DATA;
-      }
-      if (sscanf(p, "%x", &chunksize) != 1)
+      switch (decoder->state)
       {
-         return CHUNK_STATUS_PARSE_ERROR;
-      }
+         case CHUNK_STATE_SIZE:
+            c = buf[in++];
+            if (c == '\n')
+            {
+               if (decoder->digits == 0)
+               {
+                  return -1;
+               }
+               decoder->state = (decoder->chunk_left != 0) ?
+                  CHUNK_STATE_DATA : CHUNK_STATE_TRAILER;
+               decoder->digits = 0;
+               decoder->in_extension = 0;
+               decoder->line_length = 0;
+               break;
+            }
+            if (decoder->in_extension)
+            {
+               break;
+            }
+            if ((c >= '0') && (c <= '9'))
+            {
+               digit = c - '0';
+            }
+            else if ((c >= 'a') && (c <= 'f'))
+            {
+               digit = c - 'a' + 10;
+            }
+            else if ((c >= 'A') && (c <= 'F'))
+            {
+               digit = c - 'A' + 10;
+            }
+            else
+            {
+               /* Chunk extension, whitespace or the CR. */
+               decoder->in_extension = 1;
+               break;
+            }
+            if (decoder->chunk_left > (~0ULL >> 4))
+            {
+               return -1;
+            }
+            decoder->chunk_left = (decoder->chunk_left << 4) | (unsigned)digit;
+            decoder->digits++;
+            break;
 
-      /*
-       * We want at least a single digit, followed by "\r\n",
-       * followed by the specified amount of data, followed by "\r\n".
-       */
-      if (p + chunksize + 5 > iob->eod)
-      {
-         return CHUNK_STATUS_MISSING_DATA;
-      }
+         case CHUNK_STATE_DATA:
+            n = *length - in;
+            if (n > decoder->chunk_left)
+            {
+               n = (size_t)decoder->chunk_left;
+            }
+            memmove(buf + out, buf + in, n);
+            in += n;
+            out += n;
+            decoder->chunk_left -= n;
+            if (decoder->chunk_left == 0)
+            {
+               decoder->state = CHUNK_STATE_DATA_END;
+            }
+            break;
 
-      /* Skip chunk-size. */
-      p = strstr(p, "\r\n");
-      if (NULL == p)
-      {
-         return CHUNK_STATUS_PARSE_ERROR;
-      }
-      /* Move beyond the chunkdata. */
-      p += 2 + chunksize;
+         case CHUNK_STATE_DATA_END:
+            c = buf[in++];
+            if (c == '\n')
+            {
+               decoder->state = CHUNK_STATE_SIZE;
+            }
+            else if (c != '\r')
+            {
+               return -1;
+            }
+            break;
 
-      /* There should be another "\r\n" to skip */
-      if (memcmp(p, "\r\n", 2))
-      {
-         return CHUNK_STATUS_PARSE_ERROR;
-      }
-      p += 2;
-   } while (chunksize > 0U);
+         case CHUNK_STATE_TRAILER:
+            c = buf[in++];
+            if (c == '\n')
+            {
+               if (decoder->line_length == 0)
+               {
+                  decoder->state = CHUNK_STATE_DONE;
+               }
+               decoder->line_length = 0;
+            }
+            else if (c != '\r')
+            {
+               decoder->line_length++;
+            }
+            break;
 
-   *length = (size_t)(p - iob->cur);
-   assert(*length <= (size_t)(iob->eod - iob->cur));
-   assert(p <= iob->eod);
+         case CHUNK_STATE_DONE:
+            break;
+      }
+   }
+   *length = in;
 
-   return CHUNK_STATUS_BODY_COMPLETE;
+   return (long)out;
 
 }
 
 
 /*********************************************************************
  *
- * Function    : receive_chunked_client_request_body
+ * Function    :  upload_client_body
  *
- * Description : Read the chunk-encoded client request body.
- *               Failures are dealt with.
+ * Description :  Hands the next part of the client request body to
+ *                the proxy interface, decoding it first if it is
+ *                chunked, and notes when the body is complete.
  *
  * Parameters  :
  *          1  :  csp = Current client state (buffers, headers, etc...)
+ *          2  :  decoder = State of the chunked body decoding
+ *          3  :  buf = The body data, decoded in place
+ *          4  :  length = Length of buf, set to the number of
+ *                         bytes belonging to the body
  *
- * Returns     :  JB_ERR_OK or JB_ERR_PARSE
+ * Returns     :  JB_ERR_OK on success, JB_ERR_PARSE if the body
+ *                couldn't be decoded or uploaded.
  *
  *********************************************************************/
-static jb_err receive_chunked_client_request_body(struct client_state *csp)
+static jb_err upload_client_body(struct client_state *csp,
+   struct chunk_decoder *decoder, char *buf, size_t *length)
 {
-   size_t body_length;
-   enum chunk_status status;
+   long body_length = (long)*length;
 
-   while (CHUNK_STATUS_MISSING_DATA ==
-      (status = chunked_body_is_complete(csp->client_iob,&body_length)))
+   if (csp->flags & CSP_FLAG_CHUNKED_CLIENT_BODY)
    {
-      char buf[BUFFER_SIZE];
-      int len;
-
-      if (!data_is_available(csp->cfd, csp->config->socket_timeout))
-      {
-         log_error(LOG_LEVEL_ERROR,
-            "Timeout while waiting for the client body.");
-         break;
-      }
-      len = read_socket(csp->cfd, buf, sizeof(buf) - 1);
-      if (len <= 0)
-      {
-         log_error(LOG_LEVEL_ERROR, "Read the client body failed: %E");
-         break;
-      }
-      if (add_to_iob(csp->client_iob, csp->config->buffer_limit, buf, len))
+      body_length = decode_chunks(decoder, buf, length);
+      if (body_length < 0)
       {
-         break;
+         log_error(LOG_LEVEL_ERROR, "Invalid chunked client body.");
+         return JB_ERR_PARSE;
       }
    }
-   if (status != CHUNK_STATUS_BODY_COMPLETE)
+
+   if ((body_length > 0)
+      && proxy_interface_write(csp->handle, buf, (uint32_t)body_length))
    {
-      write_socket(csp->cfd, CLIENT_BODY_PARSE_ERROR_RESPONSE,
-         strlen(CLIENT_BODY_PARSE_ERROR_RESPONSE));
-      log_error(LOG_LEVEL_CLF,
-         "%s - - [%T] \"Failed reading chunked client body\" 400 0", csp->ip_addr_str);
+      log_error(LOG_LEVEL_ERROR, "Uploading the client body failed.");
       return JB_ERR_PARSE;
    }
-   log_error(LOG_LEVEL_CONNECT,
-      "Chunked client body completely read. Length: %d", body_length);
-   csp->expected_client_content_length = body_length;
+
+   if ((csp->flags & CSP_FLAG_CHUNKED_CLIENT_BODY)
+      && (decoder->state == CHUNK_STATE_DONE)
+      && !(csp->flags & CSP_FLAG_CLIENT_REQUEST_COMPLETELY_READ))
+   {
+      log_error(LOG_LEVEL_CONNECT, "Chunked client body completely read.");
+      csp->flags |= CSP_FLAG_CLIENT_REQUEST_COMPLETELY_READ;
+
+      /* The body length wasn't known, tell the interface it ended. */
+      if (proxy_interface_write(csp->handle, buf, 0))
+      {
+         log_error(LOG_LEVEL_ERROR, "Ending the client body upload failed.");
+         return JB_ERR_PARSE;
+      }
+   }
 
    return JB_ERR_OK;
 
@@ -1695,14 +1783,11 @@ static jb_err parse_client_request(struct client_state *csp)
        * This whole block belongs to chat() but currently
        * has to be executed before sed().
        */
-      if (csp->flags & CSP_FLAG_CHUNKED_CLIENT_BODY)
-      {
-         if (receive_chunked_client_request_body(csp) != JB_ERR_OK)
-         {
-            return JB_ERR_PARSE;
-         }
-      }
-      else
+      /*
+       * A chunked body is decoded by chat() while it is
+       * uploaded, its length isn't known before.
+       */
+      if (!(csp->flags & CSP_FLAG_CHUNKED_CLIENT_BODY))
       {
          csp->expected_client_content_length = get_expected_content_length(csp->headers);
       }
@@ -1751,6 +1836,200 @@ static jb_err parse_client_request(struct client_state *csp)
 }
 
 
+/*********************************************************************
+ *
+ * Function    :  media_mode_content_type
+ *
+ * Description :  Tells how the media-mode action wants the content
+ *                of the request to be got.
+ *
+ * Parameters  :
+ *          1  :  csp = Current client state (buffers, headers, etc...)
+ *
+ * Returns     :  The content type, PROXY_CONTENT_TYPE_NONE if the
+ *                action isn't set and the URL decides.
+ *
+ *********************************************************************/
+static ProxyContentType media_mode_content_type(const struct client_state *csp)
+{
+   const char *media_mode;
+
+   if (!(csp->action->flags & ACTION_MEDIA_MODE))
+   {
+      return PROXY_CONTENT_TYPE_NONE;
+   }
+
+   media_mode = csp->action->string[ACTION_STRING_MEDIA_MODE];
+   if (0 == strcmpic(media_mode, "accelerate"))
+   {
+      return PROXY_CONTENT_TYPE_MEDIA;
+   }
+   else if (0 == strcmpic(media_mode, "stream"))
+   {
+      return PROXY_CONTENT_TYPE_STREAM;
+   }
+   else if (0 == strcmpic(media_mode, "download"))
+   {
+      return PROXY_CONTENT_TYPE_FILE_NORMAL;
+   }
+
+   log_error(LOG_LEVEL_ERROR, "Bad media-mode parameter: %s", media_mode);
+   return PROXY_CONTENT_TYPE_NONE;
+}
+
+
+/*********************************************************************
+ *
+ * Function    :  request_is_accelerated
+ *
+ * Description :  Tells whether the content of the request is got by
+ *                the range requests of the media path, which honours
+ *                the Range header of the client by itself.
+ *
+ * Parameters  :
+ *          1  :  csp = Current client state (buffers, headers, etc...)
+ *
+ * Returns     :  TRUE for yes, FALSE otherwise
+ *
+ *********************************************************************/
+int request_is_accelerated(const struct client_state *csp)
+{
+   ProxyInterfaceRequest request;
+
+   if (csp->http->ssl || (csp->http->url == NULL))
+   {
+      return FALSE;
+   }
+
+   memset(&request, 0, sizeof(request));
+   request.url = csp->http->url;
+   request.method = csp->http->gpc;
+   request.content_type = media_mode_content_type(csp);
+   request.server_fd = JB_INVALID_SOCKET;
+
+   return (PROXY_CONTENT_TYPE_MEDIA == proxy_interface_classify(&request));
+}
+
+
+/*********************************************************************
+ *
+ * Function    :  send_server_request
+ *
+ * Description :  Connects to the server, or the forwarder, and sends
+ *                the client request to it, so that the response can
+ *                be relayed from the server socket as it is.
+ *
+ *                The server is asked to close the connection after
+ *                the response, the body is relayed without looking
+ *                at it and its end couldn't be told otherwise.
+ *
+ * Parameters  :
+ *          1  :  csp = Current client state (buffers, headers, etc...)
+ *          2  :  fwd = The forwarding spec used for the request
+ *
+ * Returns     :  TRUE on success, FALSE if the client has been
+ *                told about the failure.
+ *
+ *********************************************************************/
+static int send_server_request(struct client_state *csp, const struct forward_spec *fwd)
+{
+   struct http_request *http = csp->http;
+   struct http_response *rsp;
+   struct list_entry *p;
+   char *hdr;
+
+   build_request_line(csp, fwd, &csp->headers->first->str);
+
+   for (p = csp->headers->first->next; p != NULL; p = p->next)
+   {
+      if ((p->str != NULL) && !strncmpic(p->str, "Connection:", 11))
+      {
+         freez(p->str);
+      }
+   }
+   if ((JB_ERR_OK != enlist_unique_header(csp->headers, "Connection", "close"))
+      || (NULL == (hdr = list_to_text(csp->headers))))
+   {
+      log_error(LOG_LEVEL_ERROR,
+         "Out of memory building the request headers for %s", http->hostport);
+      send_crunch_response(csp, cgi_error_memory());
+      return FALSE;
+   }
+
+   if (csp->server_connection.sfd != JB_INVALID_SOCKET)
+   {
+      log_error(LOG_LEVEL_CONNECT,
+         "Closing server socket %d left open by the previous request.",
+         csp->server_connection.sfd);
+#ifdef FEATURE_CONNECTION_SHARING
+      if (csp->config->feature_flags & RUNTIME_FEATURE_CONNECTION_SHARING)
+      {
+         forget_connection(csp->server_connection.sfd);
+      }
+#endif /* def FEATURE_CONNECTION_SHARING */
+      close_socket(csp->server_connection.sfd);
+#ifdef FEATURE_CONNECTION_KEEP_ALIVE
+      mark_connection_closed(&csp->server_connection);
+#else
+      csp->server_connection.sfd = JB_INVALID_SOCKET;
+#endif
+   }
+
+   csp->server_connection.sfd = forwarded_connect(fwd, http, csp);
+   if (csp->server_connection.sfd == JB_INVALID_SOCKET)
+   {
+      if (fwd->type != SOCKS_NONE)
+      {
+         /* Socks error. */
+         rsp = error_response(csp, "forwarding-failed");
+      }
+      else if (errno == EINVAL)
+      {
+         rsp = error_response(csp, "no-such-domain");
+      }
+      else
+      {
+         rsp = error_response(csp, "connect-failed");
+      }
+
+      /* Write the answer to the client */
+      if (rsp != NULL)
+      {
+         send_crunch_response(csp, rsp);
+      }
+
+      freez(hdr);
+      return FALSE;
+   }
+#ifdef FEATURE_CONNECTION_KEEP_ALIVE
+   save_connection_destination(csp->server_connection.sfd,
+      http, fwd, &csp->server_connection);
+#endif /* def FEATURE_CONNECTION_KEEP_ALIVE */
+
+   /*
+    * Write the request headers to the server, requests
+    * with a body are uploaded by the proxy interface.
+    */
+   if (write_socket(csp->server_connection.sfd, hdr, strlen(hdr)))
+   {
+      log_error(LOG_LEVEL_CONNECT,
+         "Failed sending request headers to: %s: %E", http->hostport);
+
+      rsp = error_response(csp, "connect-failed");
+      if (rsp != NULL)
+      {
+         send_crunch_response(csp, rsp);
+      }
+      mark_server_socket_tainted(csp);
+      freez(hdr);
+      return FALSE;
+   }
+   freez(hdr);
+
+   return TRUE;
+}
+
+
 /*********************************************************************
  *
  * Function    :  chat
@@ -1778,19 +2057,35 @@ static jb_err parse_client_request(struct client_state *csp)
 static void chat(struct client_state *csp)
 {
    char buf[BUFFER_SIZE];
+   struct iovec iov[8];
    fd_set read_fd_set;
+   fd_set write_fd_set;
+   fd_set exc_fd_set;
    int n;
    jb_socket maxfd;
+   int proxy_maxfd;
+   int32_t wait_ms;
+   int watch_client_socket = 1;
+   int proxy_idle = 0;
+   ProxyInterfaceRequest proxy_request;
+   const char **client_headers;
+   struct list_entry *header;
+   struct chunk_decoder chunks;
+   size_t body_bytes;
+   int upload = 0;
+   uint32_t upload_space;
    const struct forward_spec *fwd;
    struct http_request *http;
    int total_running;
    long len = 0; /* for buffer sizes (and negative error codes) */
    int server_body;
+   int splice_body = 0;
    unsigned long long byte_count = 0;
    char *hdr;
    struct timeval timeout;
 
    memset(buf, 0, sizeof(buf));
+   memset(&chunks, 0, sizeof(chunks));
 
    http = csp->http;
 
@@ -1848,22 +2143,107 @@ static void chat(struct client_state *csp)
       log_error(LOG_LEVEL_CONNECT, "to %s", http->hostport);
    }
 
-   csp->handle = proxy_interface_create(http->url);
+   /*
+    * Let the actions decide how to get the content,
+    * the proxy interface tells it by the URL otherwise.
+    */
+   proxy_request.url = http->url;
+   proxy_request.content_type = media_mode_content_type(csp);
+   proxy_request.server_fd = JB_INVALID_SOCKET;
+   proxy_request.method = http->gpc;
+   proxy_request.headers = NULL;
+   if (csp->flags & CSP_FLAG_CHUNKED_CLIENT_BODY)
+   {
+      proxy_request.body_length = -1;
+   }
+   else
+   {
+      proxy_request.body_length = (int64_t)get_expected_content_length(csp->headers);
+   }
+
+   /*
+    * A request body is streamed to the server while it arrives,
+    * through the upload of a single request.
+    */
+   if ((proxy_request.body_length != 0)
+      && strcmpic(http->gpc, "GET") && strcmpic(http->gpc, "HEAD"))
+   {
+      proxy_request.content_type = PROXY_CONTENT_TYPE_STREAM;
+      upload = 1;
+   }
+
+   /*
+    * Nothing to accelerate, relay the response from our own
+    * server socket. Only media-mode{stream} still gets it by curl.
+    */
+   if (!http->ssl
+      && (PROXY_CONTENT_TYPE_NONE == proxy_request.content_type)
+      && (PROXY_CONTENT_TYPE_STREAM == proxy_interface_classify(&proxy_request)))
+   {
+      if (!send_server_request(csp, fwd))
+      {
+         return;
+      }
+      proxy_request.server_fd = csp->server_connection.sfd;
+   }
+
+   /*
+    * The request headers go along with the request if
+    * the interface makes one, skipping the request line.
+    */
+   n = 1;
+   for (header = csp->headers->first; header != NULL; header = header->next)
+   {
+      n++;
+   }
+   client_headers = zalloc(sizeof(*client_headers) * (size_t)n);
+   if (client_headers == NULL)
+   {
+      log_error(LOG_LEVEL_FATAL, "Out of memory passing on the client headers");
+   }
+   n = 0;
+   for (header = csp->headers->first->next; header != NULL; header = header->next)
+   {
+      if (header->str != NULL)
+      {
+         client_headers[n++] = header->str;
+      }
+   }
+   proxy_request.headers = client_headers;
+
+   csp->handle = proxy_interface_create(&proxy_request);
+   freez(client_headers);
    if (csp->handle == NULL)
    {
       log_error(LOG_LEVEL_ERROR, "create proxy interface failed");
       return;
    }
 
+   if (upload)
+   {
+      /*
+       * Upload the part of the body that came with
+       * the headers, the rest is read below.
+       */
+      body_bytes = (size_t)(csp->client_iob->eod - csp->client_iob->cur);
+      if (JB_ERR_OK != upload_client_body(csp, &chunks, csp->client_iob->cur, &body_bytes))
+      {
+         write_socket(csp->cfd, CLIENT_BODY_PARSE_ERROR_RESPONSE,
+            strlen(CLIENT_BODY_PARSE_ERROR_RESPONSE));
+         log_error(LOG_LEVEL_CLF,
+            "%s - - [%T] \"Failed reading client body\" 400 0", csp->ip_addr_str);
+         mark_server_socket_tainted(csp);
+         proxy_interface_destroy(csp->handle);
+         return;
+      }
+      csp->client_iob->cur += body_bytes;
+   }
+
    total_running = proxy_interface_perform(csp->handle);
 
    list_remove_all(csp->headers);
    server_body = 0;
 
-   FD_ZERO(&read_fd_set);
-   maxfd = csp->cfd;
-   FD_SET(csp->cfd, &read_fd_set);
-
    for (;;)
    {
       if (server_body && server_response_is_complete(csp, byte_count))
@@ -1893,10 +2273,59 @@ static void chat(struct client_state *csp)
          break;
       }
    
-      /* Selecting for detecting the client fd */
-      timeout.tv_sec = 0;
-      timeout.tv_usec = 0;
-      n = select(maxfd+1, &read_fd_set, NULL, NULL, &timeout);
+      FD_ZERO(&read_fd_set);
+      FD_ZERO(&write_fd_set);
+      FD_ZERO(&exc_fd_set);
+      maxfd = 0;
+
+      /*
+       * While the upload buffer is full the rest of the body
+       * stays in the client socket, so that the memory used
+       * doesn't depend on the size of the body.
+       */
+      upload_space = sizeof(buf) - 1;
+      if (upload && !(csp->flags & CSP_FLAG_CLIENT_REQUEST_COMPLETELY_READ))
+      {
+         upload_space = proxy_interface_write_space(csp->handle);
+      }
+
+      if (watch_client_socket && (upload_space > 0))
+      {
+         maxfd = csp->cfd;
+         FD_SET(csp->cfd, &read_fd_set);
+      }
+
+      if (proxy_idle)
+      {
+         /*
+          * Nothing to send to the client right now. Sleep until
+          * the client or one of the transfers has something for
+          * us, or until the transfers want to be performed anyway.
+          */
+         proxy_maxfd = -1;
+         if (proxy_interface_fdset(csp->handle, &read_fd_set,
+               &write_fd_set, &exc_fd_set, &proxy_maxfd)
+          || proxy_interface_timeout(csp->handle, &wait_ms))
+         {
+            log_error(LOG_LEVEL_ERROR, "Getting the transfer state failed");
+            mark_server_socket_tainted(csp);
+            break;
+         }
+         if (proxy_maxfd > maxfd)
+         {
+            maxfd = proxy_maxfd;
+         }
+         timeout.tv_sec = wait_ms / 1000;
+         timeout.tv_usec = (wait_ms % 1000) * 1000;
+      }
+      else
+      {
+         /* There may be more data ready, don't wait for anything */
+         timeout.tv_sec = 0;
+         timeout.tv_usec = 0;
+      }
+
+      n = select(maxfd+1, &read_fd_set, &write_fd_set, &exc_fd_set, &timeout);
       if (n < 0)
       {
          log_error(LOG_LEVEL_ERROR, "select() failed!: %E");
@@ -1922,6 +2351,7 @@ static void chat(struct client_state *csp)
                   "Stopping to watch the client socket %d. "
                   "There's already another request waiting.",
                   csp->cfd);
+               watch_client_socket = 0;
                continue;
             }
             /*
@@ -1948,6 +2378,10 @@ static void chat(struct client_state *csp)
          }
          assert(max_bytes_to_read < sizeof(buf));
 #endif /* def FEATURE_CONNECTION_KEEP_ALIVE */
+         if (max_bytes_to_read > (int)upload_space)
+         {
+            max_bytes_to_read = (int)upload_space;
+         }
 
          len = read_socket(csp->cfd, buf, max_bytes_to_read);
 
@@ -1976,8 +2410,25 @@ static void chat(struct client_state *csp)
          }
 #endif /* def FEATURE_CONNECTION_KEEP_ALIVE */
 
-         // TODO: process the client msg and handle
-         
+         if (upload)
+         {
+            body_bytes = (size_t)len;
+            if (JB_ERR_OK != upload_client_body(csp, &chunks, buf, &body_bytes))
+            {
+               mark_server_socket_tainted(csp);
+               break;
+            }
+            if ((body_bytes < (size_t)len)
+               && add_to_iob(csp->client_iob, csp->config->buffer_limit,
+                  buf + body_bytes, len - (long)body_bytes))
+            {
+               log_error(LOG_LEVEL_ERROR,
+                  "Out of memory keeping the request after the client body.");
+               mark_server_socket_tainted(csp);
+               break;
+            }
+         }
+
          continue;
       }
 
@@ -1988,7 +2439,43 @@ static void chat(struct client_state *csp)
          }
       }
 
-      len = proxy_interface_read(csp->handle, buf, sizeof(buf)-1);
+      if (splice_body)
+      {
+         /*
+          * Nothing to filter, let the kernel move the body
+          * from the server socket to the client.
+          */
+         len = proxy_interface_splice(csp->handle, csp->cfd);
+         if (len < 0)
+         {
+            log_error(LOG_LEVEL_ERROR, "Relaying the body to the client failed");
+            mark_server_socket_tainted(csp);
+            break;
+         }
+      }
+      else if (server_body)
+      {
+         /*
+          * Hand the body straight from the proxy buffers to the
+          * client and only consume what the client has taken.
+          */
+         len = proxy_interface_peek(csp->handle, iov, SZ(iov));
+         if (len > 0)
+         {
+            len = writev(csp->cfd, iov, (int)len);
+            if (len < 0)
+            {
+               log_error(LOG_LEVEL_ERROR, "write to client failed: %E");
+               mark_server_socket_tainted(csp);
+               return;
+            }
+            proxy_interface_consume(csp->handle, (uint32_t)len);
+         }
+      }
+      else
+      {
+         len = proxy_interface_read(csp->handle, buf, sizeof(buf)-1);
+      }
       if (len < 0)
       {
          printf ("Data read failed\n");
@@ -1996,18 +2483,19 @@ static void chat(struct client_state *csp)
       }
       else if (len == 0)
       {
-         /* Data is not ready */
+         if (total_running <= 0)
+         {
+            /* Everything the transfers got has been read */
+            break;
+         }
+         /* Data is not ready, wait for the transfers */
+         proxy_idle = 1;
          continue;
       }
+      proxy_idle = 0;
 
       if (server_body)
       {
-          if (write_socket(csp->cfd, buf, (size_t)len))
-          {
-             log_error(LOG_LEVEL_ERROR, "write to client failed: %E");
-             mark_server_socket_tainted(csp);
-             return;
-          }
           byte_count += (unsigned long long)len;
       }
       else
@@ -2068,6 +2556,13 @@ static void chat(struct client_state *csp)
 
           freez(hdr);
           server_body = 1;
+
+          /*
+           * The body is relayed as it is, content filters don't
+           * apply to it on either path. Let the kernel move it if
+           * it comes from a server socket.
+           */
+          splice_body = proxy_interface_can_splice(csp->handle);
       }
    }
 
@@ -2876,6 +3371,15 @@ int main(int argc, char **argv)
    /* Initialize the CGI subsystem */
    cgi_init_error_messages();
 
+   /*
+    * Initialize the proxy interface before any client thread is started,
+    * its I/O threads are only started in listen_loop() after daemonizing.
+    */
+   if (proxy_interface_init())
+   {
+      log_error(LOG_LEVEL_FATAL, "Failed to initialize the proxy interface");
+   }
+
    /*
     * If running on unix and without the --no-daemon
     * option, become a daemon. I.e. fork, detach
@@ -3243,6 +3747,12 @@ static void listen_loop(void)
    struct configuration_spec *config;
    unsigned int active_threads = 0;
 
+   /* Threads don't survive the fork() of the daemon, start them here */
+   if (proxy_interface_start())
+   {
+      log_error(LOG_LEVEL_FATAL, "Failed to start the proxy interface");
+   }
+
    config = load_config();
 
 #ifdef FEATURE_CONNECTION_SHARING
@@ -3598,6 +4108,8 @@ static void listen_loop(void)
    freez(basedir);
 #endif
 
+   proxy_interface_uninit();
+
 #if defined(_WIN32) && !defined(_WIN_CONSOLE)
    /* Cleanup - remove taskbar icon etc. */
    TermLogWindow();
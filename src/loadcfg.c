@@ -85,6 +85,7 @@ const char loadcfg_rcs[] = "$Id: loadcfg.c,v 1.142 2014/10/18 11:27:28 fabiankei
 #include "urlmatch.h"
 #include "cgi.h"
 #include "gateway.h"
+#include "proxyinterface.h"
 
 const char loadcfg_h_rcs[] = LOADCFG_H_VERSION;
 
@@ -130,6 +131,7 @@ static struct file_list *current_configfile = NULL;
 #define hash_debug                            78263U /* "debug" */
 #define hash_default_server_timeout      2530089913U /* "default-server-timeout" */
 #define hash_deny_access                 1227333715U /* "deny-access" */
+#define hash_download_directory          1344375854U /* "download-directory" */
 #define hash_enable_edit_actions         2517097536U /* "enable-edit-actions" */
 #define hash_enable_compression          3943696946U /* "enable-compression" */
 #define hash_enable_proxy_authentication_forwarding 4040610791U /* enable-proxy-authentication-forwarding */
@@ -150,6 +152,14 @@ static struct file_list *current_configfile = NULL;
 #define hash_logdir                          422889U /* "logdir" */
 #define hash_logfile                        2114766U /* "logfile" */
 #define hash_max_client_connections      3595884446U /* "max-client-connections" */
+#define hash_media_cache_directory        381817399U /* "media-cache-directory" */
+#define hash_media_cache_size            2889090873U /* "media-cache-size" */
+#define hash_media_first_window_size     4232586046U /* "media-first-window-size" */
+#define hash_media_memory_limit          4059389430U /* "media-memory-limit" */
+#define hash_media_memory_lock           1670871424U /* "media-memory-lock" */
+#define hash_media_memory_prefault        617965278U /* "media-memory-prefault" */
+#define hash_media_read_ahead            2919587397U /* "media-read-ahead" */
+#define hash_media_window_growth         1445773249U /* "media-window-growth" */
 #define hash_permit_access               3587953268U /* "permit-access" */
 #define hash_proxy_info_url              3903079059U /* "proxy-info-url" */
 #define hash_single_threaded             4250084780U /* "single-threaded" */
@@ -221,6 +231,8 @@ static void unload_configfile (void * data)
 
    freez(config->confdir);
    freez(config->logdir);
+   freez(config->download_directory);
+   freez(config->media_cache_directory);
    freez(config->templdir);
    freez(config->hostname);
 #ifdef FEATURE_EXTERNAL_FILTERS
@@ -421,6 +433,7 @@ struct configuration_spec * load_config(void)
    unsigned long linenum = 0;
    int i;
    char *logfile = NULL;
+   ProxyInterfaceConfig proxy_config;
 
    if (!check_file_changed(current_configfile, configfile, &fs))
    {
@@ -498,6 +511,13 @@ struct configuration_spec * load_config(void)
    config->compression_level         = 1;
 #endif
    config->feature_flags            &= ~RUNTIME_FEATURE_TOLERATE_PIPELINING;
+   config->media_first_window_size   = 32 * 1024;
+   config->media_window_growth       = 2;
+   config->media_memory_limit        = 64 * 1024 * 1024;
+   config->media_memory_prefault     = 0;
+   config->media_memory_lock         = 0;
+   config->media_read_ahead          = 8192 * 1024;
+   config->media_cache_size          = 1024ULL * 1024 * 1024;
 
    configfp = fopen(configfile, "r");
    if (NULL == configfp)
@@ -795,6 +815,14 @@ struct configuration_spec * load_config(void)
             break;
 #endif /* def FEATURE_ACL */
 
+/* *************************************************************************
+ * download-directory directory-name
+ * *************************************************************************/
+         case hash_download_directory :
+            freez(config->download_directory);
+            config->download_directory = make_path(NULL, arg);
+            break;
+
 /* *************************************************************************
  * enable-edit-actions 0|1
  * *************************************************************************/
@@ -1232,6 +1260,123 @@ struct configuration_spec * load_config(void)
             }
             break;
 
+/* *************************************************************************
+ * media-cache-directory directory-name
+ * *************************************************************************/
+         case hash_media_cache_directory :
+            freez(config->media_cache_directory);
+            config->media_cache_directory = make_path(NULL, arg);
+            break;
+
+/* *************************************************************************
+ * media-cache-size n
+ * *************************************************************************/
+         case hash_media_cache_size :
+            if (*arg != '\0')
+            {
+               int media_cache_size = atoi(arg);
+               if (0 <= media_cache_size)
+               {
+                  config->media_cache_size = (unsigned long long)media_cache_size * 1024 * 1024;
+               }
+               else
+               {
+                  log_error(LOG_LEVEL_FATAL,
+                     "Invalid media-cache-size value: %s", arg);
+               }
+            }
+            break;
+
+/* *************************************************************************
+ * media-first-window-size n
+ * *************************************************************************/
+         case hash_media_first_window_size :
+            if (*arg != '\0')
+            {
+               int media_first_window_size = atoi(arg);
+               if (0 <= media_first_window_size && media_first_window_size <= 4096)
+               {
+                  config->media_first_window_size = (unsigned int)(1024 * media_first_window_size);
+               }
+               else
+               {
+                  log_error(LOG_LEVEL_FATAL,
+                     "Invalid media-first-window-size value: %s", arg);
+               }
+            }
+            break;
+
+/* *************************************************************************
+ * media-memory-limit n
+ * *************************************************************************/
+         case hash_media_memory_limit :
+            if (*arg != '\0')
+            {
+               int media_memory_limit = atoi(arg);
+               if (0 <= media_memory_limit)
+               {
+                  config->media_memory_limit = (unsigned long long)media_memory_limit * 1024 * 1024;
+               }
+               else
+               {
+                  log_error(LOG_LEVEL_FATAL,
+                     "Invalid media-memory-limit value: %s", arg);
+               }
+            }
+            break;
+
+/* *************************************************************************
+ * media-memory-lock 0|1
+ * *************************************************************************/
+         case hash_media_memory_lock :
+            config->media_memory_lock = parse_toggle_state(cmd, arg);
+            break;
+
+/* *************************************************************************
+ * media-memory-prefault 0|1
+ * *************************************************************************/
+         case hash_media_memory_prefault :
+            config->media_memory_prefault = parse_toggle_state(cmd, arg);
+            break;
+
+/* *************************************************************************
+ * media-read-ahead n
+ * *************************************************************************/
+         case hash_media_read_ahead :
+            if (*arg != '\0')
+            {
+               int media_read_ahead = atoi(arg);
+               if (0 <= media_read_ahead && media_read_ahead <= 1024 * 1024)
+               {
+                  config->media_read_ahead = (unsigned int)(1024 * media_read_ahead);
+               }
+               else
+               {
+                  log_error(LOG_LEVEL_FATAL,
+                     "Invalid media-read-ahead value: %s", arg);
+               }
+            }
+            break;
+
+/* *************************************************************************
+ * media-window-growth n
+ * *************************************************************************/
+         case hash_media_window_growth :
+            if (*arg != '\0')
+            {
+               int media_window_growth = atoi(arg);
+               if (2 <= media_window_growth && media_window_growth <= 16)
+               {
+                  config->media_window_growth = (unsigned int)media_window_growth;
+               }
+               else
+               {
+                  log_error(LOG_LEVEL_FATAL,
+                     "Invalid media-window-growth value: %s", arg);
+               }
+            }
+            break;
+
 /* *************************************************************************
  * permit-access source-ip[/significant-bits] [dest-ip[/significant-bits]]
  * *************************************************************************/
@@ -1657,6 +1802,17 @@ struct configuration_spec * load_config(void)
       log_error(LOG_LEVEL_FATAL, "Out of memory loading config - insufficient memory for config->proxy_args");
    }
 
+   proxy_config.media_first_window_size = config->media_first_window_size;
+   proxy_config.media_window_growth     = config->media_window_growth;
+   proxy_config.media_memory_limit      = config->media_memory_limit;
+   proxy_config.media_memory_prefault   = config->media_memory_prefault;
+   proxy_config.media_memory_lock       = config->media_memory_lock;
+   proxy_config.media_read_ahead        = config->media_read_ahead;
+   proxy_config.download_directory      = config->download_directory;
+   proxy_config.media_cache_directory   = config->media_cache_directory;
+   proxy_config.media_cache_size        = config->media_cache_size;
+   proxy_interface_config_set(&proxy_config);
+
    if (config->re_filterfile[0])
    {
       add_loader(load_re_filterfiles, config);
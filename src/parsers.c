@@ -3562,6 +3562,9 @@ jb_err client_x_filter(struct client_state *csp, char **header)
  *                requests gracefully and emit misleading error messages
  *                instead.
  *
+ *                The media path answers the range itself and never
+ *                filters the content, so its requests keep the header.
+ *
  * Parameters  :
  *          1  :  csp = Current client state (buffers, headers, etc...)
  *          2  :  header = On input, pointer to header to modify.
@@ -3575,7 +3578,8 @@ jb_err client_x_filter(struct client_state *csp, char **header)
 static jb_err client_range(struct client_state *csp, char **header)
 {
    if (content_filters_enabled(csp->action)
-      && (0 != strncmpic(strstr(*header, ":"), ": bytes=0-", 10)))
+      && (0 != strncmpic(strstr(*header, ":"), ": bytes=0-", 10))
+      && !request_is_accelerated(csp))
    {
       log_error(LOG_LEVEL_HEADER, "Content filtering is enabled."
          " Crunching: \'%s\' to prevent range-mismatch problems.", *header);
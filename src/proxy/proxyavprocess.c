@@ -3,13 +3,32 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <time.h>
 #include "proxyqueue.h"
 #include "proxycurlwrapper.h"
+#include "proxycurlengine.h"
+#include "proxybandwidth.h"
+#include "proxypool.h"
+#include "proxycache.h"
 #include "proxyavprocess.h"
 #include "proxylog.h"
 
-static BOOL avprocess_multi_task_build (ProxyAVProcessor *processor, uint32_t count, BOOL need_head);
-static ProxyAVBufferItem * avprocess_buffer_item_obtain (ProxyQueue * queue);
+static ProxyAVBufferItem * avprocess_buffer_item_obtain (ProxyAVProcessor * processor, uint32_t size);
+static void avprocess_buffer_item_recycle (ProxyAVProcessor * processor, ProxyAVBufferItem * item);
+static uint32_t avprocess_stream_write (ProxyAVProcessor * processor, ProxyAVSingleBuffer * single,
+    const char * content, uint32_t length);
+
+/* settings of the processors created from now on */
+static ProxyAVConfig avprocess_config = {DEFAULT_AV_RAMP_FIRST_SIZE, DEFAULT_AV_RAMP_FACTOR, \
+    DEFAULT_AV_READ_AHEAD};
+static pthread_mutex_t avprocess_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* windows being got, read by all the processors getting the same content */
+static ProxyAVShared * avprocess_shared[AV_SHARE_COUNT];
+static pthread_mutex_t avprocess_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* charged with the shared buffers, which outlive the processor getting them */
+static ProxyPoolUser avprocess_share_user;
 
 static uint32_t
 avprocess_data_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
@@ -22,12 +41,23 @@ avprocess_data_write (void * content, uint32_t size, uint32_t nmemb, void * user
   p_return_val_if_fail (content != NULL, 0);
   p_return_val_if_fail (user_data != NULL, 0);
 
+  if (buffer->processor->streaming)
+    return avprocess_stream_write (buffer->processor, buffer, content, length);
+
   if (buffer->buffer_pos >= buffer->buffer_len) {
+    if (buffer->stolen)
+      return 0;
     pri_warning ("Cannot write, buffer is full\n");
     return length;
   }
 
   free_length = buffer->buffer_len  - buffer->buffer_pos;
+  if (free_length < length && buffer->stolen) {
+    /* The rest of the piece is downloading by another single task, stop here */
+    memcpy (buffer->buffer+buffer->buffer_pos, content, free_length);
+    buffer->buffer_pos += free_length;
+    return 0;
+  }
   if (free_length < length) {
     pri_warning ("Should not happen, buffer not long enough, data will be "\
         "cut off, buffer_len = %u, buffer_pos = %u, data length = %u, free_length = %u\n", \
@@ -44,58 +74,150 @@ avprocess_data_write (void * content, uint32_t size, uint32_t nmemb, void * user
 static BOOL
 avprocess_header_end (void * content, uint32_t length)
 {
-  return (length == 2)&&(strcmp(content, "\r\n") == 0);
+  return (length == 2)&&(strncmp(content, "\r\n", 2) == 0);
 }
 
-static uint32_t
-avprocess_header_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+/**
+ * avprocess_header_value:
+ * @line: a header line
+ * @name: header name
+ *
+ * Returns: the value of the header if @line is the header @name, NULL otherwise.
+ */
+static char *
+avprocess_header_value (char * line, const char * name)
 {
-  ProxyAVProcessor *processor = user_data;
-  ProxyAVBufferItem *item;
+  size_t name_len = strlen(name);
   char * p;
-  uint32_t length = size*nmemb;
-  uint32_t free_length = 0;
-  uint32_t write_lenth;
 
-  p_return_val_if_fail (content != NULL, 0);
-  p_return_val_if_fail (user_data != NULL, 0);
+  if (strncasecmp (line, name, name_len) != 0 || line[name_len] != ':')
+    return NULL;
 
-  pri_debug ("Header line: length = %u, %s", length, (char *)content);
+  p = line + name_len + 1;
+  while (*p && isspace(*p)) p++;
 
-  if (!processor->handle.head_buf) {
-    pri_error ("No header buffer for storing data\n");
-    return length;
+  return p;
+}
+
+static void
+avprocess_header_append (ProxyAVBufferItem * item, const char * content, uint32_t length)
+{
+  uint32_t free_length = item->buffer_len - item->data_len;
+  uint32_t write_lenth = (free_length > length) ? length : free_length;
+
+  memcpy (item->buffer + item->data_len, content, write_lenth);
+  item->data_len += write_lenth;
+}
+
+/**
+ * avprocess_range_parse:
+ * @processor: processor handle
+ * @range: Range header value of the client
+ *
+ * Take a single range of @range as the part of the content to get. A
+ * suffix range or a set of ranges is not taken, the whole content is sent
+ * then, as a server may always do.
+ */
+static void
+avprocess_range_parse (ProxyAVProcessor * processor, const char * range)
+{
+  unsigned long long first;
+  unsigned long long last = 0;
+  char * end;
+
+  while (*range && isspace(*range)) range++;
+  if (strncasecmp (range, "bytes=", 6) != 0 || !isdigit(range[6]))
+    return;
+
+  first = strtoull (range + 6, &end, 10);
+  if (*end != '-')
+    return;
+  range = end + 1;
+  if (isdigit(*range)) {
+    last = strtoull (range, &end, 10);
+    if (last < first)
+      return;
+    range = end;
+    last++;
   }
+  while (*range && isspace(*range)) range++;
+  if (*range != '\0')
+    return;
+
+  processor->ranged = TRUE;
+  processor->range_start = first;
+  processor->range_end = last;
+  processor->start = first;
+  processor->read_pos = first;
+}
 
-  /* Try to get the content length */
-  if (processor->content_length == 0 && (p = strstr(content, \
-    "Content-Length:")) != NULL) {
-    while (*p && isspace(*p)) p++;
+/**
+ * avprocess_content_end:
+ * @processor: processor handle, the header got
+ *
+ * Returns: The content position after the last byte to get.
+ */
+static uint64_t
+avprocess_content_end (ProxyAVProcessor * processor)
+{
+  if (processor->range_end > 0 && processor->range_end < processor->content_length)
+    return processor->range_end;
 
-    p += 15;
+  return processor->content_length;
+}
 
-    sscanf(p , "%u", &processor->content_length);
-  }  
+/**
+ * avprocess_location_learn:
+ * @processor: processor handle
+ * @single: the single buffer which has got its response
+ *
+ * Keep the url the redirects of the processor url end at, so that the next
+ * pieces go there at once.
+ */
+static void
+avprocess_location_learn (ProxyAVProcessor * processor, ProxyAVSingleBuffer * single)
+{
+  char * url;
 
-  item = processor->handle.head_buf;
-  free_length = item->buffer_len - item->data_len;
-  write_lenth = (free_length > length) ? length : free_length;
-  memcpy (item->buffer + item->data_len, content, write_lenth);
-  item->data_len += write_lenth;
+  if (processor->location != NULL || single->located)
+    return;
 
-  /* Last line of the header data, now push header into data queue */
-  if (avprocess_header_end (content, length)) {
-    proxy_queue_push_tail(processor->data_queue, item);
-    processor->handle.head_buf = NULL;
+  if (proxy_curl_single_get_url (single->single_handle, &url) != CURL_SUCC)
+    return;
 
-    if (processor->content_length == 0) {
-      pri_warning ("Unknown content length, aborting body\n");
-      return length;
-    }
+  if (strcmp (url, processor->url) != 0) {
+    processor->location = strdup (url);
+    pri_debug ("Pieces go to %s from now on\n", url);
+  }
+}
+
+/**
+ * avprocess_piece_header:
+ *
+ * Header callback of the pieces, a piece is aborted unless it gets the
+ * range asked for.
+ */
+static uint32_t
+avprocess_piece_header (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyAVSingleBuffer * single = user_data;
+  uint32_t length = size*nmemb;
+  char line[64];
+  uint32_t line_length;
+
+  p_return_val_if_fail (content != NULL, 0);
+  p_return_val_if_fail (user_data != NULL, 0);
 
-    /* Now we can start task to download body data */
-    if (!avprocess_multi_task_build(processor, MAX_SINGLE_COUNT, FALSE)) {
-      pri_error ("Bulid multi task failed\n");
+  if (length > 5 && strncmp (content, "HTTP/", 5) == 0) {
+    line_length = (length < sizeof(line)) ? length : sizeof(line) - 1;
+    memcpy (line, content, line_length);
+    line[line_length] = '\0';
+    single->status = 0;
+    sscanf (line, "%*s %u", &single->status);
+  } else if (avprocess_header_end (content, length)) {
+    /* A redirect is followed, anything else but the range is not the content wanted */
+    if (single->status/100 != 3 && single->status != 206) {
+      pri_warning ("Piece got status %u instead of the range\n", single->status);
       return 0;
     }
   }
@@ -103,30 +225,218 @@ avprocess_header_write (void * content, uint32_t size, uint32_t nmemb, void * us
   return length;
 }
 
-static int32_t
-avprocess_header_obtain (ProxyAVProcessor * processor, char * url)
+/**
+ * avprocess_stream_start:
+ * @processor: processor handle
+ * @item: the first window item
+ * @single: the single task of the first piece
+ *
+ * Go on with the transfer of the first piece until the end of the body,
+ * writing it into a window item after another as it comes.
+ */
+static void
+avprocess_stream_start (ProxyAVProcessor * processor, ProxyAVBufferItem * item,
+    ProxyAVSingleBuffer * single)
 {
-  ProxyAVBufferItem * item;
+  pri_debug ("Streaming the body, length %llu\n", (unsigned long long)processor->content_length);
 
-  p_return_val_if_fail (processor != NULL, CURL_FAIL);
-  p_return_val_if_fail (url != NULL, CURL_FAIL);
+  processor->streaming = TRUE;
+  processor->start = 0;
+  processor->read_pos = 0;
+  item->start = 0;
+
+  /* Nothing of the body has been received yet */
+  item->data_len = 0;
+  item->piece_size = item->buffer_len;
+  item->piece_next = 0;
+  single->buffer_len = item->buffer_len;
+  single->buffer_pos = 0;
+}
+
+/**
+ * avprocess_head_done:
+ * @processor: processor handle
+ *
+ * The header of the first piece is got, size the first window to what the
+ * origin really sends on it. The body is streamed if its length is unknown
+ * or it does not fit the first window of an origin ignoring the range, which
+ * sends the whole content even if the client asked for a range.
+ *
+ * Returns: TRUE on success and FALSE if the body cannot be handled.
+ */
+static BOOL
+avprocess_head_done (ProxyAVProcessor * processor)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item = handle->window[handle->window_head];
+  ProxyAVSingleBuffer * single = &handle->singles[0];
+  char if_range[256];
+  uint32_t length;
+
+  /* The range asked for is all that comes, the rest cannot be got by pieces */
+  if (processor->status == 206 && processor->content_length == 0) {
+    pri_warning ("Range of unknown content length, aborting body\n");
+    return FALSE;
+  }
+
+  if (processor->status == 206) {
+    processor->end = avprocess_content_end (processor);
+    if (item->start >= processor->end) {
+      pri_warning ("Range beyond the content length, aborting body\n");
+      return FALSE;
+    }
+    length = item->data_len;
+    if (processor->end - item->start < length)
+      length = (uint32_t)(processor->end - item->start);
+
+    /* The other pieces skip the redirects and must get the same content */
+    avprocess_location_learn (processor, single);
+    if (processor->etag[0] != '\0' || processor->last_modified[0] != '\0') {
+      snprintf (if_range, sizeof(if_range), "If-Range: %s", \
+          processor->etag[0] != '\0' ? processor->etag : processor->last_modified);
+      processor->piece_headers = proxy_curl_header_list_append (NULL, if_range);
+
+      /* The first piece has told the content is still the one cached */
+      processor->cache = proxy_cache_open (processor->url, \
+          processor->etag[0] != '\0' ? processor->etag : processor->last_modified, \
+          processor->content_length);
+    }
+  } else {
+    /* The origin ignores the range, the whole body comes on the first piece */
+    processor->end = processor->content_length;
+    processor->read_pos = 0;
+    item->start = 0;
+    if (processor->content_length == 0 || processor->content_length > item->buffer_len) {
+      avprocess_stream_start (processor, item, single);
+      return TRUE;
+    }
+    length = (uint32_t)processor->content_length;
+  }
+
+  item->data_len = length;
+  item->piece_size = length;
+  item->piece_next = length;
+  single->buffer_len = length;
+  processor->start = item->start + length;
+
+  return TRUE;
+}
+
+/**
+ * avprocess_header_write:
+ *
+ * Header callback of the first piece. The header is handed to the client as
+ * the answer of a request for the whole content, so a partial content status
+ * is turned into 200 and the content length becomes the complete one, unless
+ * the client asked for a range itself and gets the content range of it. The
+ * headers of redirect responses are dropped, and so is the transfer coding
+ * which curl takes off the body.
+ */
+static uint32_t
+avprocess_header_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyAVProcessor *processor = user_data;
+  ProxyAVBufferItem *item;
+  char line[1024];
+  char status_line[64];
+  char * value;
+  unsigned long long total;
+  uint32_t length = size*nmemb;
+  uint32_t line_length;
+
+  p_return_val_if_fail (content != NULL, 0);
+  p_return_val_if_fail (user_data != NULL, 0);
 
+  /* The header has already been got, the single task now carries other pieces */
   if (!processor->handle.head_buf) {
-    item = avprocess_buffer_item_obtain(processor->mem_queue);
-    if (item == NULL) {
-      pri_error ("Malloc buffer item failed\n");
-      return CURL_FAIL;
+    return length;
+  }
+  item = processor->handle.head_buf;
+
+  line_length = (length < sizeof(line)) ? length : sizeof(line) - 1;
+  memcpy (line, content, line_length);
+  line[line_length] = '\0';
+  pri_debug ("Header line: length = %u, %s", length, line);
+
+  /* Shoutcast servers answer with an ICY status line */
+  if (strncmp (line, "HTTP/", 5) == 0 || strncmp (line, "ICY ", 4) == 0) {
+    /* A new response begins, forget the one redirected from */
+    item->data_len = 0;
+    processor->status = 0;
+    processor->redirect = FALSE;
+    processor->content_length = 0;
+    processor->etag[0] = '\0';
+    processor->last_modified[0] = '\0';
+    sscanf (line, "%*s %u", &processor->status);
+
+    if (processor->status == 206) {
+      snprintf (status_line, sizeof(status_line), "%.*s %s\r\n", \
+          (int)strcspn(line, " "), line, processor->ranged ? "206 Partial Content" : "200 OK");
+      avprocess_header_append (item, status_line, (uint32_t)strlen(status_line));
+      return length;
     }
-    processor->handle.head_buf = item;  
+  } else if ((value = avprocess_header_value (line, "Content-Range")) != NULL) {
+    if (sscanf (value, "bytes %*[0-9]-%*[0-9]/%llu", &total) != 1)
+      total = 0;
+    processor->content_length = total;
+    return length;
+  } else if ((value = avprocess_header_value (line, "Content-Length")) != NULL) {
+    if (processor->status != 206 && sscanf (value, "%llu", &total) == 1)
+      processor->content_length = total;
+    return length;
+  } else if (avprocess_header_value (line, "Transfer-Encoding") != NULL) {
+    return length;
+  } else if (avprocess_header_value (line, "Location") != NULL) {
+    processor->redirect = TRUE;
+  } else if ((value = avprocess_header_value (line, "ETag")) != NULL) {
+    /* A weak validator cannot be used for a range */
+    if (strncmp (value, "W/", 2) != 0)
+      snprintf (processor->etag, sizeof(processor->etag), "%.*s", \
+          (int)strcspn(value, "\r\n"), value);
+  } else if ((value = avprocess_header_value (line, "Last-Modified")) != NULL) {
+    snprintf (processor->last_modified, sizeof(processor->last_modified), "%.*s", \
+        (int)strcspn(value, "\r\n"), value);
   }
-  
-  if (proxy_curl_single_obtain_header (url, avprocess_header_write, \
-    processor) != CURL_SUCC) {
-    pri_error ("Getting header failed\n");
-    return CURL_FAIL;
-  }  
 
-  return CURL_SUCC;
+  if (!avprocess_header_end (content, length)) {
+    avprocess_header_append (item, content, length);
+    return length;
+  }
+
+  /* The end of a redirect response, the followed one comes next */
+  if (processor->redirect && processor->status/100 == 3) {
+    return length;
+  }
+
+  /* Last line of the header data, now push header into data queue */
+  if (processor->ranged && processor->status == 206) {
+    if (processor->range_start < avprocess_content_end (processor)) {
+      snprintf (line, sizeof(line), "Content-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n", \
+          (unsigned long long)processor->range_start, \
+          (unsigned long long)avprocess_content_end (processor) - 1, \
+          (unsigned long long)processor->content_length, \
+          (unsigned long long)(avprocess_content_end (processor) - processor->range_start));
+      avprocess_header_append (item, line, (uint32_t)strlen(line));
+    }
+  } else if (processor->content_length > 0) {
+    snprintf (line, sizeof(line), "Content-Length: %llu\r\n", \
+        (unsigned long long)processor->content_length);
+    avprocess_header_append (item, line, (uint32_t)strlen(line));
+  }
+  avprocess_header_append (item, content, length);
+  if (!proxy_queue_push_tail(processor->data_queue, item)) {
+    pri_error ("Data queue full, cannot hand out the header\n");
+    processor->failed = TRUE;
+    return 0;
+  }
+  processor->handle.head_buf = NULL;
+
+  if (!avprocess_head_done (processor)) {
+    processor->failed = TRUE;
+    return 0;
+  }
+
+  return length;
 }
 
 static void
@@ -138,32 +448,171 @@ avprocess_init (ProxyAVProcessor * processor)
   p_return_if_fail (processor != NULL);
 
   processor->url = NULL;
+  processor->location = NULL;
+  processor->etag[0] = '\0';
+  processor->last_modified[0] = '\0';
+  processor->piece_headers = NULL;
   processor->content_length = 0;
+  processor->ranged = FALSE;
+  processor->range_start = 0;
+  processor->range_end = 0;
+  processor->end = 0;
   processor->start = 0;
+  processor->read_pos = 0;
+  processor->paused = FALSE;
+  processor->status = 0;
+  processor->redirect = FALSE;
+  processor->failed = FALSE;
+  processor->streaming = FALSE;
+  processor->stream_paused = FALSE;
+  processor->cache = NULL;
+  processor->tail = NULL;
   
   processor->data_queue = proxy_queue_new();
   processor->mem_queue = proxy_queue_new();
   processor->data = NULL;
+  proxy_pool_user_join (&processor->pool_user);
   
   processor->func = NULL;
   processor->user_data = NULL;  
 
+  /* init the tuner, start from the defaults until something is measured */
+  processor->tuner.single_limit = DEFAULT_SINGLE_COUNT;
+  processor->tuner.window_size = DEFAULT_AV_BUFFER_SIZE;
+  processor->tuner.ramp_size = 0;
+  processor->tuner.last_change = 0;
+  processor->tuner.settled = 0;
+  processor->tuner.probe_down = TRUE;
+  processor->tuner.rate = 0;
+  processor->tuner.piece_rate = 0;
+  processor->tuner.rtt = 0;
+  processor->tuner.period_start = 0;
+  processor->tuner.period_bytes = 0;
+  processor->tuner.recv_bytes = 0;
+
   /* init the handle */
+  processor->handle.session = NULL;
   processor->handle.multi = 0;
   processor->handle.head_buf = NULL;
-  processor->handle.data_buf = NULL;
+  processor->handle.window_head = 0;
+  processor->handle.window_count = 0;
+  for (count = 0; count < AV_WINDOW_COUNT; count++) {
+    processor->handle.window[count] = NULL;
+  }
   processor->handle.single_count = 0;
   for (count = 0; count < MAX_SINGLE_COUNT; count++) {
     single = &processor->handle.singles[count];
     single->single_handle = 0;
+    single->processor = processor;
+    single->item = NULL;
     single->buffer = NULL;
     single->buffer_len = 0;
     single->buffer_pos = 0;
+    single->stolen = FALSE;
+    single->located = FALSE;
+    single->status = 0;
+    single->waiting = FALSE;
+    single->retries = 0;
+    single->retry_at = 0;
+  }
+}
+
+/**
+ * avprocess_share_validator:
+ * @processor: processor handle, the header got
+ *
+ * Returns: The validator telling the content apart, empty if none.
+ */
+static const char *
+avprocess_share_validator (ProxyAVProcessor *processor)
+{
+  return processor->etag[0] != '\0' ? processor->etag : processor->last_modified;
+}
+
+static void
+avprocess_share_free (ProxyAVShared *shared)
+{
+  proxy_pool_free (shared->pool_user, shared->buffer, shared->buffer_len);
+  free (shared->url);
+  free (shared);
+}
+
+/**
+ * avprocess_share_release:
+ * @item: the window item holding a shared buffer
+ *
+ * Drop the hold of @item on its shared buffer, the buffer goes back to the
+ * pool with the last hold. The processors reading the window get it
+ * themselves if the processor getting it drops it before it is done.
+ */
+static void
+avprocess_share_release (ProxyAVBufferItem *item)
+{
+  ProxyAVShared * shared = item->shared;
+  BOOL last;
+  uint32_t i;
+
+  pthread_mutex_lock (&avprocess_share_lock);
+  if (!item->borrowed && !shared->done)
+    shared->failed = TRUE;
+
+  /* A window never got is not worth keeping */
+  if (shared->failed && shared->kept_until > 0) {
+    shared->kept_until = 0;
+    shared->refs--;
   }
+  last = (--shared->refs == 0);
+  if (last) {
+    for (i = 0; i < AV_SHARE_COUNT; i++) {
+      if (avprocess_shared[i] == shared)
+        avprocess_shared[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock (&avprocess_share_lock);
+
+  if (last)
+    avprocess_share_free (shared);
+  item->shared = NULL;
+  item->borrowed = FALSE;
+}
+
+/**
+ * avprocess_share_state:
+ * @item: the window item holding a shared buffer
+ * @failed: where to store whether getting the window has failed, or NULL
+ *
+ * Returns: TRUE if the whole window has been received.
+ */
+static BOOL
+avprocess_share_state (ProxyAVBufferItem *item, BOOL * failed)
+{
+  BOOL done;
+
+  pthread_mutex_lock (&avprocess_share_lock);
+  done = item->shared->done;
+  if (failed != NULL)
+    *failed = item->shared->failed;
+  pthread_mutex_unlock (&avprocess_share_lock);
+
+  return done;
+}
+
+/**
+ * avprocess_share_done:
+ * @item: the window item getting a shared buffer
+ *
+ * The whole window has been received, the processors reading it can go on.
+ */
+static void
+avprocess_share_done (ProxyAVBufferItem *item)
+{
+  pthread_mutex_lock (&avprocess_share_lock);
+  item->shared->done = TRUE;
+  pthread_mutex_unlock (&avprocess_share_lock);
 }
 
 static ProxyAVBufferItem *
-avprocess_buffer_item_malloc (uint32_t size)
+avprocess_buffer_item_malloc (void)
 {
   ProxyAVBufferItem * item;
   
@@ -173,236 +622,1750 @@ avprocess_buffer_item_malloc (uint32_t size)
     return NULL;
   }
 
-  item->buffer = malloc (size);
+  item->buffer = NULL;
+  item->buffer_len = 0; 
+  item->map = NULL;
+  item->map_len = 0;
+  item->shared = NULL;
+  item->borrowed = FALSE;
+  
+  return item;
+}
+
+static void
+avprocess_buffer_item_free (ProxyAVProcessor * processor, ProxyAVBufferItem * item)
+{
+  p_return_if_fail (item != NULL);
+
+  if (item->map) {
+    proxy_cache_unmap (item->map, item->map_len);
+    item->map = NULL;
+  } else if (item->shared) {
+    avprocess_share_release (item);
+  } else if (item->buffer) {
+    proxy_pool_free (&processor->pool_user, item->buffer, item->buffer_len);
+  }
+  item->buffer = NULL;
+
+  free (item);
+}
+
+/**
+ * avprocess_buffer_item_obtain:
+ * @processor: processor handle
+ * @size: bytes the buffer must hold
+ *
+ * Get a buffer item with a buffer taken from the process-wide pool.
+ *
+ * Returns: The buffer item, NULL if no buffer can be had now.
+ */
+static ProxyAVBufferItem *
+avprocess_buffer_item_obtain (ProxyAVProcessor * processor, uint32_t size)
+{
+  ProxyAVBufferItem * item;
+
+  item = proxy_queue_pop_head (processor->mem_queue);
+  if (item == NULL && (item = avprocess_buffer_item_malloc ()) == NULL)
+    return NULL;
+
+  item->buffer = proxy_pool_alloc (&processor->pool_user, size, &item->buffer_len);
   if (item->buffer == NULL) {
-    pri_error ("Data cach malloc failed\n");
-    goto error_out;
+    if (!proxy_queue_push_tail (processor->mem_queue, item))
+      free (item);
+    return NULL;
   }
-  item->buffer_len = size; 
   item->data_len = 0;
   item->offset = 0;
-  
+  item->start = 0;
+  item->piece_size = 0;
+  item->piece_next = 0;
+  item->piece_running = 0;
+  item->map = NULL;
+  item->map_len = 0;
+  item->shared = NULL;
+  item->borrowed = FALSE;
+
   return item;
-error_out:
-  if (item) free (item);
-  return NULL;
 }
 
+/**
+ * avprocess_buffer_item_recycle:
+ * @processor: processor handle
+ * @item: the buffer item done with
+ *
+ * Give the buffer back to the pool at once so that other sessions can use
+ * it, and keep the buffer item for the next window.
+ */
+static void
+avprocess_buffer_item_recycle (ProxyAVProcessor * processor, ProxyAVBufferItem * item)
+{
+  if (item->map) {
+    proxy_cache_unmap (item->map, item->map_len);
+    item->map = NULL;
+  } else if (item->shared) {
+    avprocess_share_release (item);
+  } else {
+    proxy_pool_free (&processor->pool_user, item->buffer, item->buffer_len);
+  }
+  item->buffer = NULL;
+  item->buffer_len = 0;
+  if (!proxy_queue_push_tail (processor->mem_queue, item))
+    free (item);
+}
+
+static double
+avprocess_time_now (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (double)now.tv_sec + (double)now.tv_nsec/1000000000.0;
+}
+
+/**
+ * avprocess_window_cached:
+ * @processor: processor handle
+ * @cached: length of the content cached from the next start position
+ *
+ * Open a window on the content cached on disk, it is mapped and complete
+ * at once. The cache is given up if it cannot be mapped.
+ *
+ * Returns: The opened window item, NULL if the window is to be got from
+ * the network.
+ */
+static ProxyAVBufferItem *
+avprocess_window_cached (ProxyAVProcessor *processor, uint64_t cached)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item;
+  uint32_t length = AV_CACHE_WINDOW_SIZE;
+
+  if (cached < length)
+    length = (uint32_t)cached;
+  if (processor->end - processor->start < length)
+    length = (uint32_t)(processor->end - processor->start);
+
+  item = proxy_queue_pop_head (processor->mem_queue);
+  if (item == NULL && (item = avprocess_buffer_item_malloc ()) == NULL)
+    return NULL;
+
+  item->buffer = proxy_cache_map (processor->cache, processor->start, length, \
+      &item->map, &item->map_len);
+  if (item->buffer == NULL) {
+    if (!proxy_queue_push_tail (processor->mem_queue, item))
+      free (item);
+    proxy_cache_close (processor->cache);
+    processor->cache = NULL;
+    return NULL;
+  }
+
+  /* Nothing to download, the whole window is ready to read */
+  item->buffer_len = length;
+  item->data_len = length;
+  item->offset = 0;
+  item->start = processor->start;
+  item->piece_size = length;
+  item->piece_next = length;
+  item->piece_running = 0;
+
+  handle->window[(handle->window_head + handle->window_count) % AV_WINDOW_COUNT] = item;
+  handle->window_count++;
+  processor->start += length;
+
+  pri_debug ("Open cached window from pos %llu, length is %u\n", \
+      (unsigned long long)item->start, length);
+
+  return item;
+}
+
+/**
+ * avprocess_share_expire:
+ *
+ * Let the table drop the windows kept longer than they are waited for,
+ * the share lock held.
+ */
+static void
+avprocess_share_expire (void)
+{
+  ProxyAVShared * shared;
+  double now = avprocess_time_now ();
+  uint32_t i;
+
+  for (i = 0; i < AV_SHARE_COUNT; i++) {
+    shared = avprocess_shared[i];
+    if (shared == NULL || shared->kept_until == 0 || now < shared->kept_until)
+      continue;
+
+    shared->kept_until = 0;
+    if (--shared->refs == 0) {
+      avprocess_shared[i] = NULL;
+      avprocess_share_free (shared);
+    }
+  }
+}
+
+/**
+ * avprocess_share_keep:
+ * @item: the window item just published
+ *
+ * Let the table hold the shared window for %AV_TAIL_KEEP_TIME seconds, so
+ * that a processor created once the one getting it is gone still reads it.
+ */
+static void
+avprocess_share_keep (ProxyAVBufferItem *item)
+{
+  ProxyAVShared * shared = item->shared;
+
+  pthread_mutex_lock (&avprocess_share_lock);
+  if (shared->pool_user != &avprocess_share_user) {
+    proxy_pool_hand_over (shared->pool_user, &avprocess_share_user, shared->buffer_len);
+    shared->pool_user = &avprocess_share_user;
+  }
+  shared->refs++;
+  shared->kept_until = avprocess_time_now () + AV_TAIL_KEEP_TIME;
+  pthread_mutex_unlock (&avprocess_share_lock);
+}
+
+/**
+ * avprocess_share_find:
+ * @processor: processor handle, the header got
+ * @start: content position
+ *
+ * Find the shared window of the content holding @start, the share lock held.
+ *
+ * Returns: The shared window, NULL if none.
+ */
+static ProxyAVShared *
+avprocess_share_find (ProxyAVProcessor *processor, uint64_t start)
+{
+  const char * validator = avprocess_share_validator (processor);
+  ProxyAVShared * shared;
+  uint32_t i;
+
+  if (validator[0] == '\0')
+    return NULL;
+
+  for (i = 0; i < AV_SHARE_COUNT; i++) {
+    shared = avprocess_shared[i];
+    if (shared != NULL && !shared->failed && shared->start <= start
+        && start < shared->start + shared->length
+        && strcmp (shared->validator, validator) == 0
+        && strcmp (shared->url, processor->url) == 0)
+      return shared;
+  }
+
+  return NULL;
+}
+
+/**
+ * avprocess_share_publish:
+ * @processor: processor handle, the header got
+ * @item: the window item just opened, no piece of it started yet
+ *
+ * Let the other processors getting the same content read the window
+ * instead of getting it again. Nothing is shared if the table is full.
+ */
+static void
+avprocess_share_publish (ProxyAVProcessor *processor, ProxyAVBufferItem *item)
+{
+  const char * validator = avprocess_share_validator (processor);
+  ProxyAVShared * shared;
+  uint32_t i;
+
+  /* The same url may give another content, only a validator tells */
+  if (validator[0] == '\0')
+    return;
+
+  if ((shared = malloc (sizeof(ProxyAVShared))) == NULL) {
+    pri_error ("malloc shared window failed\n");
+    return;
+  }
+  if ((shared->url = strdup (processor->url)) == NULL) {
+    pri_error ("malloc shared window failed\n");
+    free (shared);
+    return;
+  }
+  snprintf (shared->validator, sizeof(shared->validator), "%s", validator);
+  shared->start = item->start;
+  shared->length = item->data_len;
+  shared->buffer = item->buffer;
+  shared->buffer_len = item->buffer_len;
+  shared->pool_user = &processor->pool_user;
+  shared->refs = 1;
+  shared->kept_until = 0;
+  shared->done = FALSE;
+  shared->failed = FALSE;
+
+  pthread_mutex_lock (&avprocess_share_lock);
+  avprocess_share_expire ();
+  for (i = 0; i < AV_SHARE_COUNT; i++) {
+    if (avprocess_shared[i] == NULL) {
+      avprocess_shared[i] = shared;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&avprocess_share_lock);
+
+  if (i == AV_SHARE_COUNT) {
+    free (shared->url);
+    free (shared);
+    return;
+  }
+  item->shared = shared;
+}
+
+/**
+ * avprocess_share_attach:
+ * @processor: processor handle, the header got
+ *
+ * Open a window on the buffer of another processor getting the same
+ * content from the next start position. The window ends where the other
+ * one does, so that the next windows of both start at the same place.
+ *
+ * Returns: The opened window item, NULL if the window is to be got.
+ */
+static ProxyAVBufferItem *
+avprocess_share_attach (ProxyAVProcessor *processor)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVShared * shared;
+  ProxyAVBufferItem * item;
+  uint32_t offset;
+  uint32_t length;
+
+  pthread_mutex_lock (&avprocess_share_lock);
+  avprocess_share_expire ();
+  if ((shared = avprocess_share_find (processor, processor->start)) == NULL) {
+    pthread_mutex_unlock (&avprocess_share_lock);
+    return NULL;
+  }
+
+  item = proxy_queue_pop_head (processor->mem_queue);
+  if (item == NULL && (item = avprocess_buffer_item_malloc ()) == NULL) {
+    pthread_mutex_unlock (&avprocess_share_lock);
+    return NULL;
+  }
+
+  /* The buffer may outlive the processor getting it from now on */
+  if (shared->pool_user != &avprocess_share_user) {
+    proxy_pool_hand_over (shared->pool_user, &avprocess_share_user, shared->buffer_len);
+    shared->pool_user = &avprocess_share_user;
+  }
+  shared->refs++;
+  pthread_mutex_unlock (&avprocess_share_lock);
+
+  /* The range of the client may end inside the window */
+  offset = (uint32_t)(processor->start - shared->start);
+  length = shared->length - offset;
+  if (processor->end - processor->start < length)
+    length = (uint32_t)(processor->end - processor->start);
+  item->buffer = shared->buffer + offset;
+  item->buffer_len = shared->length - offset;
+  item->data_len = length;
+  item->offset = 0;
+  item->start = processor->start;
+  item->piece_size = item->data_len;
+  item->piece_next = item->data_len;
+  item->piece_running = 0;
+  item->shared = shared;
+  item->borrowed = TRUE;
+
+  handle->window[(handle->window_head + handle->window_count) % AV_WINDOW_COUNT] = item;
+  handle->window_count++;
+  processor->start += item->data_len;
+
+  pri_debug ("Open shared window from pos %llu, length is %u\n", \
+      (unsigned long long)item->start, item->data_len);
+
+  return item;
+}
+
+/**
+ * avprocess_share_wait:
+ * @processor: processor handle
+ * @item: a borrowed window item
+ *
+ * Tell whether the processor getting the window has got it all. If it
+ * has stopped before, the window is taken over and got like the others.
+ *
+ * Returns: TRUE if the whole window has been received.
+ */
+static BOOL
+avprocess_share_wait (ProxyAVProcessor *processor, ProxyAVBufferItem *item)
+{
+  uint32_t buffer_len;
+  uint32_t count;
+  BOOL failed;
+  char * buffer;
+
+  if (avprocess_share_state (item, &failed))
+    return TRUE;
+  if (!failed)
+    return FALSE;
+
+  /* Keep waiting on it until a buffer of our own can be had */
+  if ((buffer = proxy_pool_alloc (&processor->pool_user, item->data_len, &buffer_len)) == NULL)
+    return FALSE;
+  avprocess_share_release (item);
+
+  count = item->data_len/MIN_AV_PIECE_SIZE;
+  if (count > processor->tuner.single_limit) {
+    count = processor->tuner.single_limit;
+  } else if (count == 0) {
+    count = 1;
+  }
+  item->buffer = buffer;
+  item->buffer_len = buffer_len;
+  item->piece_size = item->data_len/count;
+  item->piece_next = 0;
+  item->piece_running = 0;
+  pri_debug ("Shared window from pos %llu failed, getting it again\n", \
+      (unsigned long long)item->start);
+
+  return FALSE;
+}
+
+/**
+ * avprocess_share_pending:
+ * @processor: processor handle
+ *
+ * Returns: TRUE if a borrowed window is waiting for another processor.
+ */
+static BOOL
+avprocess_share_pending (ProxyAVProcessor *processor)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item;
+  uint32_t i;
+
+  for (i = 0; i < handle->window_count; i++) {
+    item = handle->window[(handle->window_head + i) % AV_WINDOW_COUNT];
+    if (item->borrowed && !avprocess_share_state (item, NULL))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+ * avprocess_moov_after:
+ * @buffer: the start of the content
+ * @length: length of @buffer
+ * @tail_start: where to store the content position after the media data
+ *
+ * Walk the top level boxes of an MP4 content. A player needs the movie box
+ * before it plays anything, so one after the media data makes it seek to
+ * the end first and then back.
+ *
+ * Returns: TRUE if the media data comes before the movie box.
+ */
+static BOOL
+avprocess_moov_after (const unsigned char * buffer, uint32_t length, uint64_t * tail_start)
+{
+  const unsigned char * box;
+  uint64_t pos = 0;
+  uint64_t size;
+  uint32_t head;
+  uint32_t i;
+
+  /* The file type box comes first */
+  if (length < 8 || memcmp (buffer + 4, "ftyp", 4) != 0)
+    return FALSE;
+
+  while (pos + 8 <= length) {
+    box = buffer + pos;
+    size = (uint64_t)box[0] << 24 | (uint64_t)box[1] << 16 | (uint64_t)box[2] << 8 | box[3];
+    head = 8;
+
+    /* A large size follows the type, a size of 0 runs to the end */
+    if (size == 1) {
+      if (pos + 16 > length)
+        return FALSE;
+      size = 0;
+      for (i = 8; i < 16; i++)
+        size = size << 8 | box[i];
+      head = 16;
+    }
+    if (size < head || size > UINT64_MAX - pos)
+      return FALSE;
+
+    if (memcmp (box + 4, "moov", 4) == 0)
+      return FALSE;
+    if (memcmp (box + 4, "mdat", 4) == 0) {
+      *tail_start = pos + size;
+      return TRUE;
+    }
+    pos += size;
+  }
+
+  return FALSE;
+}
+
+/**
+ * avprocess_tail_start:
+ * @processor: processor handle, the header got
+ * @item: the window at the start of the content, received done
+ *
+ * Prefetch the tail of an MP4 content with the movie box at the end while
+ * the player reads the start. The tail is shared and kept once got, so the
+ * seek of the player to the end, by the next processor, reads it from
+ * memory.
+ */
+static void
+avprocess_tail_start (ProxyAVProcessor *processor, ProxyAVBufferItem *item)
+{
+  ProxyAVBufferItem * tail;
+  uint64_t tail_start;
+  uint32_t length;
+  uint32_t count;
+  BOOL shared;
+
+  if (processor->tail != NULL || processor->status != 206 || processor->streaming)
+    return;
+
+  /* Nothing to seek to first, or the windows are getting the tail already */
+  if (!avprocess_moov_after ((const unsigned char *)item->buffer, item->data_len, &tail_start)
+      || tail_start < processor->start || tail_start >= processor->content_length)
+    return;
+
+  length = AV_TAIL_MAX_SIZE;
+  if (processor->content_length - tail_start < length)
+    length = (uint32_t)(processor->content_length - tail_start);
+
+  /* Another processor has got it or is getting it */
+  pthread_mutex_lock (&avprocess_share_lock);
+  shared = (avprocess_share_find (processor, tail_start) != NULL);
+  pthread_mutex_unlock (&avprocess_share_lock);
+  if (shared)
+    return;
+
+  if ((tail = avprocess_buffer_item_obtain (processor, length)) == NULL) {
+    pri_debug ("No buffer for the tail now\n");
+    return;
+  }
+
+  count = length/MIN_AV_PIECE_SIZE;
+  if (count > processor->tuner.single_limit) {
+    count = processor->tuner.single_limit;
+  } else if (count == 0) {
+    count = 1;
+  }
+  tail->data_len = length;
+  tail->start = tail_start;
+  tail->piece_size = length/count;
+
+  /* Only the next processor reads the tail, it is no use unless shared */
+  avprocess_share_publish (processor, tail);
+  if (tail->shared == NULL) {
+    avprocess_buffer_item_recycle (processor, tail);
+    return;
+  }
+  avprocess_share_keep (tail);
+  processor->tail = tail;
+
+  pri_debug ("Movie box after the media data, prefetch tail from pos %llu, length is %u\n", \
+      (unsigned long long)tail_start, length);
+}
+
+/**
+ * avprocess_window_open:
+ * @processor: processor handle
+ *
+ * Open a new window item for the next part data if the window is not full.
+ *
+ * Returns: The opened window item, NULL if no more window can be opened.
+ */
+static ProxyAVBufferItem *
+avprocess_window_open (ProxyAVProcessor *processor)
+{
+  ProxyAVTaskHandle * handle;
+  ProxyAVBufferItem * item;
+  uint32_t window_size;
+  uint32_t download_length;
+  uint32_t buffer_length;
+  uint32_t count;
+  uint64_t cached;
+
+  p_return_val_if_fail (processor != NULL, NULL);
+
+  handle = &processor->handle;
+  if (handle->window_count >= AV_WINDOW_COUNT)
+    return NULL;
+
+  /* All the content has been scheduled */
+  if (processor->end > 0 && processor->start >= processor->end)
+    return NULL;
+
+  /* Flow control, a paused or slow player must not make the whole content downloaded */
+  if (processor->config.read_ahead > 0
+      && processor->start - processor->read_pos >= processor->config.read_ahead) {
+    if (!processor->paused)
+      pri_debug ("Pause at %llu, reader at %llu\n", (unsigned long long)processor->start, \
+          (unsigned long long)processor->read_pos);
+    processor->paused = TRUE;
+    return NULL;
+  }
+  processor->paused = FALSE;
+
+  /* The content seen before is read back from the disk */
+  if (processor->cache != NULL
+      && (cached = proxy_cache_cached (processor->cache, processor->start)) > 0
+      && (item = avprocess_window_cached (processor, cached)) != NULL)
+    return item;
+
+  /* Another processor is getting the same content from here */
+  if (processor->handle.head_buf == NULL
+      && (item = avprocess_share_attach (processor)) != NULL)
+    return item;
+
+  /* Slow start, the windows grow from a small one until the full window size
+   * so the reader gets the first data as soon as possible */
+  window_size = processor->tuner.window_size;
+  if (processor->tuner.ramp_size > 0 && processor->tuner.ramp_size < window_size) {
+    window_size = processor->tuner.ramp_size;
+    if (processor->config.ramp_factor > 1
+        && window_size <= processor->tuner.window_size/processor->config.ramp_factor) {
+      processor->tuner.ramp_size *= processor->config.ramp_factor;
+    } else {
+      processor->tuner.ramp_size = 0;
+    }
+  } else {
+    processor->tuner.ramp_size = 0;
+  }
+
+  /* calculating how many data we wil download in this window, the first
+   * window is opened before the content length is known and gets no more
+   * than the range of the client */
+  if (processor->end == 0
+      || (processor->end - processor->start) > window_size) {
+    download_length = window_size;
+  } else {
+    download_length = (uint32_t)(processor->end - processor->start);
+  }
+  if (processor->end == 0 && processor->range_end > 0
+      && processor->range_end - processor->start < download_length)
+    download_length = (uint32_t)(processor->range_end - processor->start);
+
+  /* Split into as many pieces as allowed, but never into pieces too small to pay a request */
+  count = download_length/MIN_AV_PIECE_SIZE;
+  if (count > processor->tuner.single_limit) {
+    count = processor->tuner.single_limit;
+  } else if (count == 0) {
+    count = 1;
+  }
+
+  /* malloc a buffer item for storing body data, the first window must be able
+   * to take the whole body if the origin ignores the range */
+  buffer_length = download_length;
+  if (processor->content_length == 0)
+    buffer_length = processor->tuner.window_size;
+  item = avprocess_buffer_item_obtain(processor, buffer_length);
+  if (item == NULL) {
+    pri_debug ("No buffer for a new window now\n");
+    return NULL;
+  }
+
+  /* The total data should be received in this window */
+  item->data_len = download_length;
+  item->offset = 0;
+  item->start = processor->start;
+  item->piece_size = download_length/count;
+  item->piece_next = 0;
+  item->piece_running = 0;
+  if (processor->handle.head_buf == NULL)
+    avprocess_share_publish (processor, item);
+
+  handle->window[(handle->window_head + handle->window_count) % AV_WINDOW_COUNT] = item;
+  handle->window_count++;
+
+  /* refresh next start position */
+  processor->start += download_length;
+
+  pri_debug ("Open window from pos %llu, length is %u, next start will be %llu\n", \
+        (unsigned long long)item->start, download_length, (unsigned long long)processor->start);
+
+  return item;
+}
+
+/**
+ * avprocess_stream_limit:
+ * @processor: processor handle
+ *
+ * Returns: The max length of a streamed body buffered ahead of the reader,
+ * there is no end to wait for on a live stream.
+ */
+static uint32_t
+avprocess_stream_limit (ProxyAVProcessor *processor)
+{
+  if (processor->config.read_ahead > 0 && processor->config.read_ahead < AV_STREAM_BUFFER_LIMIT)
+    return processor->config.read_ahead;
+
+  return AV_STREAM_BUFFER_LIMIT;
+}
+
+/**
+ * avprocess_stream_open:
+ * @processor: processor handle
+ * @size: bytes the window item must hold at least
+ *
+ * Open a new window item for the next part of a streamed body.
+ *
+ * Returns: The opened window item, NULL if no more window can be opened now.
+ */
+static ProxyAVBufferItem *
+avprocess_stream_open (ProxyAVProcessor *processor, uint32_t size)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item;
+
+  if (handle->window_count >= AV_WINDOW_COUNT)
+    return NULL;
+
+  if (size < AV_STREAM_BUFFER_SIZE)
+    size = AV_STREAM_BUFFER_SIZE;
+  if ((item = avprocess_buffer_item_obtain (processor, size)) == NULL) {
+    pri_debug ("No buffer for the stream now\n");
+    return NULL;
+  }
+
+  /* The window grows with the data written, as a single piece */
+  item->start = processor->start;
+  item->piece_size = item->buffer_len;
+
+  handle->window[(handle->window_head + handle->window_count) % AV_WINDOW_COUNT] = item;
+  handle->window_count++;
+
+  return item;
+}
+
+/**
+ * avprocess_stream_append:
+ * @processor: processor handle
+ * @single: the single buffer of the streaming transfer
+ * @content: the data received
+ * @length: length of @content, no more than the room left in @single
+ */
+static void
+avprocess_stream_append (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single,
+    const char * content, uint32_t length)
+{
+  memcpy (single->buffer + single->buffer_pos, content, length);
+  single->buffer_pos += length;
+  single->item->data_len = single->buffer_pos;
+  single->item->piece_next = single->buffer_pos;
+  processor->start += length;
+}
+
+/**
+ * avprocess_stream_write:
+ * @processor: processor handle
+ * @single: the single buffer of the streaming transfer
+ * @content: the data received
+ * @length: length of @content
+ *
+ * Write a part of a streamed body. The full window item is handed to the
+ * data queue once the next one is opened, and the transfer is paused while
+ * the reader is too far behind or no memory can be had.
+ *
+ * Returns: @length on success, CURL_WRITE_PAUSE to get the same data again
+ * once resumed.
+ */
+static uint32_t
+avprocess_stream_write (ProxyAVProcessor * processor, ProxyAVSingleBuffer * single,
+    const char * content, uint32_t length)
+{
+  ProxyAVBufferItem * item;
+  uint32_t free_length;
+
+  /* All or nothing, curl hands the same data again once resumed */
+  if (processor->start - processor->read_pos >= avprocess_stream_limit (processor)) {
+    processor->stream_paused = TRUE;
+    return CURL_WRITE_PAUSE;
+  }
+
+  free_length = single->buffer_len - single->buffer_pos;
+  if (free_length < length) {
+    if ((item = avprocess_stream_open (processor, length - free_length)) == NULL) {
+      processor->stream_paused = TRUE;
+      return CURL_WRITE_PAUSE;
+    }
+    avprocess_stream_append (processor, single, content, free_length);
+    item->start = processor->start;
+
+    single->item->piece_running--;
+    single->item = item;
+    single->buffer = item->buffer;
+    single->buffer_len = item->buffer_len;
+    single->buffer_pos = 0;
+    item->piece_running++;
+  } else {
+    free_length = 0;
+  }
+
+  avprocess_stream_append (processor, single, content + free_length, length - free_length);
+
+  return length;
+}
+
+/**
+ * avprocess_stream_resume:
+ * @processor: processor handle
+ *
+ * Resume the paused streaming transfer once the reader has caught up.
+ */
+static void
+avprocess_stream_resume (ProxyAVProcessor *processor)
+{
+  if (!processor->stream_paused
+      || processor->start - processor->read_pos >= avprocess_stream_limit (processor)/2)
+    return;
+
+  processor->stream_paused = FALSE;
+  proxy_curl_single_pause (processor->handle.singles[0].single_handle, FALSE);
+}
+
+/**
+ * avprocess_window_pending:
+ * @processor: processor handle
+ *
+ * Find the oldest window item which still has pieces not assigned to any single task.
+ *
+ * Returns: The window item, NULL if all pieces in flight have been assigned.
+ */
+static ProxyAVBufferItem *
+avprocess_window_pending (ProxyAVProcessor *processor)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item;
+  uint32_t i;
+
+  for (i = 0; i < handle->window_count; i++) {
+    item = handle->window[(handle->window_head + i) % AV_WINDOW_COUNT];
+    if (item->piece_next < item->data_len)
+      return item;
+  }
+
+  return NULL;
+}
+
+/**
+ * avprocess_single_start:
+ * @processor: processor handle
+ * @single: the idle single buffer to carry the piece
+ * @item: the window item the piece belongs to
+ * @piece_pos: buffer position of the piece in @item
+ * @piece_size: size of the piece
+ *
+ * Start downloading a piece of @item by @single.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_single_start (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single,
+    ProxyAVBufferItem *item, uint32_t piece_pos, uint32_t piece_size)
+{
+  uint64_t piece_start = item->start + piece_pos;
+  char piece_range[256];
+  SINGLE_HANDLE single_handle;
+
+  /* The single task is created once and then reused for every piece it carries */
+  if (single->single_handle == NULL) {
+    if ((single->single_handle = proxy_curl_single_task_create()) == NULL) {
+      pri_error ("Creating single task failed\n");
+      return FALSE;
+    }
+    proxy_curl_single_opt_body(single->single_handle, avprocess_data_write, single);
+  }
+  single_handle = single->single_handle;
+
+  snprintf (piece_range, sizeof(piece_range), "%llu-%llu", \
+      (unsigned long long)piece_start, (unsigned long long)(piece_start + piece_size - 1));
+  single->item = item;
+  single->buffer = item->buffer + piece_pos;
+  single->buffer_len = piece_size;
+  single->buffer_pos = 0;
+  single->stolen = FALSE;
+  single->located = (processor->location != NULL);
+  single->status = 0;
+  pri_debug ("Piece range %s, size = %u\n", piece_range, piece_size);
+
+  /* Only the range changes between two pieces, the connection is kept */
+  proxy_curl_single_set_url(single_handle, \
+      single->located ? processor->location : processor->url);
+  proxy_curl_single_set_range(single_handle, piece_range);
+  proxy_curl_single_set_headers(single_handle, processor->piece_headers);
+  proxy_curl_single_opt_header(single_handle, avprocess_piece_header, single);
+
+  if (proxy_curl_multi_add_single(processor->handle.multi, \
+      single_handle) != CURL_SUCC) {
+    pri_error ("Adding single to multi failed\n");
+    single->item = NULL;
+    return FALSE;
+  }
+
+  item->piece_running++;
+  processor->handle.single_count++;
+
+  return TRUE;
+}
+
+/**
+ * avprocess_piece_start:
+ * @processor: processor handle
+ * @single: the idle single buffer to carry the piece
+ * @item: the window item the piece belongs to
+ *
+ * Assign the next unassigned piece of @item to @single and start downloading it.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_piece_start (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single,
+    ProxyAVBufferItem *item)
+{
+  uint32_t piece_pos = item->piece_next;
+  uint32_t piece_size = item->piece_size;
+
+  /* The last piece takes the remainder of the window */
+  if (item->data_len - piece_pos < 2*piece_size) {
+    piece_size = item->data_len - piece_pos;
+  }
+
+  if (!avprocess_single_start (processor, single, item, piece_pos, piece_size))
+    return FALSE;
+
+  item->piece_next += piece_size;
+
+  return TRUE;
+}
+
+/**
+ * avprocess_piece_victim:
+ * @processor: processor handle
+ *
+ * Find the running piece worth splitting: among the pieces whose remaining
+ * bytes would still take more than two round trips, the one of the oldest
+ * window with the most bytes remaining.
+ *
+ * Returns: The single buffer of the piece, NULL if no piece is worth it.
+ */
+static ProxyAVSingleBuffer *
+avprocess_piece_victim (ProxyAVProcessor *processor)
+{
+  ProxyAVTuner * tuner = &processor->tuner;
+  ProxyAVSingleBuffer *single;
+  ProxyAVSingleBuffer *victim = NULL;
+  uint32_t remain;
+  uint32_t victim_remain = 0;
+  int32_t i;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    single = &processor->handle.singles[i];
+    if (single->item == NULL || single->waiting)
+      continue;
+
+    remain = single->buffer_len - single->buffer_pos;
+    if (remain < AV_STEAL_MIN_SIZE)
+      continue;
+
+    /* It will be done before a new request could return its first byte */
+    if (tuner->piece_rate > 0 && tuner->rtt > 0 
+        && remain < tuner->piece_rate*tuner->rtt*2)
+      continue;
+
+    if (victim == NULL || single->item->start < victim->item->start
+        || (single->item == victim->item && remain > victim_remain)) {
+      victim = single;
+      victim_remain = remain;
+    }
+  }
+
+  return victim;
+}
+
+/**
+ * avprocess_task_steal:
+ * @processor: processor handle
+ *
+ * Hand the tail half of lagging pieces to the idle single tasks. Both halves
+ * keep writing into the same window buffer, the lagging piece is cut at the
+ * split point and its transfer is aborted once it gets there.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_task_steal (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single;
+  ProxyAVSingleBuffer *victim;
+  uint32_t keep_len;
+  uint32_t tail_len;
+  int32_t i;
+
+  /* The origin ignoring the range sends the whole body on the first piece */
+  if (processor->status != 206)
+    return TRUE;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    if (processor->handle.single_count >= processor->tuner.single_limit)
+      break;
+
+    single = &processor->handle.singles[i];
+    if (single->item != NULL)
+      continue;
+
+    victim = avprocess_piece_victim (processor);
+    if (victim == NULL)
+      break;
+
+    tail_len = (victim->buffer_len - victim->buffer_pos)/2;
+    keep_len = victim->buffer_len - tail_len;
+
+    pri_debug ("Steal %u bytes from piece at %llu, %u of %u received\n", tail_len, \
+        (unsigned long long)(victim->item->start + (uint32_t)(victim->buffer - victim->item->buffer)), \
+        victim->buffer_pos, victim->buffer_len);
+
+    if (!avprocess_single_start (processor, single, victim->item, \
+        (uint32_t)(victim->buffer - victim->item->buffer) + keep_len, tail_len))
+      return FALSE;
+
+    victim->buffer_len = keep_len;
+    victim->stolen = TRUE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * avprocess_head_start:
+ * @processor: processor handle
+ *
+ * Request the first window at once as a single piece, its response header
+ * is the one handed to the client and tells the content length. The other
+ * pieces are fanned out once the header is got.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_head_start (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single = &processor->handle.singles[0];
+  ProxyAVBufferItem *item;
+
+  /* malloc a buffer item for storing header data */
+  item = avprocess_buffer_item_obtain(processor, AV_HEAD_BUFFER_SIZE);
+  if (item == NULL) {
+    pri_error ("Malloc buffer item failed\n");
+    return FALSE;
+  }
+  processor->handle.head_buf = item;
+
+  if ((item = avprocess_window_open (processor)) == NULL) {
+    pri_error ("Open first window failed\n");
+    return FALSE;
+  }
+  item->piece_size = item->data_len;
+
+  if (!avprocess_piece_start (processor, single, item)) {
+    pri_error ("Start first piece failed\n");
+    return FALSE;
+  }
+  proxy_curl_single_opt_header(single->single_handle, avprocess_header_write, processor);
+
+  return TRUE;
+}
+
+/**
+ * avprocess_task_schedule:
+ * @processor: processor handle
+ *
+ * Start the next pieces on every idle single task, opening new windows
+ * ahead of the reader as long as the window is not full.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_task_schedule (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single;
+  ProxyAVBufferItem *item;
+  int32_t i;
+
+  p_return_val_if_fail (processor != NULL, FALSE);
+
+  /* Nothing more can be scheduled before the first piece tells the content
+   * length, nor while the first piece streams the whole body */
+  if (processor->handle.head_buf != NULL || processor->streaming)
+    return TRUE;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    if (processor->handle.single_count >= processor->tuner.single_limit)
+      break;
+
+    single = &processor->handle.singles[i];
+    if (single->item != NULL)
+      continue;
+
+    /* The tail the player seeks to goes first. A window read from the disk
+     * cache or from another processor has no piece to get, go on to the
+     * next one */
+    item = processor->tail;
+    if (item == NULL || item->piece_next >= item->data_len)
+      item = avprocess_window_pending (processor);
+    while (item == NULL && (item = avprocess_window_open (processor)) != NULL) {
+      if (item->piece_next >= item->data_len)
+        item = NULL;
+    }
+    if (item == NULL)
+      break;
+
+    if (!avprocess_piece_start (processor, single, item))
+      return FALSE;
+  }
+
+  /* Nothing left to assign, let the idle single tasks help the lagging pieces */
+  return avprocess_task_steal (processor);
+}
+
+/**
+ * avprocess_single_detach:
+ * @processor: processor handle
+ * @single: the single buffer whose piece has stopped
+ *
+ * Take the single task out of the multi task, the piece stays with it
+ * until it is released or resumed.
+ */
+static void
+avprocess_single_detach (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single)
+{
+  if (single->item != NULL && !single->waiting) {
+    proxy_curl_multi_remove_single(processor->handle.multi, single->single_handle);
+    processor->handle.single_count--;
+  }
+
+  single->waiting = (single->item != NULL);
+}
+
+/**
+ * avprocess_single_release:
+ * @processor: processor handle
+ * @single: the single buffer done with its piece
+ *
+ * Take the single task out of the multi task and make it idle, keeping the
+ * single task and its connection for the next piece.
+ */
+static void
+avprocess_single_release (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single)
+{
+  avprocess_single_detach (processor, single);
+
+  single->item = NULL;
+  single->buffer = NULL;
+  single->buffer_len = 0;
+  single->buffer_pos = 0;
+  single->stolen = FALSE;
+  single->waiting = FALSE;
+  single->retries = 0;
+  single->retry_at = 0;
+}
+
+/**
+ * avprocess_piece_resume:
+ * @processor: processor handle
+ * @single: the single buffer of a detached piece
+ *
+ * Request the part of the piece not received yet, the data already in the
+ * window buffer is kept.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_piece_resume (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single)
+{
+  ProxyAVBufferItem *item = single->item;
+  uint32_t piece_pos;
+  uint32_t piece_size;
+
+  piece_pos = (uint32_t)(single->buffer - item->buffer) + single->buffer_pos;
+  piece_size = single->buffer_len - single->buffer_pos;
+  pri_debug ("Resume piece at %llu, %u bytes left\n", \
+      (unsigned long long)(item->start + piece_pos), piece_size);
+
+  /* What the piece has got so far is counted once it goes */
+  processor->tuner.recv_bytes += single->buffer_pos;
+  item->piece_running--;
+  single->item = NULL;
+  single->waiting = FALSE;
+
+  if (!avprocess_single_start (processor, single, item, piece_pos, piece_size)) {
+    pri_error ("Restart piece failed\n");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * avprocess_piece_relocate:
+ * @processor: processor handle
+ * @single: the single buffer whose piece has failed
+ *
+ * The location of a signed url expires, restart the rest of a piece failed
+ * for that on the processor url, going through the redirects again.
+ *
+ * Returns: TRUE if the failure has been dealt with, FALSE otherwise.
+ */
+static BOOL
+avprocess_piece_relocate (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single)
+{
+  if (!single->located)
+    return FALSE;
+  if (single->status != 403 && single->status != 404 && single->status != 410)
+    return FALSE;
+
+  /* The other pieces sent there at the same time fail alike */
+  if (processor->location != NULL) {
+    pri_warning ("Location %s refused with %u, going back to %s\n", \
+        processor->location, single->status, processor->url);
+    free (processor->location);
+    processor->location = NULL;
+  }
+
+  avprocess_single_detach (processor, single);
+  if (!avprocess_piece_resume (processor, single))
+    processor->failed = TRUE;
+
+  return TRUE;
+}
+
+/**
+ * avprocess_piece_retry:
+ * @processor: processor handle
+ * @single: the single buffer whose piece has failed or ended short
+ *
+ * Plan to request the rest of the piece again after a backoff doubling on
+ * each failure of the piece, instead of leaving a hole in the window. A
+ * failing origin gets one connection less each time.
+ *
+ * Returns: TRUE if the retry is planned, FALSE if the piece cannot be retried.
+ */
+static BOOL
+avprocess_piece_retry (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single)
+{
+  ProxyAVTuner * tuner = &processor->tuner;
+  uint32_t wait;
+
+  /* Only the origin sending ranges can give the rest of a piece */
+  if (processor->status != 206 || processor->streaming
+      || single->retries >= AV_RETRY_MAX)
+    return FALSE;
+
+  wait = AV_RETRY_FIRST_WAIT << single->retries;
+  if (wait > AV_RETRY_MAX_WAIT)
+    wait = AV_RETRY_MAX_WAIT;
+  single->retries++;
+  single->retry_at = avprocess_time_now () + wait/1000.0;
+
+  pri_warning ("Piece at %llu failed with %u of %u received, retry %u in %u ms\n", \
+      (unsigned long long)(single->item->start + (uint32_t)(single->buffer - single->item->buffer)), \
+      single->buffer_pos, single->buffer_len, single->retries, wait);
+  avprocess_single_detach (processor, single);
+
+  if (tuner->single_limit > 1) {
+    tuner->single_limit--;
+    tuner->last_change = 0;
+    tuner->settled = 0;
+  }
+
+  return TRUE;
+}
+
+/**
+ * avprocess_retry_start:
+ * @processor: processor handle
+ *
+ * Request the rest of the failed pieces whose backoff is over.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+avprocess_retry_start (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single;
+  double now = 0;
+  int32_t i;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    single = &processor->handle.singles[i];
+    if (!single->waiting)
+      continue;
+
+    if (now == 0)
+      now = avprocess_time_now ();
+    if (now >= single->retry_at && !avprocess_piece_resume (processor, single))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * avprocess_retry_pending:
+ * @processor: processor handle
+ *
+ * Returns: TRUE if a failed piece waits for its backoff to be over.
+ */
+static BOOL
+avprocess_retry_pending (ProxyAVProcessor *processor)
+{
+  int32_t i;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    if (processor->handle.singles[i].waiting)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+avprocess_multi_task_free (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single;
+  int32_t i;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    single = &processor->handle.singles[i];
+    avprocess_single_release (processor, single);
+    if (single->single_handle != NULL) {
+      proxy_curl_single_task_destroy (single->single_handle);
+      single->single_handle = NULL;
+    }
+  }
+}
+
+static BOOL
+avprocess_piece_recv_done (ProxyAVSingleBuffer *single)
+{
+  return (single->buffer_pos == single->buffer_len);
+}
+
+/**
+ * avprocess_piece_measure:
+ * @processor: processor handle
+ * @single: the single buffer which has finished its piece
+ *
+ * Feed the round trip and rate of the finished piece to the tuner.
+ */
+static void
+avprocess_piece_measure (ProxyAVProcessor *processor, ProxyAVSingleBuffer *single)
+{
+  ProxyAVTuner * tuner = &processor->tuner;
+  CurlTaskStats stats;
+  double rtt;
+  double rate;
+
+  tuner->recv_bytes += single->buffer_pos;
+
+  if (proxy_curl_single_get_stats (single->single_handle, &stats) != CURL_SUCC)
+    return;
+
+  /* Time from sending the request to the first byte */
+  rtt = stats.starttransfer_time - stats.pretransfer_time;
+  if (rtt > 0) {
+    tuner->rtt = (tuner->rtt > 0) ? (tuner->rtt*3 + rtt)/4 : rtt;
+  }
+
+  /* Rate once the data is flowing, tiny pieces tell nothing about it */
+  if (stats.size >= MIN_AV_PIECE_SIZE/2 
+      && stats.total_time > stats.starttransfer_time) {
+    rate = stats.size/(stats.total_time - stats.starttransfer_time);
+    tuner->piece_rate = (tuner->piece_rate > 0) ? (tuner->piece_rate*3 + rate)/4 : rate;
+  }
+}
+
+/**
+ * avprocess_tail_drop:
+ * @processor: processor handle, getting a tail
+ *
+ * Give up the tail and stop its pieces, the processors reading it get it
+ * themselves.
+ */
+static void
+avprocess_tail_drop (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single;
+  int32_t i;
+
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    single = &processor->handle.singles[i];
+    if (single->item == processor->tail)
+      avprocess_single_release (processor, single);
+  }
+  avprocess_buffer_item_recycle (processor, processor->tail);
+  processor->tail = NULL;
+}
+
+/**
+ * avprocess_tail_done:
+ * @processor: processor handle
+ *
+ * Hand the tail over to the table once it is received done, it stays
+ * there for the processor the player seeks with.
+ */
+static void
+avprocess_tail_done (ProxyAVProcessor *processor)
+{
+  ProxyAVBufferItem * tail = processor->tail;
+
+  if (tail == NULL || tail->piece_next < tail->data_len || tail->piece_running > 0)
+    return;
+
+  avprocess_share_done (tail);
+  /* The cache keeps the blocks following the first one, that one is only
+   * complete once the windows reach it */
+  if (processor->cache != NULL)
+    proxy_cache_write (processor->cache, tail->start, tail->buffer, tail->data_len);
+  pri_debug ("Tail from pos %llu prefetched\n", (unsigned long long)tail->start);
+
+  avprocess_buffer_item_recycle (processor, tail);
+  processor->tail = NULL;
+}
+
+/**
+ * avprocess_task_reap:
+ * @processor: processor handle
+ *
+ * Release the single tasks which have finished their pieces, so that
+ * they can carry the next pieces.
+ */
 static void
-avprocess_buffer_item_free (ProxyAVBufferItem * item)
+avprocess_task_reap (ProxyAVProcessor *processor)
 {
-  p_return_if_fail (item != NULL);
+  SINGLE_HANDLE single_handle;
+  ProxyAVSingleBuffer *single;
+  int32_t result;
+  int32_t i;
 
-  if (item->buffer) {
-    free (item->buffer);
-    item->buffer = NULL;
-  }
+  while (proxy_curl_multi_info_read (processor->handle.multi, \
+      &single_handle, &result) == CURL_SUCC) {
+    for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+      single = &processor->handle.singles[i];
+      if (single->item != NULL && single->single_handle == single_handle)
+        break;
+    }
+    if (i == MAX_SINGLE_COUNT) {
+      pri_warning ("Unknown single task finished\n");
+      continue;
+    }
 
-  free (item);
+    /* A stolen piece is aborted on purpose once it reaches the split point */
+    /* The location may have expired, go through the redirects again */
+    if (result != CURL_SUCC && !single->stolen
+        && avprocess_piece_relocate (processor, single))
+      continue;
+
+    /* Get the rest of a piece failed or ended short once the header is got */
+    if (!avprocess_piece_recv_done (single) && processor->handle.head_buf == NULL
+        && avprocess_piece_retry (processor, single))
+      continue;
+
+    /* The tail is only a guess of what is read next, it is given up alone */
+    if (processor->tail != NULL && single->item == processor->tail
+        && ((result != CURL_SUCC && !single->stolen) || !avprocess_piece_recv_done (single))) {
+      pri_warning ("Prefetching the tail failed\n");
+      avprocess_tail_drop (processor);
+      continue;
+    }
+
+    /* The window would be read through the hole, nothing after it can be handed out */
+    if ((result != CURL_SUCC && !single->stolen)
+        || (!processor->streaming && !avprocess_piece_recv_done (single))) {
+      pri_error ("Expect data not receive done, %u of %u received.\n", \
+          single->buffer_pos, single->buffer_len);
+      processor->failed = TRUE;
+    }
+    if (processor->handle.head_buf != NULL) {
+      pri_error ("The first piece finished without header\n");
+      processor->failed = TRUE;
+    }
+    if (result == CURL_SUCC)
+      avprocess_location_learn (processor, single);
+    single->item->piece_running--;
+    if (!processor->streaming)
+      avprocess_piece_measure (processor, single);
+    avprocess_single_release (processor, single);
+  }
 }
 
-static ProxyAVBufferItem *
-avprocess_buffer_item_obtain (ProxyQueue * queue)
+/**
+ * avprocess_window_deliver:
+ * @processor: processor handle
+ *
+ * Push the window items which have been received done to the data queue,
+ * keeping the content order.
+ */
+static void
+avprocess_window_deliver (ProxyAVProcessor *processor)
 {
-  p_return_val_if_fail (queue != NULL, NULL);
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item;
 
-  if (!proxy_queue_is_empty (queue))
-    return proxy_queue_pop_head(queue);
-  
-  return avprocess_buffer_item_malloc(DEFAULT_AV_BUFFER_SIZE);
+  while (handle->window_count > 0) {
+    item = handle->window[handle->window_head];
+    if (item->borrowed && !avprocess_share_wait (processor, item))
+      break;
+    if (item->piece_next < item->data_len || item->piece_running > 0)
+      break;
+
+    /* The processors reading the window can have it now */
+    if (item->shared != NULL && !item->borrowed)
+      avprocess_share_done (item);
+
+    /* Keep what the network has got for the next time it is played */
+    if (processor->cache != NULL && item->map == NULL)
+      proxy_cache_write (processor->cache, item->start, item->buffer, item->data_len);
+
+    /* The player may have to seek to the end before it plays anything */
+    if (item->start == 0)
+      avprocess_tail_start (processor, item);
+
+    /* The reader may have drained it already while it was downloading */
+    if (item->offset >= item->data_len)
+      avprocess_buffer_item_recycle (processor, item);
+    else if (!proxy_queue_push_tail (processor->data_queue, item))
+      break;
+    handle->window[handle->window_head] = NULL;
+    handle->window_head = (handle->window_head + 1) % AV_WINDOW_COUNT;
+    handle->window_count--;
+  }
 }
 
 /**
- * avprocess_multi_task_build:
- * @handle: processor handle 
- * @count: how many single task need
- * @do we need the header data
+ * avprocess_window_ready:
+ * @processor: processor handle
+ * @item: the window item
  *
- * Setting up the task to start download the next part data.
+ * The pieces of a window finish in any order, find how far the data received
+ * goes from the start of the window without a hole.
  *
- * Returns: TRUE on success and FALSE on error.
+ * Returns: The length of the contiguous data received.
  */
-static BOOL
-avprocess_multi_task_build (ProxyAVProcessor *processor, uint32_t count, BOOL need_head)
+static uint32_t
+avprocess_window_ready (ProxyAVProcessor *processor, ProxyAVBufferItem *item)
 {
-  uint32_t piece_start;
-  uint32_t piece_end;
-  uint32_t piece_size;
-  uint32_t piece_pos = 0;
-  uint32_t download_length = 0;
-  ProxyAVSingleBuffer *single_buf;
-  char piece_range[256];
-  SINGLE_HANDLE single_handle;
-  ProxyAVBufferItem * item;
+  ProxyAVSingleBuffer *single;
+  uint32_t ready = item->piece_next;
+  uint32_t received;
   int32_t i;
 
-  p_return_val_if_fail (processor != NULL, FALSE);
-  p_return_val_if_fail (count > 0, FALSE);
+  /* Another processor is getting it, its pieces are not known here */
+  if (item->borrowed)
+    return avprocess_share_state (item, NULL) ? item->data_len : 0;
 
-  /* The content length is unkonwn */
-  if (processor->content_length == 0) {
-    pri_error ("Unkonwn content length, aborting task bulid\n");
-    return FALSE;
-  }
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    single = &processor->handle.singles[i];
+    if (single->item != item)
+      continue;
 
-  /* calculating how many data we wil download in this task */
-  piece_start = processor->start;
-  if ((processor->content_length - piece_start) > DEFAULT_AV_BUFFER_SIZE) {
-    download_length = DEFAULT_AV_BUFFER_SIZE;
-  } else {
-    download_length = processor->content_length - piece_start;
+    received = (uint32_t)(single->buffer - item->buffer) + single->buffer_pos;
+    if (received < ready)
+      ready = received;
   }
 
-  /* refresh next start position */
-  processor->start += download_length;
+  return ready;
+}
 
-  pri_debug ("This task will download data from pos %u, "\
-        "length is %u, next start will be %u\n", piece_start, \
-        download_length, processor->start);
+/**
+ * avprocess_window_peek:
+ * @processor: processor handle
+ * @ready: where to store the length of the contiguous data received
+ *
+ * Find the data received so far by the oldest window, before all its pieces
+ * are done.
+ *
+ * Returns: The oldest window item, NULL if nothing can be read from it.
+ */
+static ProxyAVBufferItem *
+avprocess_window_peek (ProxyAVProcessor *processor, uint32_t * ready)
+{
+  ProxyAVTaskHandle * handle = &processor->handle;
+  ProxyAVBufferItem * item;
 
-  /* If the download_length is less than @DEFAULT_AV_BUFFER_SIZE just use a task */
-  if (download_length < DEFAULT_AV_BUFFER_SIZE) {
-    count = 1;
-  }
+  /* The body must not get ahead of the header, and a failed piece may
+   * have left a hole anywhere */
+  if (handle->head_buf != NULL || handle->window_count == 0 || processor->failed)
+    return NULL;
 
-  /* Calculta each task download size */
-  piece_size = download_length/count;
+  item = handle->window[handle->window_head];
+  *ready = avprocess_window_ready (processor, item);
+  if (*ready <= item->offset)
+    return NULL;
 
-  /* malloc a buffer item for storing body data */
-  item = avprocess_buffer_item_obtain(processor->mem_queue);
-  if (item == NULL) {
-    pri_error ("Malloc buffer item failed\n");
-    return FALSE;
-  }
-  processor->handle.data_buf = item;
+  return item;
+}
 
-  /* The total data should be received in this task */
-  item->data_len = download_length;
-  item->offset = 0;
-  
-  for (i = 0; i < count; i++) {
-    single_buf = &processor->handle.singles[i];
-    if ((single_handle = proxy_curl_single_task_create()) == NULL) {
-      pri_error ("Creating single task failed\n");
-      goto task_bulid_failed;
-    }
-    single_buf->single_handle = single_handle;
-    processor->handle.single_count++;
-    
-    if (need_head && i == 0) {
-      /* malloc a buffer item for storing header data */
-      item = avprocess_buffer_item_obtain(processor->mem_queue);
-      if (item == NULL) {
-        pri_error ("Malloc buffer item failed\n");
-        goto task_bulid_failed;;
-      }
-      processor->handle.head_buf = item;       
-      proxy_curl_single_opt_header(single_handle, avprocess_header_write, item);
-    }
+/**
+ * avprocess_tune_window:
+ * @tuner: the processor tuner
+ *
+ * Size the window so that each piece lasts @AV_TUNE_PIECE_RTTS round trips,
+ * which keeps the request overhead small whatever the link is.
+ */
+static void
+avprocess_tune_window (ProxyAVTuner * tuner)
+{
+  double piece_size;
+  double window_size;
 
-    /* Calculate each piece range */
-    if (i == count - 1) {
-      /* The last piece */
-      piece_end = processor->start - 1;
-      piece_size = processor->start - piece_start;
-    } else {
-      piece_end = piece_start + piece_size - 1;
-    }
-    snprintf (piece_range, sizeof(piece_range), "%u-%u", \
-        piece_start, piece_end);
-    single_buf->buffer = processor->handle.data_buf->buffer + piece_pos;
-    single_buf->buffer_len = piece_size;
-    pri_debug ("The %dth piece's range %s, size = %u\n", \
-          i, piece_range, piece_size);
-
-    /* Setting single task options */
-    proxy_curl_single_set_url(single_handle, processor->url);
-    proxy_curl_single_opt_body(single_handle, avprocess_data_write, single_buf);
-    proxy_curl_single_set_range(single_handle, piece_range);
-    if (need_head && i == 0) {
-      /* malloc a buffer item for storing header data */
-      item = avprocess_buffer_item_obtain(processor->mem_queue);
-      if (item == NULL) {
-        pri_error ("Malloc buffer item failed\n");
-        goto task_bulid_failed;;
-      }
-      processor->handle.head_buf = item;       
-      proxy_curl_single_opt_header(single_handle, avprocess_header_write, processor);
-    }
+  if (tuner->piece_rate <= 0 || tuner->rtt <= 0)
+    return;
 
-    if (proxy_curl_multi_add_single(processor->handle.multi, \
-        single_handle) != CURL_SUCC) {
-      pri_error ("Adding single to multi failed\n");
-      goto task_bulid_failed;
-    }
+  piece_size = tuner->piece_rate*tuner->rtt*AV_TUNE_PIECE_RTTS;
+  if (piece_size < MIN_AV_PIECE_SIZE)
+    piece_size = MIN_AV_PIECE_SIZE;
 
-    piece_start += piece_size;
-    piece_pos += piece_size;
+  window_size = piece_size*tuner->single_limit;
+  if (window_size < MIN_AV_BUFFER_SIZE) {
+    window_size = MIN_AV_BUFFER_SIZE;
+  } else if (window_size > MAX_AV_BUFFER_SIZE) {
+    window_size = MAX_AV_BUFFER_SIZE;
   }
 
-  return TRUE;
-task_bulid_failed:
-  return FALSE;
+  tuner->window_size = (uint32_t)window_size;
 }
 
+/**
+ * avprocess_tune:
+ * @processor: processor handle
+ *
+ * Measure the aggregate rate once per @AV_TUNE_PERIOD and climb toward the
+ * smallest single task count which still saturates the link: a change of
+ * the count is kept only if it earns @AV_TUNE_GAIN of rate, and once
+ * settled the count is probed downward and upward in turn.
+ */
 static void
-avprocess_multi_task_free (ProxyAVProcessor *processor)
+avprocess_tune (ProxyAVProcessor *processor)
 {
-  void * task_handle;
+  ProxyAVTuner * tuner = &processor->tuner;
+  ProxyBandwidthEstimate estimate;
+  uint64_t recv_bytes;
+  double prev_rate;
+  double now;
   int32_t i;
-  ProxyAVSingleBuffer *single;
 
-  for (i = 0; i < processor->handle.single_count; i++) {
-    task_handle = processor->handle.singles[i].single_handle;
-    if (task_handle != 0) {
-      proxy_curl_multi_remove_single(processor->handle.multi, task_handle);
-      proxy_curl_single_task_destroy (task_handle);
-    }
+  /* Idle or paused periods tell nothing about the link, restart measuring.
+   * The rate of a streamed body is set by the origin, there is nothing to tune */
+  if (processor->handle.single_count == 0 || processor->paused || processor->streaming) {
+    tuner->period_start = 0;
+    return;
   }
-  processor->handle.single_count = 0;
 
+  recv_bytes = tuner->recv_bytes;
   for (i = 0; i < MAX_SINGLE_COUNT; i++) {
-    single = &processor->handle.singles[i];
-    single->single_handle = NULL;
-    single->buffer = NULL;
-    single->buffer_len = 0;
-    single->buffer_pos = 0;
-  } 
+    if (processor->handle.singles[i].item != NULL)
+      recv_bytes += processor->handle.singles[i].buffer_pos;
+  }
+
+  now = avprocess_time_now ();
+  if (tuner->period_start == 0) {
+    tuner->period_start = now;
+    tuner->period_bytes = recv_bytes;
+    return;
+  }
+  if (now - tuner->period_start < AV_TUNE_PERIOD)
+    return;
+
+  prev_rate = tuner->rate;
+  tuner->rate = (double)(recv_bytes - tuner->period_bytes)/(now - tuner->period_start);
+  tuner->period_start = now;
+  tuner->period_bytes = recv_bytes;
+
+  if (prev_rate > 0) {
+    if (tuner->last_change > 0) {
+      if (tuner->rate < prev_rate*AV_TUNE_GAIN) {
+        /* The extra piece did not pay, the link is saturated */
+        tuner->single_limit--;
+        tuner->last_change = 0;
+      } else if (tuner->single_limit < MAX_SINGLE_COUNT) {
+        tuner->single_limit++;
+      } else {
+        tuner->last_change = 0;
+      }
+    } else if (tuner->last_change < 0) {
+      if (tuner->rate*AV_TUNE_GAIN < prev_rate) {
+        /* One piece less lost rate, it was needed */
+        tuner->single_limit++;
+        tuner->last_change = 0;
+      } else if (tuner->single_limit > 1) {
+        tuner->single_limit--;
+      } else {
+        tuner->last_change = 0;
+      }
+    } else if (++tuner->settled >= AV_TUNE_PROBE_PERIODS) {
+      tuner->settled = 0;
+      if (tuner->probe_down && tuner->single_limit > 1) {
+        tuner->single_limit--;
+        tuner->last_change = -1;
+      } else if (tuner->single_limit < MAX_SINGLE_COUNT) {
+        tuner->single_limit++;
+        tuner->last_change = 1;
+      }
+      tuner->probe_down = !tuner->probe_down;
+    }
+  }
+  avprocess_tune_window (tuner);
+
+  pri_debug ("Rate %.0f B/s, piece rate %.0f B/s, rtt %.3f s, %u pieces, window %u\n", \
+      tuner->rate, tuner->piece_rate, tuner->rtt, tuner->single_limit, \
+      tuner->window_size);
+
+  /* Let the next session to this origin start warm */
+  estimate.rate = tuner->rate;
+  estimate.piece_rate = tuner->piece_rate;
+  estimate.rtt = tuner->rtt;
+  estimate.single_limit = tuner->single_limit;
+  estimate.window_size = tuner->window_size;
+  proxy_bandwidth_update (processor->url, &estimate);
 }
 
-BOOL
-avprocess_data_recv_done (ProxyAVProcessor *processor)
+/**
+ * proxy_avprocess_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the av processors, the processors already created
+ * keep their settings.
+ */
+void
+proxy_avprocess_config_set (const ProxyAVConfig * config)
 {
-  uint32_t data_expect_recv = 0;
-  uint32_t data_current_recv = 0;
-  int32_t i;
-  
-  p_return_val_if_fail (processor != NULL, FALSE);
+  p_return_if_fail (config != NULL);
 
-  data_expect_recv = processor->handle.data_buf->data_len;
-  
-  for (i = 0; i < processor->handle.single_count; i++) {
-    data_current_recv += processor->handle.singles[i].buffer_pos;
-  }
-
-  return (data_expect_recv == data_current_recv);
+  pthread_mutex_lock (&avprocess_config_lock);
+  avprocess_config = *config;
+  pthread_mutex_unlock (&avprocess_config_lock);
 }
 
 /**
  * proxy_avprocess_create:
  * @url: The target address
+ * @range: Range header value of the client, NULL to get the whole content
  * @func: Callback function user registered for write data back
  * @user_data: user param
  * 
- * Create a av processor to handle url. 
+ * Create a av processor to handle url. A single range of @range is got
+ * from its first byte and answered as partial content, any other range is
+ * ignored and the whole content is sent.
  * 
  * Returns: processor handle.
  */
 PROCESSOR_HANDLE
-proxy_avprocess_create (char * url, AVProcessWrite func, void * user_data)
+proxy_avprocess_create (char * url, const char * range, AVProcessWrite func, void * user_data)
 {
   ProxyAVProcessor *processor;
-  MULTI_HANDLE multi_handle;
+  ProxyBandwidthEstimate estimate;
+  BOOL started;
   
   p_return_val_if_fail (url != NULL, 0);
 
@@ -416,16 +2379,35 @@ proxy_avprocess_create (char * url, AVProcessWrite func, void * user_data)
   processor->url = strdup(url);
   processor->func = func;
   processor->user_data = user_data;
-
-  if ((multi_handle = proxy_curl_multi_task_create()) == NULL) {
-    pri_error ("Creating multi task failed\n");
-    return FALSE;
+  if (range != NULL)
+    avprocess_range_parse (processor, range);
+
+  /* Start from what the last session to this origin has learnt */
+  if (proxy_bandwidth_lookup (url, &estimate)) {
+    processor->tuner.single_limit = estimate.single_limit;
+    processor->tuner.window_size = estimate.window_size;
+    processor->tuner.piece_rate = estimate.piece_rate;
+    processor->tuner.rtt = estimate.rtt;
   }
-  processor->handle.multi = multi_handle;
 
-  /* Try to get the requst header at first, the body receive will after that */
-  if (avprocess_header_obtain (processor, url) != CURL_SUCC) {
-    pri_error ("Getting header failed\n");
+  pthread_mutex_lock (&avprocess_config_lock);
+  processor->config = avprocess_config;
+  pthread_mutex_unlock (&avprocess_config_lock);
+  processor->tuner.ramp_size = processor->config.ramp_first_size;
+
+  /* The transfers are driven by the engine I/O threads from now on */
+  if ((processor->handle.session = proxy_curl_engine_attach()) == NULL) {
+    pri_error ("Attaching to engine failed\n");
+    goto avprocessor_create_failed;
+  }
+  processor->handle.multi = proxy_curl_engine_multi (processor->handle.session);
+
+  /* Request the first data at once, the header comes with it */
+  proxy_curl_engine_lock (processor->handle.session);
+  started = avprocess_head_start (processor);
+  proxy_curl_engine_unlock (processor->handle.session);
+  if (!started) {
+    pri_error ("Starting first piece failed\n");
     goto avprocessor_create_failed;
   }   
 
@@ -435,6 +2417,62 @@ avprocessor_create_failed:
   return 0;  
 }
 
+/**
+ * avprocess_tail_wait:
+ * @processor: processor handle
+ *
+ * The player going away from the start is about to seek to the end, let
+ * the tail come for %AV_TAIL_WAIT milliseconds at most. The other pieces
+ * are stopped at once.
+ */
+static void
+avprocess_tail_wait (ProxyAVProcessor *processor)
+{
+  ProxyAVSingleBuffer *single;
+  double deadline = avprocess_time_now () + AV_TAIL_WAIT/1000.0;
+  struct timeval wait;
+  fd_set read_fd_set;
+  int fd;
+  int32_t i;
+
+  proxy_curl_engine_lock (processor->handle.session);
+  for (i = 0; i < MAX_SINGLE_COUNT; i++) {
+    single = &processor->handle.singles[i];
+    if (single->item != NULL && single->item != processor->tail)
+      avprocess_single_release (processor, single);
+  }
+  proxy_curl_engine_unlock (processor->handle.session);
+
+  fd = proxy_curl_engine_fd (processor->handle.session);
+  while (fd >= 0 && avprocess_time_now () < deadline) {
+    proxy_curl_engine_lock (processor->handle.session);
+    proxy_curl_engine_clear (processor->handle.session);
+    avprocess_task_reap (processor);
+    avprocess_tail_done (processor);
+    if (processor->tail != NULL && !avprocess_retry_start (processor))
+      avprocess_tail_drop (processor);
+
+    /* The single tasks freed go on with the rest of the tail */
+    for (i = 0; processor->tail != NULL && i < MAX_SINGLE_COUNT; i++) {
+      single = &processor->handle.singles[i];
+      if (processor->handle.single_count >= processor->tuner.single_limit
+          || processor->tail->piece_next >= processor->tail->data_len)
+        break;
+      if (single->item == NULL && !avprocess_piece_start (processor, single, processor->tail))
+        avprocess_tail_drop (processor);
+    }
+    proxy_curl_engine_unlock (processor->handle.session);
+    if (processor->tail == NULL)
+      break;
+
+    FD_ZERO (&read_fd_set);
+    FD_SET (fd, &read_fd_set);
+    wait.tv_sec = 0;
+    wait.tv_usec = AV_IDLE_WAIT*1000;
+    select (fd + 1, &read_fd_set, NULL, NULL, &wait);
+  }
+}
+
 /**
  * proxy_avprocess_destroy
  * @handle: processor handle create by @proxy_avprocess_create
@@ -448,27 +2486,44 @@ proxy_avprocess_destroy (PROCESSOR_HANDLE handle)
   ProxyAVBufferItem * item;
 
   p_return_if_fail (processor != NULL);
-  
-  avprocess_multi_task_free(processor);
 
-  if (processor->handle.multi != 0) {
-    proxy_curl_multi_task_destroy (processor->handle.multi);
+  if (processor->tail != NULL && !processor->failed)
+    avprocess_tail_wait (processor);
+  
+  /* No callback runs any more once detached, the buffers can go */
+  if (processor->handle.session != NULL) {
+    proxy_curl_engine_lock (processor->handle.session);
+    avprocess_multi_task_free(processor);
+    proxy_curl_engine_unlock (processor->handle.session);
+    proxy_curl_engine_detach (processor->handle.session);
+    processor->handle.session = NULL;
     processor->handle.multi = 0;
   }
 
   /* Now free all buffer items */
+  if (processor->tail) {
+    avprocess_buffer_item_free (processor, processor->tail);
+    processor->tail = NULL;
+  }
   if (processor->handle.head_buf) {
-    avprocess_buffer_item_free (processor->handle.head_buf);
+    avprocess_buffer_item_free (processor, processor->handle.head_buf);
     processor->handle.head_buf = NULL;
   }
-  if (processor->handle.data_buf) {
-    avprocess_buffer_item_free (processor->handle.data_buf);
-    processor->handle.data_buf = NULL;
+  while (processor->handle.window_count > 0) {
+    item = processor->handle.window[processor->handle.window_head];
+    avprocess_buffer_item_free (processor, item);
+    processor->handle.window[processor->handle.window_head] = NULL;
+    processor->handle.window_head = (processor->handle.window_head + 1) % AV_WINDOW_COUNT;
+    processor->handle.window_count--;
+  }
+  if (processor->data) {
+    avprocess_buffer_item_free (processor, processor->data);
+    processor->data = NULL;
   }
   if (processor->mem_queue) {
     item = proxy_queue_pop_head (processor->mem_queue);
     while (item) {
-      avprocess_buffer_item_free (item);
+      avprocess_buffer_item_free (processor, item);
       item = proxy_queue_pop_head (processor->mem_queue);
     }
     proxy_queue_free (processor->mem_queue);
@@ -476,15 +2531,75 @@ proxy_avprocess_destroy (PROCESSOR_HANDLE handle)
   if (processor->data_queue) {
     item = proxy_queue_pop_head (processor->data_queue);
     while (item) {
-      avprocess_buffer_item_free (item);
+      avprocess_buffer_item_free (processor, item);
       item = proxy_queue_pop_head (processor->data_queue);
     }
     proxy_queue_free (processor->data_queue);
   }
+  proxy_pool_user_leave (&processor->pool_user);
+  if (processor->cache)
+    proxy_cache_close (processor->cache);
+  proxy_curl_header_list_free (processor->piece_headers);
+  free (processor->location);
+  free (processor->url);
   
   free (processor);
 }
 
+/**
+ * avprocess_perform:
+ * @processor: processor handle, its engine session locked
+ *
+ * Take what the engine has got for the transfers and start the next ones.
+ *
+ * Returns: The same as @proxy_avprocess_perform.
+ */
+static int32_t
+avprocess_perform (ProxyAVProcessor *processor)
+{
+  if (processor->failed)
+    return CURL_FAIL;
+
+  /* Whatever the engine does from now on wakes the caller up again */
+  proxy_curl_engine_clear (processor->handle.session);
+
+  /* Release the finished pieces and push the completed windows to data queue */
+  avprocess_task_reap (processor);
+  if (processor->failed) {
+    pri_error ("Getting content failed\n");
+    return CURL_FAIL;
+  }
+  avprocess_tail_done (processor);
+  avprocess_window_deliver (processor);
+  avprocess_stream_resume (processor);
+  avprocess_tune (processor);
+  if (!avprocess_retry_start (processor)) {
+    pri_error ("Getting content failed\n");
+    return CURL_FAIL;
+  }
+
+  /* Data content receive done, no more task needed */
+  if (processor->handle.head_buf == NULL
+      && processor->start >= processor->end
+      && processor->handle.window_count == 0) {
+    pri_debug ("All content download done\n");
+    return 0;
+  }
+
+  /* Keep every single task busy with the next pieces ahead of the reader,
+   * the engine starts them as soon as they are added */
+  if (!avprocess_task_schedule (processor)) {
+    pri_error ("Schedule task failed\n");
+    return CURL_FAIL;
+  }
+
+  /* Not done but waiting for memory or for the reader, tell the caller to go on */
+  if (processor->handle.single_count == 0)
+    return 1;
+
+  return (int32_t)processor->handle.single_count; 
+}
+
 /**
  * proxy_avprocess_perform:
  * @handle: processor handle create by @proxy_avprocess_create
@@ -498,76 +2613,187 @@ int32_t
 proxy_avprocess_perform (PROCESSOR_HANDLE handle)
 {
   ProxyAVProcessor *processor = (ProxyAVProcessor *)handle;
-  int32_t running_handles;
+  int32_t ret;
   
   p_return_val_if_fail (processor != NULL, CURL_FAIL);
 
-  if (proxy_curl_multi_perform_async(processor->handle.multi, \
-      &running_handles) != CURL_SUCC) {
-    pri_error ("multi perform failed\n");
-    return CURL_FAIL;
-  }
-
-  /* No longer any transfers in progress, now pushing buffer item to data queue */
-  if (running_handles == 0) {
-    /* Save the header buffer item to the data queue if needed */
-    if (processor->handle.head_buf) {
-      proxy_queue_push_tail (processor->data_queue, \
-        processor->handle.head_buf);
-      processor->handle.head_buf = NULL;
-    }
-
-    /* Save the body buffer item to the data queue if needed */
-    if (processor->handle.data_buf) {
-      if (!avprocess_data_recv_done(processor)) {
-        pri_warning ("Expect data not receive done.\n");
-      }
-      proxy_queue_push_tail (processor->data_queue, \
-        processor->handle.data_buf);
-      processor->handle.data_buf = NULL;
-    }
-
-    /* Data content receive done, no more task needed */
-    if (processor->start >= processor->content_length 
-        && processor->content_length > 0) {
-      pri_debug ("All content download done\n");
-      return 0;
-    }
-
-    /* Now rebuild and start data downloading task without asking for header data */
-    avprocess_multi_task_free (processor);    
-    if (!avprocess_multi_task_build (processor, MAX_SINGLE_COUNT, FALSE)) {
-      pri_error ("Bulid multi task failed\n");
-      return 0;
-    }
-    if (proxy_curl_multi_perform_async(processor->handle.multi, \
-        &running_handles) != CURL_SUCC) {
-      pri_error ("multi perform failed\n");
-      return CURL_FAIL;
-    }
-  }
+  proxy_curl_engine_lock (processor->handle.session);
+  ret = avprocess_perform (processor);
+  proxy_curl_engine_unlock (processor->handle.session);
 
-  return running_handles; 
+  return ret;
 }
 
 /**
  * proxy_avprocess_fdset:
  * @handle: processor handle create by @proxy_avprocess_create
  * 
- * Extracts all file descriptor information from a given @multi_handle
+ * Extracts the file descriptor becoming readable once the engine has got
+ * something for the transfers of @handle. The sockets themselves are waited
+ * on by the engine.
  *
  * Returns: CURL_SUCC on success or CURL_FAIL error.
  */
 int32_t
 proxy_avprocess_fdset (PROCESSOR_HANDLE handle,fd_set * read_fd_set,
     fd_set * write_fd_set,fd_set * exc_fd_set,int * max_fd)
+{
+  ProxyAVProcessor *processor = (ProxyAVProcessor *)handle;
+  int fd;
+
+  p_return_val_if_fail (processor != NULL, CURL_FAIL);
+  p_return_val_if_fail (read_fd_set != NULL, CURL_FAIL);
+  p_return_val_if_fail (max_fd != NULL, CURL_FAIL);
+
+  if ((fd = proxy_curl_engine_fd (processor->handle.session)) < 0)
+    return CURL_FAIL;
+
+  FD_SET (fd, read_fd_set);
+  if (fd > *max_fd)
+    *max_fd = fd;
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_avprocess_timeout:
+ * @handle: processor handle create by @proxy_avprocess_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_avprocess_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_avprocess_timeout (PROCESSOR_HANDLE handle, int32_t * timeout_ms)
 {
   ProxyAVProcessor *processor = (ProxyAVProcessor *)handle;
 
   p_return_val_if_fail (processor != NULL, CURL_FAIL);
+  p_return_val_if_fail (timeout_ms != NULL, CURL_FAIL);
+
+  /* The curl timers are run by the engine. Waiting for memory or for the
+   * reader has no file descriptor to wait on */
+  proxy_curl_engine_lock (processor->handle.session);
+  *timeout_ms = (processor->handle.single_count == 0 || processor->stream_paused
+      || avprocess_retry_pending (processor) || avprocess_share_pending (processor)) \
+      ? AV_IDLE_WAIT : AV_MAX_WAIT;
+  proxy_curl_engine_unlock (processor->handle.session);
+
+  return CURL_SUCC;
+}
+
+/**
+ * avprocess_peek:
+ * @processor: processor handle, its engine session locked
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Returns: The same as @proxy_avprocess_peek.
+ */
+static int32_t
+avprocess_peek (ProxyAVProcessor * processor, struct iovec * iov, int32_t iov_count)
+{
+  ProxyAVBufferItem * item = processor->data;
+  uint32_t index = 0;
+  uint32_t ready;
+  int32_t count = 0;
+
+  /* The items received done come first */
+  if (item == NULL)
+    item = proxy_queue_peek_nth (processor->data_queue, index++);
+  while (item != NULL && count < iov_count) {
+    if (item->offset < item->data_len) {
+      iov[count].iov_base = item->buffer + item->offset;
+      iov[count].iov_len = item->data_len - item->offset;
+      count++;
+    }
+    item = proxy_queue_peek_nth (processor->data_queue, index++);
+  }
+
+  /* Then what the oldest window has got so far */
+  if (item == NULL && count < iov_count
+      && (item = avprocess_window_peek (processor, &ready)) != NULL) {
+    iov[count].iov_base = item->buffer + item->offset;
+    iov[count].iov_len = ready - item->offset;
+    count++;
+  }
+
+  /* No data available now, and none will come if getting content failed */
+  if (count == 0 && processor->failed)
+    return CURL_FAIL;
+
+  return count;
+}
+
+/**
+ * avprocess_consume:
+ * @processor: processor handle, its engine session locked
+ * @len: bytes used from the regions got by @avprocess_peek
+ *
+ * Returns: The number of bytes consumed.
+ */
+static uint32_t
+avprocess_consume (ProxyAVProcessor * processor, uint32_t len)
+{
+  ProxyAVBufferItem * item;
+  uint32_t consumed = 0;
+  uint32_t length;
+  uint32_t ready;
+
+  while (consumed < len) {
+    if (!processor->data)
+      processor->data = proxy_queue_pop_head (processor->data_queue);
+
+    if ((item = processor->data) != NULL)
+      length = item->data_len - item->offset;
+    else if ((item = avprocess_window_peek (processor, &ready)) != NULL)
+      length = ready - item->offset;
+    else
+      break;
+
+    if (length > len - consumed)
+      length = len - consumed;
+    item->offset += length;
+    consumed += length;
+
+    /* Only the window items carry pieces, the header does not move the reader */
+    if (item->piece_size > 0)
+      processor->read_pos = item->start + item->offset;
+
+    if (item == processor->data && item->offset >= item->data_len) {
+      avprocess_buffer_item_recycle (processor, item);
+      processor->data = NULL;
+    }
+  }
+  avprocess_stream_resume (processor);
+
+  return consumed;
+}
+
+/**
+ * avprocess_read:
+ * @processor: processor handle, its engine session locked
+ * @buf: pointer to buffer where data will be written,Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Returns: The same as @proxy_avprocess_read.
+ */
+static int32_t
+avprocess_read (ProxyAVProcessor * processor, char * buf, uint32_t len)
+{
+  struct iovec iov;
+  int32_t count;
+  uint32_t read_length;
+
+  if ((count = avprocess_peek (processor, &iov, 1)) <= 0)
+    return count;
 
-  return proxy_curl_multi_fdset (processor->handle.multi, \
-      read_fd_set, write_fd_set, exc_fd_set, max_fd);
+  read_length = (iov.iov_len > len) ? len : (uint32_t)iov.iov_len;
+  memcpy (buf, iov.iov_base, read_length);
+
+  return (int32_t)avprocess_consume (processor, read_length);
 }
 
 /**
@@ -586,44 +2812,67 @@ int32_t
 proxy_avprocess_read (PROCESSOR_HANDLE handle, char * buf, uint32_t len)
 {
   ProxyAVProcessor * processor = (ProxyAVProcessor *)handle;
-  ProxyAVBufferItem * item;
-  uint32_t remain_length;
-  uint32_t read_length;
-  BOOL exhausted = FALSE;
+  int32_t ret;
 
   p_return_val_if_fail (processor != NULL, CURL_FAIL);
   p_return_val_if_fail (buf != NULL, CURL_FAIL);
 
-  if (!processor->data)
-    processor->data = proxy_queue_pop_head (processor->data_queue);
-    
-  /* No data available now */
-  if (!processor->data)
-    return 0;
+  /* The window being read is still written by the engine */
+  proxy_curl_engine_lock (processor->handle.session);
+  ret = avprocess_read (processor, buf, len);
+  proxy_curl_engine_unlock (processor->handle.session);
 
-  item = processor->data;
-  if (item->offset >= item->data_len) {
-    exhausted = TRUE;
-    goto Exhausted;
-  }
+  return ret;
+}
 
-  remain_length = item->data_len - item->offset;  
-  if (remain_length > len) {
-    read_length = len;
-  } else {
-    read_length = remain_length;
-    exhausted = TRUE;
-  }
+/**
+ * proxy_avprocess_peek:
+ * @handle: av processor handle
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order. The
+ * regions stay valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_avprocess_peek (PROCESSOR_HANDLE handle, struct iovec * iov, int32_t iov_count)
+{
+  ProxyAVProcessor * processor = (ProxyAVProcessor *)handle;
+  int32_t ret;
 
-  memcpy (buf, item->buffer+item->offset, read_length);  
-  item->offset += read_length;
+  p_return_val_if_fail (processor != NULL, CURL_FAIL);
+  p_return_val_if_fail (iov != NULL, CURL_FAIL);
 
-Exhausted:  
-  if (exhausted) {
-    proxy_queue_push_tail(processor->mem_queue, item);
-    processor->data = NULL;
-  }
+  /* The regions only cover data received done, the engine is not writing there */
+  proxy_curl_engine_lock (processor->handle.session);
+  ret = avprocess_peek (processor, iov, iov_count);
+  proxy_curl_engine_unlock (processor->handle.session);
 
-  return (int32_t)read_length;
+  return ret;
 }
 
+/**
+ * proxy_avprocess_consume:
+ * @handle: av processor handle
+ * @len: bytes used from the regions got by @proxy_avprocess_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_avprocess_consume (PROCESSOR_HANDLE handle, uint32_t len)
+{
+  ProxyAVProcessor * processor = (ProxyAVProcessor *)handle;
+  uint32_t consumed;
+
+  p_return_val_if_fail (processor != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (processor->handle.session);
+  consumed = avprocess_consume (processor, len);
+  proxy_curl_engine_unlock (processor->handle.session);
+
+  return (int32_t)consumed;
+}
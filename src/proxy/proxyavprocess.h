@@ -2,10 +2,40 @@
 #define __PROXY_AV_PROCESS_H__
 
 #include <sys/select.h>
+#include <sys/uio.h>
 
-#define MAX_SINGLE_COUNT 6 /* max single task count */
+#define MAX_SINGLE_COUNT 8 /* max single task count */
+#define DEFAULT_SINGLE_COUNT 4 /* single task count before anything is measured */
 
 #define DEFAULT_AV_BUFFER_SIZE (1*1024*1024)
+#define MIN_AV_BUFFER_SIZE (256*1024)
+#define MAX_AV_BUFFER_SIZE (4*1024*1024)
+#define MIN_AV_PIECE_SIZE (64*1024) /* smaller pieces are not worth a request */
+#define AV_STEAL_MIN_SIZE (2*MIN_AV_PIECE_SIZE) /* min remaining of a piece to split */
+
+#define AV_TUNE_PERIOD 1.0 /* seconds between two throughput measures */
+#define AV_TUNE_GAIN 1.1 /* rate ratio a single task count change must earn */
+#define AV_TUNE_PROBE_PERIODS 4 /* settled periods before probing again */
+#define AV_TUNE_PIECE_RTTS 8 /* a piece should last this many round trips */
+
+#define AV_WINDOW_COUNT 3 /* max window count in flight ahead of the reader */
+#define AV_MAX_WAIT 1000 /* max milliseconds to wait for the engine before performing again */
+#define AV_IDLE_WAIT 100 /* milliseconds to wait with no transfer running */
+#define AV_RETRY_MAX 5 /* times the rest of a failed piece is requested again */
+#define AV_RETRY_FIRST_WAIT 200 /* milliseconds before the first retry, doubled on each */
+#define AV_RETRY_MAX_WAIT 3000 /* max milliseconds before a retry */
+#define AV_HEAD_BUFFER_SIZE (32*1024) /* max length of the header handed to the client */
+
+#define DEFAULT_AV_RAMP_FIRST_SIZE (32*1024) /* first window size while slow starting */
+#define DEFAULT_AV_RAMP_FACTOR 2 /* growth of each window over the previous one while slow starting */
+#define DEFAULT_AV_READ_AHEAD (8*1024*1024) /* max content downloaded ahead of the reader */
+#define AV_STREAM_BUFFER_SIZE (256*1024) /* size of each buffer a streamed body is written into */
+#define AV_STREAM_BUFFER_LIMIT (4*1024*1024) /* max streamed body buffered ahead of the reader */
+#define AV_CACHE_WINDOW_SIZE (4*1024*1024) /* max size of a window read from the disk cache */
+#define AV_SHARE_COUNT 64 /* windows shared between the processors at a time */
+#define AV_TAIL_MAX_SIZE MAX_AV_BUFFER_SIZE /* max length of the content tail prefetched */
+#define AV_TAIL_KEEP_TIME 30 /* seconds a prefetched tail is kept for the player to seek to */
+#define AV_TAIL_WAIT 5000 /* max milliseconds a processor destroyed waits for its tail */
 
 typedef void* PROCESSOR_HANDLE;
 
@@ -13,8 +43,22 @@ typedef uint32_t (*AVProcessWrite) (void *content, uint32_t size, uint32_t nmemb
 
 typedef struct _ProxyAVSingleBuffer ProxyAVSingleBuffer;
 typedef struct _ProxyAVBufferItem ProxyAVBufferItem;
+typedef struct _ProxyAVShared ProxyAVShared;
 typedef struct _ProxyAVTaskHandle ProxyAVTaskHandle;
+typedef struct _ProxyAVTuner ProxyAVTuner;
 typedef struct _ProxyAVProcessor ProxyAVProcessor;
+typedef struct _ProxyAVConfig ProxyAVConfig;
+
+/**
+ * ProxyAVConfig:
+ *
+ * Settings shared by all the av processors, taken by each processor on creation.
+ */
+struct _ProxyAVConfig {
+  uint32_t ramp_first_size; /* size of the first window, 0 to start at the full window size */
+  uint32_t ramp_factor;     /* growth of each window over the previous one until the full window size */
+  uint32_t read_ahead;      /* max content downloaded ahead of the reader, 0 for no limit */
+};
 
 /**
  * ProxyAVSingleBuffer:
@@ -23,21 +67,35 @@ typedef struct _ProxyAVProcessor ProxyAVProcessor;
  */
 struct _ProxyAVSingleBuffer {
   void * single_handle;
+  ProxyAVProcessor * processor;
+
+  ProxyAVBufferItem * item; /* the window item this piece belongs to, NULL if idle */
   
   char *  buffer;           /* buffer to store cached data*/
   uint32_t  buffer_len;       /* currently allocated buffers length */
   uint32_t  buffer_pos;       /* end of data in buffer*/    
+  BOOL      stolen;           /* the tail has been handed to another single task */
+  BOOL      located;          /* the piece is sent to the location of the processor */
+  uint32_t  status;           /* status code of the response the piece is got from */
+  BOOL      waiting;          /* the piece has failed, the single task is out of the multi task */
+  uint32_t  retries;          /* times the rest of the piece has been requested again */
+  double    retry_at;         /* time the rest of the piece is requested again at */
 };
 
 struct _ProxyAVTaskHandle {
+  /* engine session driving @multi, locked while touching anything below */
+  void * session;
+
   /* multi task handle */
   void * multi;
 
   /* the buffer item now using for storing head */
   ProxyAVBufferItem * head_buf;
 
-  /* the buffer item now using for storing body */
-  ProxyAVBufferItem * data_buf;
+  /* the window items now downloading body, in content order */
+  ProxyAVBufferItem * window[AV_WINDOW_COUNT];
+  uint32_t window_head;     /* index of the oldest window item */
+  uint32_t window_count;    /* window items in flight */
 
   /* running single task count */
   uint32_t single_count;
@@ -46,6 +104,28 @@ struct _ProxyAVTaskHandle {
   ProxyAVSingleBuffer singles[MAX_SINGLE_COUNT];
 };
 
+/**
+ * ProxyAVTuner:
+ *
+ * Throughput measurement driving the piece count and window size of a processor.
+ */
+struct _ProxyAVTuner {
+  uint32_t single_limit;    /* parallel pieces now allowed */
+  uint32_t window_size;     /* size of the next window */
+  uint32_t ramp_size;       /* size of the next window while slow starting, 0 once ramped up */
+  int32_t  last_change;     /* last change of @single_limit, 0 when settled */
+  uint32_t settled;         /* periods passed since settled */
+  BOOL     probe_down;      /* direction of the next probe */
+
+  double   rate;            /* aggregate rate of the last period, bytes/s */
+  double   piece_rate;      /* smoothed rate of a single piece, bytes/s */
+  double   rtt;             /* smoothed request round trip, seconds */
+
+  double   period_start;    /* start time of the measure period, 0 if idle */
+  uint64_t period_bytes;    /* bytes received at @period_start */
+  uint64_t recv_bytes;      /* bytes received by the finished pieces */
+};
+
 /**
  * ProxyAVProcessor:
  * 
@@ -56,11 +136,62 @@ struct _ProxyAVProcessor {
   /* the target url*/
   char * url;
 
-  /* content length */
-  uint32_t content_length;
+  /* url the redirects of @url end at, the pieces go there at once, NULL if unknown */
+  char * location;
+
+  /* validators of the content got from the first response, empty if none */
+  char etag[128];
+  char last_modified[64];
+
+  /* extra request headers making sure the pieces get the same content */
+  void * piece_headers;
+
+  /* content length, 0 if unknown */
+  uint64_t content_length;
+
+  /* the client asks for a single range, it is answered as partial content */
+  BOOL ranged;
+
+  /* content position of the first byte the client asks for, and the one
+   * after the last, 0 for the end of the content */
+  uint64_t range_start;
+  uint64_t range_end;
+
+  /* content position after the last byte to get, known once the header is got */
+  uint64_t end;
 
   /* target data position to download */
-  uint32_t start;
+  uint64_t start;
+
+  /* content position the reader has got to */
+  uint64_t read_pos;
+
+  /* @start is as far ahead of @read_pos as allowed, no window is opened */
+  BOOL paused;
+
+  /* status code of the response the header is being got from */
+  uint32_t status;
+
+  /* the response being got is a redirect */
+  BOOL redirect;
+
+  /* getting content failed, no more data will come */
+  BOOL failed;
+
+  /* the body is got by the first single task as it comes, its length is
+   * unknown or the origin does not send ranges */
+  BOOL streaming;
+
+  /* the streaming transfer is paused until the reader catches up */
+  BOOL stream_paused;
+
+  /* the content kept on disk, the parts cached are not got again, NULL if
+   * the content is not cached */
+  void * cache;
+
+  /* the tail of an MP4 content with the movie box at the end, got while
+   * the player reads the start, NULL if none is being got */
+  ProxyAVBufferItem * tail;
   
   /* the user callback func and data */
   AVProcessWrite func;
@@ -75,8 +206,17 @@ struct _ProxyAVProcessor {
   /* The data buffer we can now read */
   ProxyAVBufferItem * data;
 
+  /* the buffers held from the process-wide pool */
+  ProxyPoolUser pool_user;
+
   /* task handle container */
   ProxyAVTaskHandle handle;
+
+  /* piece count and window size tuning */
+  ProxyAVTuner tuner;
+
+  /* settings taken on creation */
+  ProxyAVConfig config;
 };
 
 /**
@@ -89,20 +229,67 @@ struct _ProxyAVBufferItem {
   uint32_t  buffer_len;     /* length of the buffer */
   uint32_t  data_len;       /* total data length in the buffer */
   uint32_t  offset;         /* data start offset in the buffer */
+
+  uint64_t  start;          /* content position of the first byte in the buffer */
+  uint32_t  piece_size;     /* size of each piece downloading into the buffer */
+  uint32_t  piece_next;     /* buffer position where the next unassigned piece starts */
+  uint32_t  piece_running;  /* pieces still downloading into the buffer */
+
+  void *    map;            /* mapping of the disk cache the buffer is in, NULL if from the pool */
+  size_t    map_len;        /* length of @map */
+
+  ProxyAVShared * shared;   /* the buffer shared with the other processors, NULL if not shared */
+  BOOL      borrowed;       /* @shared is got by another processor, nothing is ready before it is done */
+};
+
+/**
+ * ProxyAVShared:
+ *
+ * A window being got by a processor, which the processors getting the same
+ * content at the same time read as well instead of getting it again. The
+ * buffer is given back to the pool once nobody holds it.
+ */
+struct _ProxyAVShared {
+  char *    url;            /* the target url of the processors */
+  char      validator[128]; /* strong ETag or Last-Modified of the content */
+  uint64_t  start;          /* content position of the first byte in the buffer */
+  uint32_t  length;         /* length of the window */
+
+  char *    buffer;         /* the window buffer, taken from the pool */
+  uint32_t  buffer_len;     /* length of the buffer */
+  ProxyPoolUser * pool_user; /* the user the buffer is charged to */
+
+  uint32_t  refs;           /* window items holding the buffer, and the table while kept */
+  double    kept_until;     /* time the table holds the buffer until, 0 if it goes with the last item */
+  BOOL      done;           /* the whole window has been received */
+  BOOL      failed;         /* the processor getting the window stopped before it was done */
 };
 
+/**
+ * proxy_avprocess_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the av processors, the processors already created
+ * keep their settings.
+ */
+void
+proxy_avprocess_config_set (const ProxyAVConfig * config);
+
 /**
  * proxy_avprocess_create:
  * @url: The target address
+ * @range: Range header value of the client, NULL to get the whole content
  * @func: Callback function user registered for write data back
  * @user_data: user param
  * 
- * Create a av processor to handle url. 
+ * Create a av processor to handle url. A single range of @range is got
+ * from its first byte and answered as partial content, any other range is
+ * ignored and the whole content is sent.
  * 
  * Returns: processor handle.
  */
 PROCESSOR_HANDLE
-proxy_avprocess_create (char * url, AVProcessWrite func, void * user_data);
+proxy_avprocess_create (char * url, const char * range, AVProcessWrite func, void * user_data);
 
 /**
  * proxy_avprocess_destroy
@@ -137,6 +324,19 @@ int32_t
 proxy_avprocess_fdset (PROCESSOR_HANDLE handle,fd_set * read_fd_set,
     fd_set * write_fd_set,fd_set * exc_fd_set,int * max_fd);
 
+/**
+ * proxy_avprocess_timeout:
+ * @handle: processor handle create by @proxy_avprocess_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_avprocess_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_avprocess_timeout (PROCESSOR_HANDLE handle, int32_t * timeout_ms);
+
 /**
  * proxy_avprocess_read:
  * @handle: av processor handle
@@ -152,4 +352,30 @@ proxy_avprocess_fdset (PROCESSOR_HANDLE handle,fd_set * read_fd_set,
 int32_t
 proxy_avprocess_read (PROCESSOR_HANDLE handle, char * buf, uint32_t len);
 
+/**
+ * proxy_avprocess_peek:
+ * @handle: av processor handle
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order. The
+ * regions stay valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_avprocess_peek (PROCESSOR_HANDLE handle, struct iovec * iov, int32_t iov_count);
+
+/**
+ * proxy_avprocess_consume:
+ * @handle: av processor handle
+ * @len: bytes used from the regions got by @proxy_avprocess_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_avprocess_consume (PROCESSOR_HANDLE handle, uint32_t len);
+
 #endif
@@ -0,0 +1,125 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "proxylog.h"
+#include "proxybandwidth.h"
+
+#define BANDWIDTH_ORIGIN_LEN 256
+
+typedef struct _ProxyBandwidthEntry ProxyBandwidthEntry;
+
+struct _ProxyBandwidthEntry {
+  char origin[BANDWIDTH_ORIGIN_LEN];  /* scheme://host:port, empty if unused */
+  time_t updated;
+  ProxyBandwidthEstimate estimate;
+};
+
+static ProxyBandwidthEntry bandwidth_table[BANDWIDTH_ORIGIN_COUNT];
+static pthread_mutex_t bandwidth_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * bandwidth_origin_get:
+ * @url: The target address
+ * @origin: where to store the origin
+ * @len: length of @origin
+ *
+ * Cut the scheme, host and port part out of @url.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+bandwidth_origin_get (const char * url, char * origin, size_t len)
+{
+  const char * p;
+  size_t origin_len;
+
+  p = strstr (url, "://");
+  p = (p != NULL) ? p + 3 : url;
+  origin_len = strcspn (p, "/?#") + (size_t)(p - url);
+
+  if (origin_len == 0 || origin_len >= len)
+    return FALSE;
+
+  memcpy (origin, url, origin_len);
+  origin[origin_len] = '\0';
+
+  return TRUE;
+}
+
+/**
+ * proxy_bandwidth_lookup:
+ * @url: The target address
+ * @estimate: where to store the estimate
+ *
+ * Look up the estimate of the origin serving @url.
+ *
+ * Returns: TRUE if the origin is known, FALSE otherwise.
+ */
+BOOL
+proxy_bandwidth_lookup (const char * url, ProxyBandwidthEstimate * estimate)
+{
+  char origin[BANDWIDTH_ORIGIN_LEN];
+  BOOL found = FALSE;
+  int32_t i;
+
+  p_return_val_if_fail (url != NULL, FALSE);
+  p_return_val_if_fail (estimate != NULL, FALSE);
+
+  if (!bandwidth_origin_get (url, origin, sizeof(origin)))
+    return FALSE;
+
+  pthread_mutex_lock (&bandwidth_lock);
+  for (i = 0; i < BANDWIDTH_ORIGIN_COUNT; i++) {
+    if (strcmp (bandwidth_table[i].origin, origin) == 0) {
+      *estimate = bandwidth_table[i].estimate;
+      found = TRUE;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&bandwidth_lock);
+
+  return found;
+}
+
+/**
+ * proxy_bandwidth_update:
+ * @url: The target address
+ * @estimate: the newest estimate
+ *
+ * Remember @estimate for the origin serving @url, the least recently
+ * updated origin is forgotten if the table is full.
+ */
+void
+proxy_bandwidth_update (const char * url, const ProxyBandwidthEstimate * estimate)
+{
+  char origin[BANDWIDTH_ORIGIN_LEN];
+  ProxyBandwidthEntry * entry = NULL;
+  int32_t i;
+
+  p_return_if_fail (url != NULL);
+  p_return_if_fail (estimate != NULL);
+
+  if (!bandwidth_origin_get (url, origin, sizeof(origin)))
+    return;
+
+  pthread_mutex_lock (&bandwidth_lock);
+  for (i = 0; i < BANDWIDTH_ORIGIN_COUNT; i++) {
+    if (strcmp (bandwidth_table[i].origin, origin) == 0) {
+      entry = &bandwidth_table[i];
+      break;
+    }
+    /* Unused entries have never been updated, so they go first */
+    if (entry == NULL || bandwidth_table[i].updated < entry->updated)
+      entry = &bandwidth_table[i];
+  }
+
+  strcpy (entry->origin, origin);
+  entry->updated = time (NULL);
+  entry->estimate = *estimate;
+  pthread_mutex_unlock (&bandwidth_lock);
+
+  pri_debug ("Origin %s rate %.0f B/s, rtt %.3f s, %u pieces, window %u\n", \
+      origin, estimate->rate, estimate->rtt, estimate->single_limit, \
+      estimate->window_size);
+}
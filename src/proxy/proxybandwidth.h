@@ -0,0 +1,47 @@
+#ifndef __PROXY_BANDWIDTH_H__
+#define __PROXY_BANDWIDTH_H__
+
+#include <stdint.h>
+#include "proxyqueue.h"
+
+#define BANDWIDTH_ORIGIN_COUNT 32 /* max origins remembered */
+
+typedef struct _ProxyBandwidthEstimate ProxyBandwidthEstimate;
+
+/**
+ * ProxyBandwidthEstimate:
+ *
+ * What the last session learnt about the link to an origin.
+ */
+struct _ProxyBandwidthEstimate {
+  double    rate;           /* aggregate download rate, bytes per second */
+  double    piece_rate;     /* download rate of a single piece, bytes per second */
+  double    rtt;            /* request round trip time, seconds */
+  uint32_t  single_limit;   /* parallel pieces saturating the link */
+  uint32_t  window_size;    /* window size fitting the link */
+};
+
+/**
+ * proxy_bandwidth_lookup:
+ * @url: The target address
+ * @estimate: where to store the estimate
+ *
+ * Look up the estimate of the origin serving @url.
+ *
+ * Returns: TRUE if the origin is known, FALSE otherwise.
+ */
+BOOL
+proxy_bandwidth_lookup (const char * url, ProxyBandwidthEstimate * estimate);
+
+/**
+ * proxy_bandwidth_update:
+ * @url: The target address
+ * @estimate: the newest estimate
+ *
+ * Remember @estimate for the origin serving @url, the least recently
+ * updated origin is forgotten if the table is full.
+ */
+void
+proxy_bandwidth_update (const char * url, const ProxyBandwidthEstimate * estimate);
+
+#endif
@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "proxyqueue.h"
+#include "proxycache.h"
+#include "proxylog.h"
+
+#define CACHE_DATA_SUFFIX ".cache"
+#define CACHE_MAP_SUFFIX ".cmap"
+
+typedef struct _ProxyCacheEntry ProxyCacheEntry;
+
+/**
+ * ProxyCacheEntry:
+ *
+ * A content found in the cache directory while trimming it.
+ */
+struct _ProxyCacheEntry {
+  char      name[32];         /* file name without the suffix */
+  time_t    used;             /* last time a handle opened or wrote the content */
+  uint64_t  size;             /* bytes on disk of the content and its map */
+};
+
+/* settings of the handles open from now on */
+static ProxyCacheConfig cache_config = {"", DEFAULT_CACHE_SIZE_LIMIT};
+static pthread_mutex_t cache_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bytes written to the cache since it was trimmed last */
+static uint64_t cache_written;
+
+/* one trim at a time, the others have nothing left to do */
+static pthread_mutex_t cache_trim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static BOOL
+cache_write_all (int fd, const char * buf, uint32_t len, off_t offset)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = pwrite (fd, buf, len, offset);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return FALSE;
+    buf += ret;
+    len -= (uint32_t)ret;
+    offset += ret;
+  }
+
+  return TRUE;
+}
+
+static uint32_t
+cache_block_length (ProxyCache * cache, uint32_t block)
+{
+  uint64_t block_start = (uint64_t)block*CACHE_BLOCK_SIZE;
+
+  if (cache->content_length - block_start < CACHE_BLOCK_SIZE)
+    return (uint32_t)(cache->content_length - block_start);
+
+  return CACHE_BLOCK_SIZE;
+}
+
+static BOOL
+cache_block_complete (ProxyCache * cache, uint32_t block)
+{
+  return cache->blocks[block] == cache_block_length (cache, block);
+}
+
+static int
+cache_entry_compare (const void * a, const void * b)
+{
+  const ProxyCacheEntry * entry_a = a;
+  const ProxyCacheEntry * entry_b = b;
+
+  if (entry_a->used != entry_b->used)
+    return (entry_a->used < entry_b->used) ? -1 : 1;
+
+  return 0;
+}
+
+/**
+ * cache_path_make:
+ * @path: where to store the path, %CACHE_PATH_SIZE bytes
+ * @directory: the cache directory
+ * @name: file name
+ * @suffix: appended to @name
+ *
+ * Returns: TRUE on success, FALSE if the path does not fit in @path.
+ */
+static BOOL
+cache_path_make (char * path, const char * directory, const char * name, const char * suffix)
+{
+  int length = snprintf (path, CACHE_PATH_SIZE, "%s/%s%s", directory, name, suffix);
+
+  return length > 0 && length < CACHE_PATH_SIZE;
+}
+
+/**
+ * cache_entry_remove:
+ * @directory: the cache directory
+ * @entry: the content to remove
+ *
+ * Remove the files of a content, unless a handle is using it.
+ *
+ * Returns: TRUE if the content has been removed.
+ */
+static BOOL
+cache_entry_remove (const char * directory, ProxyCacheEntry * entry)
+{
+  char path[CACHE_PATH_SIZE];
+  int map_fd;
+
+  if (!cache_path_make (path, directory, entry->name, CACHE_MAP_SUFFIX)
+      || (map_fd = open (path, O_RDWR)) < 0)
+    return FALSE;
+  if (flock (map_fd, LOCK_EX | LOCK_NB) != 0) {
+    close (map_fd);
+    return FALSE;
+  }
+
+  /* The map goes last, a data file without it is found by nobody */
+  unlink (path);
+  if (cache_path_make (path, directory, entry->name, CACHE_DATA_SUFFIX))
+    unlink (path);
+  close (map_fd);
+
+  return TRUE;
+}
+
+/**
+ * cache_trim:
+ * @config: settings of the cache
+ *
+ * Remove the contents used least recently until the cache is in its size
+ * limit again. The size is what the files really take on disk, the holes
+ * of the contents cached in part cost nothing.
+ */
+static void
+cache_trim (const ProxyCacheConfig * config)
+{
+  ProxyCacheEntry * entries = NULL;
+  ProxyCacheEntry * grown;
+  uint32_t entry_count = 0;
+  uint32_t entry_max = 0;
+  uint64_t total = 0;
+  char path[CACHE_PATH_SIZE];
+  struct dirent * dirent;
+  struct stat st;
+  size_t name_len;
+  uint32_t i;
+  DIR * dir;
+
+  if (config->size_limit == 0 || pthread_mutex_trylock (&cache_trim_lock) != 0)
+    return;
+
+  if ((dir = opendir (config->directory)) == NULL) {
+    pri_warning ("Opening %s failed: %s\n", config->directory, strerror(errno));
+    pthread_mutex_unlock (&cache_trim_lock);
+    return;
+  }
+
+  while ((dirent = readdir (dir)) != NULL) {
+    name_len = strlen (dirent->d_name);
+    if (name_len <= strlen(CACHE_MAP_SUFFIX) || name_len >= sizeof(entries->name)
+        || strcmp (dirent->d_name + name_len - strlen(CACHE_MAP_SUFFIX), CACHE_MAP_SUFFIX) != 0)
+      continue;
+
+    if (entry_count == entry_max) {
+      entry_max = entry_max ? entry_max*2 : 64;
+      if ((grown = realloc (entries, entry_max*sizeof(ProxyCacheEntry))) == NULL) {
+        pri_error ("malloc cache entries failed\n");
+        break;
+      }
+      entries = grown;
+    }
+
+    if (!cache_path_make (path, config->directory, dirent->d_name, "")
+        || stat (path, &st) != 0)
+      continue;
+    snprintf (entries[entry_count].name, sizeof(entries->name), "%.*s", \
+        (int)(name_len - strlen(CACHE_MAP_SUFFIX)), dirent->d_name);
+    entries[entry_count].used = st.st_mtime;
+    entries[entry_count].size = (uint64_t)st.st_blocks*512;
+
+    if (cache_path_make (path, config->directory, entries[entry_count].name, CACHE_DATA_SUFFIX)
+        && stat (path, &st) == 0)
+      entries[entry_count].size += (uint64_t)st.st_blocks*512;
+
+    total += entries[entry_count].size;
+    entry_count++;
+  }
+  closedir (dir);
+
+  if (total > config->size_limit) {
+    qsort (entries, entry_count, sizeof(ProxyCacheEntry), cache_entry_compare);
+    for (i = 0; i < entry_count && total > config->size_limit; i++) {
+      if (!cache_entry_remove (config->directory, &entries[i]))
+        continue;
+      pri_debug ("Removed %s from the cache, %llu bytes\n", entries[i].name, \
+          (unsigned long long)entries[i].size);
+      total -= entries[i].size;
+    }
+  }
+
+  free (entries);
+  pthread_mutex_unlock (&cache_trim_lock);
+}
+
+/**
+ * cache_map_load:
+ * @cache: cache handle, its map file open
+ * @validator: validator of the content now
+ *
+ * Take the blocks an earlier handle of the same content has completed.
+ * The blocks it has written in part are written again.
+ *
+ * Returns: TRUE if the map is of the same content, FALSE otherwise.
+ */
+static BOOL
+cache_map_load (ProxyCache * cache, const char * validator)
+{
+  ProxyCacheMapHeader header;
+  size_t map_len = cache->block_count*sizeof(uint32_t);
+  uint32_t block;
+
+  if (pread (cache->map_fd, &header, sizeof(header), 0) != sizeof(header))
+    return FALSE;
+  if (memcmp (header.magic, CACHE_MAP_MAGIC, sizeof(CACHE_MAP_MAGIC)) != 0
+      || header.content_length != cache->content_length
+      || header.block_size != CACHE_BLOCK_SIZE
+      || strncmp (header.validator, validator, sizeof(header.validator)) != 0)
+    return FALSE;
+
+  if (pread (cache->map_fd, cache->blocks, map_len, sizeof(header)) != (ssize_t)map_len)
+    return FALSE;
+
+  for (block = 0; block < cache->block_count; block++) {
+    if (!cache_block_complete (cache, block))
+      cache->blocks[block] = 0;
+  }
+
+  return TRUE;
+}
+
+/**
+ * cache_map_new:
+ * @cache: cache handle, its files open
+ * @validator: validator of the content now
+ *
+ * Start the files over for the content now.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+cache_map_new (ProxyCache * cache, const char * validator)
+{
+  ProxyCacheMapHeader header;
+  uint32_t map_len = cache->block_count*(uint32_t)sizeof(uint32_t);
+
+  memset (&header, 0, sizeof(header));
+  memcpy (header.magic, CACHE_MAP_MAGIC, sizeof(CACHE_MAP_MAGIC));
+  header.content_length = cache->content_length;
+  header.block_size = CACHE_BLOCK_SIZE;
+  snprintf (header.validator, sizeof(header.validator), "%s", validator);
+
+  memset (cache->blocks, 0, map_len);
+
+  /* The data file is sparse, only the blocks got take disk */
+  if (ftruncate (cache->data_fd, 0) != 0
+      || ftruncate (cache->data_fd, (off_t)cache->content_length) != 0
+      || ftruncate (cache->map_fd, 0) != 0
+      || !cache_write_all (cache->map_fd, (char *)&header, sizeof(header), 0)
+      || !cache_write_all (cache->map_fd, (char *)cache->blocks, map_len, sizeof(header)))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * proxy_cache_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the media cache, the handles already open keep
+ * their settings.
+ */
+void
+proxy_cache_config_set (const ProxyCacheConfig * config)
+{
+  p_return_if_fail (config != NULL);
+
+  pthread_mutex_lock (&cache_config_lock);
+  cache_config = *config;
+  pthread_mutex_unlock (&cache_config_lock);
+}
+
+/**
+ * proxy_cache_enabled:
+ *
+ * Returns: TRUE if a directory to keep the contents in is set.
+ */
+BOOL
+proxy_cache_enabled (void)
+{
+  BOOL enabled;
+
+  pthread_mutex_lock (&cache_config_lock);
+  enabled = (cache_config.directory[0] != '\0');
+  pthread_mutex_unlock (&cache_config_lock);
+
+  return enabled;
+}
+
+/**
+ * proxy_cache_open:
+ * @key: what tells the content, the url it is got from
+ * @validator: strong ETag or Last-Modified of the content
+ * @content_length: length of the whole content
+ *
+ * Open the cached content for @key, made again if it was cached with
+ * another validator or length.
+ *
+ * Returns: cache handle, NULL if the cache is disabled or the content is
+ * being used by another handle.
+ */
+CACHE_HANDLE
+proxy_cache_open (const char * key, const char * validator, uint64_t content_length)
+{
+  ProxyCache * cache;
+  uint64_t hash = 14695981039346656037ULL;
+  char name[17];
+  const char * p;
+
+  p_return_val_if_fail (key != NULL, NULL);
+  p_return_val_if_fail (validator != NULL, NULL);
+
+  /* Blocks of another content must never be taken as this one */
+  if (validator[0] == '\0' || content_length == 0 || !proxy_cache_enabled ())
+    return NULL;
+
+  if ((cache = calloc (1, sizeof(ProxyCache))) == NULL) {
+    pri_error ("malloc cache handle failed\n");
+    return NULL;
+  }
+  cache->data_fd = -1;
+  cache->map_fd = -1;
+  cache->content_length = content_length;
+  cache->block_count = (uint32_t)((content_length + CACHE_BLOCK_SIZE - 1)/CACHE_BLOCK_SIZE);
+
+  pthread_mutex_lock (&cache_config_lock);
+  cache->config = cache_config;
+  pthread_mutex_unlock (&cache_config_lock);
+
+  if ((cache->blocks = calloc (cache->block_count, sizeof(uint32_t))) == NULL) {
+    pri_error ("malloc cache block map failed\n");
+    goto cache_open_failed;
+  }
+
+  for (p = key; *p; p++)
+    hash = (hash ^ (uint8_t)*p) * 1099511628211ULL;
+  snprintf (name, sizeof(name), "%016llx", (unsigned long long)hash);
+  if (!cache_path_make (cache->data_path, cache->config.directory, name, CACHE_DATA_SUFFIX)
+      || !cache_path_make (cache->map_path, cache->config.directory, name, CACHE_MAP_SUFFIX)) {
+    pri_warning ("Cache directory %s too long\n", cache->config.directory);
+    goto cache_open_failed;
+  }
+
+  cache->map_fd = open (cache->map_path, O_RDWR | O_CREAT, 0600);
+  if (cache->map_fd < 0) {
+    pri_warning ("Opening %s failed: %s\n", cache->map_path, strerror(errno));
+    goto cache_open_failed;
+  }
+  /* A content is written by one handle at a time, the others get it from the network */
+  if (flock (cache->map_fd, LOCK_EX | LOCK_NB) != 0) {
+    pri_debug ("%s is being cached by another session\n", key);
+    goto cache_open_failed;
+  }
+
+  cache->data_fd = open (cache->data_path, O_RDWR | O_CREAT, 0600);
+  if (cache->data_fd < 0) {
+    pri_warning ("Opening %s failed: %s\n", cache->data_path, strerror(errno));
+    goto cache_open_failed;
+  }
+
+  if (!cache_map_load (cache, validator) && !cache_map_new (cache, validator)) {
+    pri_warning ("Creating %s failed: %s\n", cache->data_path, strerror(errno));
+    goto cache_open_failed;
+  }
+
+  /* The time of the map tells how recently the content has been used */
+  futimens (cache->map_fd, NULL);
+
+  return (CACHE_HANDLE)cache;
+cache_open_failed:
+  proxy_cache_close ((CACHE_HANDLE)cache);
+  return NULL;
+}
+
+/**
+ * proxy_cache_close:
+ * @handle: cache handle open by @proxy_cache_open
+ *
+ * Close the cache @handle, the content stays for the next handle. The
+ * regions got by @proxy_cache_map stay valid.
+ */
+void
+proxy_cache_close (CACHE_HANDLE handle)
+{
+  ProxyCache * cache = (ProxyCache *)handle;
+
+  p_return_if_fail (cache != NULL);
+
+  if (cache->data_fd >= 0)
+    close (cache->data_fd);
+  if (cache->map_fd >= 0)
+    close (cache->map_fd);
+  free (cache->blocks);
+
+  free (cache);
+}
+
+/**
+ * proxy_cache_cached:
+ * @handle: cache handle open by @proxy_cache_open
+ * @start: content position
+ *
+ * Returns: The length of the content cached from @start without a hole.
+ */
+uint64_t
+proxy_cache_cached (CACHE_HANDLE handle, uint64_t start)
+{
+  ProxyCache * cache = (ProxyCache *)handle;
+  uint32_t block;
+
+  p_return_val_if_fail (cache != NULL, 0);
+
+  if (start >= cache->content_length)
+    return 0;
+
+  for (block = (uint32_t)(start/CACHE_BLOCK_SIZE); block < cache->block_count; block++) {
+    if (!cache_block_complete (cache, block))
+      break;
+  }
+
+  if ((uint64_t)block*CACHE_BLOCK_SIZE <= start)
+    return 0;
+  if (block == cache->block_count)
+    return cache->content_length - start;
+
+  return (uint64_t)block*CACHE_BLOCK_SIZE - start;
+}
+
+/**
+ * proxy_cache_map:
+ * @handle: cache handle open by @proxy_cache_open
+ * @start: content position
+ * @length: bytes to map, no more than @proxy_cache_cached tells
+ * @map: where to store the start of the mapping
+ * @map_len: where to store the length of the mapping
+ *
+ * Map the cached content from @start into memory, so that it is read
+ * from the page cache without a copy.
+ *
+ * Returns: The address of the content at @start, NULL on error.
+ */
+char *
+proxy_cache_map (CACHE_HANDLE handle, uint64_t start, uint32_t length,
+    void ** map, size_t * map_len)
+{
+  ProxyCache * cache = (ProxyCache *)handle;
+  uint64_t page_size = (uint64_t)sysconf (_SC_PAGESIZE);
+  uint64_t map_start = start - start%page_size;
+  void * address;
+
+  p_return_val_if_fail (cache != NULL, NULL);
+  p_return_val_if_fail (map != NULL, NULL);
+  p_return_val_if_fail (map_len != NULL, NULL);
+  p_return_val_if_fail (length > 0, NULL);
+
+  /* The mapping starts at a page, the content a bit further */
+  *map_len = (size_t)(start - map_start) + length;
+  address = mmap (NULL, *map_len, PROT_READ, MAP_SHARED, cache->data_fd, (off_t)map_start);
+  if (address == MAP_FAILED) {
+    pri_warning ("Mapping %s failed: %s\n", cache->data_path, strerror(errno));
+    return NULL;
+  }
+  /* The reader goes through it at once, start reading it from the disk */
+  madvise (address, *map_len, MADV_WILLNEED);
+
+  *map = address;
+  return (char *)address + (start - map_start);
+}
+
+/**
+ * proxy_cache_unmap:
+ * @map: start of the mapping got by @proxy_cache_map
+ * @map_len: length of the mapping
+ *
+ * Unmap a region got by @proxy_cache_map.
+ */
+void
+proxy_cache_unmap (void * map, size_t map_len)
+{
+  p_return_if_fail (map != NULL);
+
+  munmap (map, map_len);
+}
+
+/**
+ * proxy_cache_write:
+ * @handle: cache handle open by @proxy_cache_open
+ * @start: content position of @buf
+ * @buf: the content got
+ * @len: length of @buf
+ *
+ * Keep a part of the content got from the network. A block only grows
+ * from its start on, the part of @buf before what a block holds is not
+ * written again and the part past a hole is dropped, it is got from the
+ * network again next time.
+ */
+void
+proxy_cache_write (CACHE_HANDLE handle, uint64_t start, const char * buf, uint32_t len)
+{
+  ProxyCache * cache = (ProxyCache *)handle;
+  uint64_t block_end;
+  uint64_t held_end;
+  uint32_t written = 0;
+  uint32_t skip;
+  uint32_t length;
+  uint32_t block;
+  BOOL trim;
+
+  p_return_if_fail (cache != NULL);
+  p_return_if_fail (buf != NULL);
+
+  if (cache->failed || start >= cache->content_length)
+    return;
+  if (len > cache->content_length - start)
+    len = (uint32_t)(cache->content_length - start);
+
+  while (len > 0) {
+    block = (uint32_t)(start/CACHE_BLOCK_SIZE);
+    block_end = (uint64_t)block*CACHE_BLOCK_SIZE + cache_block_length (cache, block);
+    length = (block_end - start < len) ? (uint32_t)(block_end - start) : len;
+
+    held_end = (uint64_t)block*CACHE_BLOCK_SIZE + cache->blocks[block];
+    if (start <= held_end && start + length > held_end) {
+      skip = (uint32_t)(held_end - start);
+      if (!cache_write_all (cache->data_fd, buf + skip, length - skip, (off_t)held_end)) {
+        pri_warning ("Writing %s failed: %s\n", cache->data_path, strerror(errno));
+        cache->failed = TRUE;
+        return;
+      }
+      cache->blocks[block] += length - skip;
+      written += length - skip;
+
+      /* Only the complete blocks are kept on the map, the others are
+       * written again by the next handle anyway */
+      if (cache_block_complete (cache, block)
+          && !cache_write_all (cache->map_fd, (char *)&cache->blocks[block], sizeof(uint32_t), \
+              (off_t)(sizeof(ProxyCacheMapHeader) + block*sizeof(uint32_t)))) {
+        pri_warning ("Writing %s failed: %s\n", cache->map_path, strerror(errno));
+        cache->failed = TRUE;
+        return;
+      }
+    }
+
+    buf += length;
+    start += length;
+    len -= length;
+  }
+
+  /* Trim now and then while writing, a single content may fill the cache */
+  pthread_mutex_lock (&cache_config_lock);
+  cache_written += written;
+  trim = (cache_written >= CACHE_TRIM_PERIOD);
+  if (trim)
+    cache_written = 0;
+  pthread_mutex_unlock (&cache_config_lock);
+  if (trim)
+    cache_trim (&cache->config);
+}
@@ -0,0 +1,165 @@
+#ifndef __PROXY_CACHE_H__
+#define __PROXY_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_BLOCK_SIZE (1024*1024) /* unit the cached content is complete by */
+#define CACHE_TRIM_PERIOD (16*1024*1024) /* bytes written to the cache between two trims */
+#define CACHE_PATH_SIZE 1024
+#define DEFAULT_CACHE_SIZE_LIMIT (1024ULL*1024*1024) /* bytes on disk of all the cached contents */
+
+#define CACHE_MAP_MAGIC "PXYCAC1"
+
+typedef void* CACHE_HANDLE;
+
+typedef struct _ProxyCacheConfig ProxyCacheConfig;
+typedef struct _ProxyCacheMapHeader ProxyCacheMapHeader;
+typedef struct _ProxyCache ProxyCache;
+
+/**
+ * ProxyCacheConfig:
+ *
+ * Settings of the media cache, taken by each cache handle on open.
+ */
+struct _ProxyCacheConfig {
+  char directory[CACHE_PATH_SIZE]; /* where the contents are kept, empty to disable the cache */
+  uint64_t size_limit;             /* bytes on disk of all the cached contents, 0 for no limit */
+};
+
+/**
+ * ProxyCacheMapHeader:
+ *
+ * Start of the block map file, the fill count of each block follows.
+ */
+struct _ProxyCacheMapHeader {
+  char      magic[8];         /* CACHE_MAP_MAGIC */
+  uint64_t  content_length;   /* length of the whole content */
+  uint32_t  block_size;       /* size of each block */
+  char      validator[128];   /* strong ETag or Last-Modified of the content */
+};
+
+/**
+ * ProxyCache:
+ *
+ * A media content kept on disk in a sparse file, next to the map of the
+ * blocks written complete. Only the blocks complete are read back, so a
+ * content seen in part is cached in part. One handle at a time uses a
+ * content, and the contents used least recently are removed to keep the
+ * cache in its size limit.
+ */
+struct _ProxyCache {
+  /* the data file and its block map */
+  int data_fd;
+  int map_fd;
+  char data_path[CACHE_PATH_SIZE];
+  char map_path[CACHE_PATH_SIZE];
+
+  /* content length */
+  uint64_t content_length;
+
+  /* bytes written into each block, complete ones are equal to the block length */
+  uint32_t * blocks;
+  uint32_t block_count;
+
+  /* writing failed, nothing more is written */
+  BOOL failed;
+
+  /* settings taken on open */
+  ProxyCacheConfig config;
+};
+
+/**
+ * proxy_cache_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the media cache, the handles already open keep
+ * their settings.
+ */
+void
+proxy_cache_config_set (const ProxyCacheConfig * config);
+
+/**
+ * proxy_cache_enabled:
+ *
+ * Returns: TRUE if a directory to keep the contents in is set.
+ */
+BOOL
+proxy_cache_enabled (void);
+
+/**
+ * proxy_cache_open:
+ * @key: what tells the content, the url it is got from
+ * @validator: strong ETag or Last-Modified of the content
+ * @content_length: length of the whole content
+ *
+ * Open the cached content for @key, made again if it was cached with
+ * another validator or length.
+ *
+ * Returns: cache handle, NULL if the cache is disabled or the content is
+ * being used by another handle.
+ */
+CACHE_HANDLE
+proxy_cache_open (const char * key, const char * validator, uint64_t content_length);
+
+/**
+ * proxy_cache_close:
+ * @handle: cache handle open by @proxy_cache_open
+ *
+ * Close the cache @handle, the content stays for the next handle. The
+ * regions got by @proxy_cache_map stay valid.
+ */
+void
+proxy_cache_close (CACHE_HANDLE handle);
+
+/**
+ * proxy_cache_cached:
+ * @handle: cache handle open by @proxy_cache_open
+ * @start: content position
+ *
+ * Returns: The length of the content cached from @start without a hole.
+ */
+uint64_t
+proxy_cache_cached (CACHE_HANDLE handle, uint64_t start);
+
+/**
+ * proxy_cache_map:
+ * @handle: cache handle open by @proxy_cache_open
+ * @start: content position
+ * @length: bytes to map, no more than @proxy_cache_cached tells
+ * @map: where to store the start of the mapping
+ * @map_len: where to store the length of the mapping
+ *
+ * Map the cached content from @start into memory, so that it is read
+ * from the page cache without a copy.
+ *
+ * Returns: The address of the content at @start, NULL on error.
+ */
+char *
+proxy_cache_map (CACHE_HANDLE handle, uint64_t start, uint32_t length,
+    void ** map, size_t * map_len);
+
+/**
+ * proxy_cache_unmap:
+ * @map: start of the mapping got by @proxy_cache_map
+ * @map_len: length of the mapping
+ *
+ * Unmap a region got by @proxy_cache_map.
+ */
+void
+proxy_cache_unmap (void * map, size_t map_len);
+
+/**
+ * proxy_cache_write:
+ * @handle: cache handle open by @proxy_cache_open
+ * @start: content position of @buf
+ * @buf: the content got
+ * @len: length of @buf
+ *
+ * Keep a part of the content got from the network. The blocks already
+ * complete are not written again.
+ */
+void
+proxy_cache_write (CACHE_HANDLE handle, uint64_t start, const char * buf, uint32_t len);
+
+#endif
@@ -0,0 +1,700 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "curl.h"
+#include "proxyqueue.h"
+#include "proxycurlengine.h"
+#include "proxylog.h"
+
+typedef struct _CurlEngineThread CurlEngineThread;
+typedef struct _CurlEngineSession CurlEngineSession;
+
+/**
+ * CurlEngineThread:
+ *
+ * An I/O thread and the sessions it drives.
+ */
+struct _CurlEngineThread {
+  pthread_t id;
+  pthread_mutex_t lock;     /* guards everything below */
+  pthread_cond_t quiet;     /* signalled at the end of each loop */
+
+  int epfd;                 /* the socket sets of all the sessions and @wake */
+  int wake[2];              /* written to wake the thread up */
+  BOOL running;
+  BOOL stop;
+  uint64_t loops;           /* loops done, a session is never used across two loops once detached */
+  uint32_t sessions;
+
+  /* sessions with a timer set, the earliest first */
+  CurlEngineSession ** heap;
+  uint32_t heap_count;
+  uint32_t heap_size;
+};
+
+/**
+ * CurlEngineSession:
+ *
+ * A multi task driven by an I/O thread.
+ */
+struct _CurlEngineSession {
+  CURLM * multi;
+  CurlEngineThread * thread;
+  pthread_mutex_t lock;     /* held by whoever touches @multi */
+
+  int epfd;                 /* the sockets of @multi */
+  int notify[2];            /* written once the transfers have moved on */
+  BOOL notified;
+  BOOL closed;
+
+  int32_t heap_index;       /* position in the timer heap of @thread, -1 if no timer set */
+  uint64_t deadline;        /* microseconds the timer expires at */
+};
+
+static CurlEngineThread engine_threads[CURL_ENGINE_MAX_THREAD_COUNT];
+static uint32_t engine_thread_count;
+
+static uint64_t
+engine_time_now (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)now.tv_sec*1000000 + (uint64_t)now.tv_nsec/1000;
+}
+
+static int
+engine_pipe_open (int fds[2])
+{
+  if (pipe (fds) != 0)
+    return -1;
+
+  fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL) | O_NONBLOCK);
+
+  return 0;
+}
+
+static void
+engine_pipe_drain (int fd)
+{
+  char buf[64];
+
+  while (read (fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+static void
+engine_pipe_close (int fds[2])
+{
+  if (fds[0] >= 0)
+    close (fds[0]);
+  if (fds[1] >= 0)
+    close (fds[1]);
+  fds[0] = fds[1] = -1;
+}
+
+/* The pipe is non blocking, when full the reader is woken up anyway */
+static void
+engine_pipe_signal (int fd)
+{
+  ssize_t ret;
+
+  ret = write (fd, "", 1);
+  (void)ret;
+}
+
+static void
+engine_heap_swap (CurlEngineThread * thread, uint32_t a, uint32_t b)
+{
+  CurlEngineSession * session = thread->heap[a];
+
+  thread->heap[a] = thread->heap[b];
+  thread->heap[b] = session;
+  thread->heap[a]->heap_index = (int32_t)a;
+  thread->heap[b]->heap_index = (int32_t)b;
+}
+
+static void
+engine_heap_up (CurlEngineThread * thread, uint32_t index)
+{
+  uint32_t parent;
+
+  while (index > 0) {
+    parent = (index - 1)/2;
+    if (thread->heap[parent]->deadline <= thread->heap[index]->deadline)
+      break;
+    engine_heap_swap (thread, parent, index);
+    index = parent;
+  }
+}
+
+static void
+engine_heap_down (CurlEngineThread * thread, uint32_t index)
+{
+  uint32_t child;
+
+  while ((child = 2*index + 1) < thread->heap_count) {
+    if (child + 1 < thread->heap_count
+        && thread->heap[child + 1]->deadline < thread->heap[child]->deadline)
+      child++;
+    if (thread->heap[index]->deadline <= thread->heap[child]->deadline)
+      break;
+    engine_heap_swap (thread, index, child);
+    index = child;
+  }
+}
+
+/**
+ * engine_heap_remove:
+ * @thread: the thread of @session, locked
+ * @session: the session
+ *
+ * Take @session out of the timer heap if its timer is set.
+ */
+static void
+engine_heap_remove (CurlEngineThread * thread, CurlEngineSession * session)
+{
+  uint32_t index;
+
+  if (session->heap_index < 0)
+    return;
+
+  index = (uint32_t)session->heap_index;
+  thread->heap_count--;
+  if (index != thread->heap_count) {
+    engine_heap_swap (thread, index, thread->heap_count);
+    engine_heap_up (thread, index);
+    engine_heap_down (thread, (uint32_t)thread->heap[index]->heap_index);
+  }
+  session->heap_index = -1;
+}
+
+/**
+ * engine_heap_set:
+ * @thread: the thread of @session, locked
+ * @session: the session
+ * @deadline: microseconds the timer of @session expires at
+ *
+ * Set the timer of @session, putting it into the timer heap if needed.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+engine_heap_set (CurlEngineThread * thread, CurlEngineSession * session, uint64_t deadline)
+{
+  CurlEngineSession ** heap;
+  uint32_t size;
+
+  if (session->heap_index < 0) {
+    if (thread->heap_count == thread->heap_size) {
+      size = thread->heap_size ? thread->heap_size*2 : 16;
+      heap = realloc (thread->heap, size*sizeof(CurlEngineSession *));
+      if (heap == NULL) {
+        pri_error ("Growing timer heap failed\n");
+        return FALSE;
+      }
+      thread->heap = heap;
+      thread->heap_size = size;
+    }
+    session->heap_index = (int32_t)thread->heap_count;
+    thread->heap[thread->heap_count++] = session;
+  }
+
+  session->deadline = deadline;
+  engine_heap_up (thread, (uint32_t)session->heap_index);
+  engine_heap_down (thread, (uint32_t)session->heap_index);
+
+  return TRUE;
+}
+
+/**
+ * engine_socket_func:
+ *
+ * Curl asks for the events of a socket to be watched, the session is locked.
+ */
+static int
+engine_socket_func (CURL * easy, curl_socket_t s, int what, void * userp, void * socketp)
+{
+  CurlEngineSession * session = userp;
+  struct epoll_event event;
+  int op;
+
+  if (what == CURL_POLL_REMOVE) {
+    if (socketp != NULL)
+      epoll_ctl (session->epfd, EPOLL_CTL_DEL, s, &event);
+    return 0;
+  }
+
+  memset (&event, 0, sizeof(event));
+  event.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+  event.data.fd = s;
+
+  op = (socketp != NULL) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl (session->epfd, op, s, &event) != 0) {
+    /* The socket number may have been reused behind our back */
+    op = (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl (session->epfd, op, s, &event) != 0) {
+      pri_error ("Watching socket %d failed: %s\n", s, strerror(errno));
+      return -1;
+    }
+  }
+  if (socketp == NULL)
+    curl_multi_assign (session->multi, s, session);
+
+  return 0;
+}
+
+/**
+ * engine_timer_func:
+ *
+ * Curl asks to be driven again after @timeout_ms, the session is locked.
+ */
+static int
+engine_timer_func (CURLM * multi, long timeout_ms, void * userp)
+{
+  CurlEngineSession * session = userp;
+  CurlEngineThread * thread = session->thread;
+  BOOL wake = FALSE;
+
+  if (session->closed)
+    return 0;
+
+  pthread_mutex_lock (&thread->lock);
+  if (timeout_ms < 0) {
+    engine_heap_remove (thread, session);
+  } else if (engine_heap_set (thread, session, \
+      engine_time_now () + (uint64_t)timeout_ms*1000)) {
+    /* The thread may be sleeping for longer, unless it is the caller */
+    wake = (session->heap_index == 0 && !pthread_equal (pthread_self (), thread->id));
+  }
+  pthread_mutex_unlock (&thread->lock);
+
+  if (wake)
+    engine_pipe_signal (thread->wake[1]);
+
+  return 0;
+}
+
+/**
+ * engine_session_drive:
+ * @session: the session
+ * @timeout: the timer of @session has expired
+ *
+ * Hand the socket events or the expired timer of @session to curl, which
+ * runs the callbacks of the transfers, and tell the session owner.
+ */
+static void
+engine_session_drive (CurlEngineSession * session, BOOL timeout)
+{
+  struct epoll_event events[CURL_ENGINE_EVENT_COUNT];
+  int running;
+  int mask;
+  int count;
+  int i;
+
+  pthread_mutex_lock (&session->lock);
+  if (session->closed)
+    goto engine_drive_out;
+
+  if (timeout) {
+    curl_multi_socket_action (session->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  } else {
+    count = epoll_wait (session->epfd, events, CURL_ENGINE_EVENT_COUNT, 0);
+    for (i = 0; i < count; i++) {
+      mask = 0;
+      if (events[i].events & EPOLLIN)
+        mask |= CURL_CSELECT_IN;
+      if (events[i].events & EPOLLOUT)
+        mask |= CURL_CSELECT_OUT;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        mask |= CURL_CSELECT_ERR;
+      curl_multi_socket_action (session->multi, events[i].data.fd, mask, &running);
+    }
+  }
+
+  if (!session->notified) {
+    session->notified = TRUE;
+    engine_pipe_signal (session->notify[1]);
+  }
+
+engine_drive_out:
+  pthread_mutex_unlock (&session->lock);
+}
+
+static void *
+engine_thread_run (void * data)
+{
+  CurlEngineThread * thread = data;
+  struct epoll_event events[CURL_ENGINE_EVENT_COUNT];
+  CurlEngineSession * session;
+  uint64_t now;
+  int wait_ms;
+  int count;
+  int i;
+
+  pthread_mutex_lock (&thread->lock);
+  while (!thread->stop) {
+    wait_ms = -1;
+    if (thread->heap_count > 0) {
+      now = engine_time_now ();
+      wait_ms = (thread->heap[0]->deadline <= now) ? 0 : \
+          (int)((thread->heap[0]->deadline - now + 999)/1000);
+    }
+    pthread_mutex_unlock (&thread->lock);
+
+    count = epoll_wait (thread->epfd, events, CURL_ENGINE_EVENT_COUNT, wait_ms);
+    if (count < 0 && errno != EINTR)
+      pri_error ("Waiting for events failed: %s\n", strerror(errno));
+
+    for (i = 0; i < count; i++) {
+      if (events[i].data.ptr == NULL)
+        engine_pipe_drain (thread->wake[0]);
+      else
+        engine_session_drive (events[i].data.ptr, FALSE);
+    }
+
+    /* The timers set again meanwhile wait for the next loop */
+    now = engine_time_now ();
+    pthread_mutex_lock (&thread->lock);
+    while (thread->heap_count > 0 && thread->heap[0]->deadline <= now) {
+      session = thread->heap[0];
+      engine_heap_remove (thread, session);
+      pthread_mutex_unlock (&thread->lock);
+      engine_session_drive (session, TRUE);
+      pthread_mutex_lock (&thread->lock);
+    }
+
+    thread->loops++;
+    pthread_cond_broadcast (&thread->quiet);
+  }
+  thread->running = FALSE;
+  pthread_cond_broadcast (&thread->quiet);
+  pthread_mutex_unlock (&thread->lock);
+
+  return NULL;
+}
+
+static void
+engine_thread_free (CurlEngineThread * thread)
+{
+  engine_pipe_close (thread->wake);
+  if (thread->epfd >= 0) {
+    close (thread->epfd);
+    thread->epfd = -1;
+  }
+  free (thread->heap);
+  thread->heap = NULL;
+  pthread_cond_destroy (&thread->quiet);
+  pthread_mutex_destroy (&thread->lock);
+}
+
+static BOOL
+engine_thread_start (CurlEngineThread * thread)
+{
+  struct epoll_event event;
+
+  memset (thread, 0, sizeof(CurlEngineThread));
+  pthread_mutex_init (&thread->lock, NULL);
+  pthread_cond_init (&thread->quiet, NULL);
+  thread->wake[0] = thread->wake[1] = -1;
+
+  if ((thread->epfd = epoll_create (CURL_ENGINE_EVENT_COUNT)) < 0
+      || engine_pipe_open (thread->wake) != 0) {
+    pri_error ("Creating I/O thread files failed: %s\n", strerror(errno));
+    goto engine_thread_start_failed;
+  }
+
+  memset (&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl (thread->epfd, EPOLL_CTL_ADD, thread->wake[0], &event) != 0) {
+    pri_error ("Watching wake up pipe failed: %s\n", strerror(errno));
+    goto engine_thread_start_failed;
+  }
+
+  thread->running = TRUE;
+  if (pthread_create (&thread->id, NULL, engine_thread_run, thread) != 0) {
+    pri_error ("Creating I/O thread failed\n");
+    thread->running = FALSE;
+    goto engine_thread_start_failed;
+  }
+
+  return TRUE;
+engine_thread_start_failed:
+  engine_thread_free (thread);
+  return FALSE;
+}
+
+/**
+ * proxy_curl_engine_start:
+ * @thread_count: I/O threads to start
+ *
+ * Start the I/O threads. Every session attached later is given to one of
+ * them, which waits on the sockets and timers of its transfers in a single
+ * epoll set with all the other sessions of the thread and drives them by
+ * curl_multi_socket_action.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on any error.
+ */
+int32_t
+proxy_curl_engine_start (uint32_t thread_count)
+{
+  p_return_val_if_fail (engine_thread_count == 0, CURL_FAIL);
+
+  if (thread_count < 1)
+    thread_count = 1;
+  if (thread_count > CURL_ENGINE_MAX_THREAD_COUNT)
+    thread_count = CURL_ENGINE_MAX_THREAD_COUNT;
+
+  for (engine_thread_count = 0; engine_thread_count < thread_count; engine_thread_count++) {
+    if (!engine_thread_start (&engine_threads[engine_thread_count])) {
+      proxy_curl_engine_stop ();
+      return CURL_FAIL;
+    }
+  }
+  pri_debug ("Started %u I/O threads\n", engine_thread_count);
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_curl_engine_stop:
+ *
+ * Stop the I/O threads, all the sessions must have been detached.
+ */
+void
+proxy_curl_engine_stop (void)
+{
+  CurlEngineThread * thread;
+  uint32_t i;
+
+  for (i = 0; i < engine_thread_count; i++) {
+    thread = &engine_threads[i];
+    pthread_mutex_lock (&thread->lock);
+    if (thread->sessions != 0)
+      pri_warning ("Stopping I/O thread with %u sessions\n", thread->sessions);
+    thread->stop = TRUE;
+    pthread_mutex_unlock (&thread->lock);
+    engine_pipe_signal (thread->wake[1]);
+    pthread_join (thread->id, NULL);
+    engine_thread_free (thread);
+  }
+  engine_thread_count = 0;
+}
+
+/**
+ * proxy_curl_engine_attach:
+ *
+ * Create a session, a multi task driven by one of the I/O threads. Single
+ * tasks are added to and removed from the multi task as usual but never
+ * performed by the caller, the I/O thread runs their callbacks instead.
+ *
+ * Returns: The session, NULL on error.
+ */
+ENGINE_SESSION
+proxy_curl_engine_attach (void)
+{
+  CurlEngineSession * session;
+  CurlEngineThread * thread;
+  struct epoll_event event;
+  uint32_t i;
+
+  if (engine_thread_count == 0) {
+    pri_error ("No I/O thread started\n");
+    return NULL;
+  }
+
+  if ((session = calloc (1, sizeof(CurlEngineSession))) == NULL) {
+    pri_error ("malloc engine session failed\n");
+    return NULL;
+  }
+  pthread_mutex_init (&session->lock, NULL);
+  session->notify[0] = session->notify[1] = -1;
+  session->heap_index = -1;
+
+  /* The least busy thread takes the session, the count is only a hint */
+  thread = &engine_threads[0];
+  for (i = 1; i < engine_thread_count; i++) {
+    if (engine_threads[i].sessions < thread->sessions)
+      thread = &engine_threads[i];
+  }
+  session->thread = thread;
+
+  if ((session->epfd = epoll_create (CURL_ENGINE_EVENT_COUNT)) < 0
+      || engine_pipe_open (session->notify) != 0) {
+    pri_error ("Creating session files failed: %s\n", strerror(errno));
+    goto engine_attach_failed;
+  }
+
+  if ((session->multi = curl_multi_init ()) == NULL) {
+    pri_error ("curl multi init failed\n");
+    goto engine_attach_failed;
+  }
+  curl_multi_setopt (session->multi, CURLMOPT_SOCKETFUNCTION, engine_socket_func);
+  curl_multi_setopt (session->multi, CURLMOPT_SOCKETDATA, session);
+  curl_multi_setopt (session->multi, CURLMOPT_TIMERFUNCTION, engine_timer_func);
+  curl_multi_setopt (session->multi, CURLMOPT_TIMERDATA, session);
+
+  /* The thread sees the whole socket set of the session as one readable file */
+  memset (&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = session;
+  pthread_mutex_lock (&thread->lock);
+  if (epoll_ctl (thread->epfd, EPOLL_CTL_ADD, session->epfd, &event) != 0) {
+    pthread_mutex_unlock (&thread->lock);
+    pri_error ("Watching session failed: %s\n", strerror(errno));
+    goto engine_attach_failed;
+  }
+  thread->sessions++;
+  pthread_mutex_unlock (&thread->lock);
+
+  return (ENGINE_SESSION)session;
+engine_attach_failed:
+  if (session->multi)
+    curl_multi_cleanup (session->multi);
+  if (session->epfd >= 0)
+    close (session->epfd);
+  engine_pipe_close (session->notify);
+  pthread_mutex_destroy (&session->lock);
+  free (session);
+  return NULL;
+}
+
+/**
+ * proxy_curl_engine_detach:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Destroy the multi task of @session and the session itself, the single
+ * tasks must have been removed already. No callback of @session is running
+ * any more on return.
+ */
+void
+proxy_curl_engine_detach (ENGINE_SESSION handle)
+{
+  CurlEngineSession * session = (CurlEngineSession *)handle;
+  CurlEngineThread * thread;
+  uint64_t loops;
+
+  p_return_if_fail (session != NULL);
+
+  thread = session->thread;
+
+  pthread_mutex_lock (&session->lock);
+  session->closed = TRUE;
+  curl_multi_cleanup (session->multi);
+  session->multi = NULL;
+  pthread_mutex_unlock (&session->lock);
+
+  /* The thread may still hold the session from its last wait, let it finish the loop */
+  pthread_mutex_lock (&thread->lock);
+  engine_heap_remove (thread, session);
+  epoll_ctl (thread->epfd, EPOLL_CTL_DEL, session->epfd, NULL);
+  thread->sessions--;
+  loops = thread->loops;
+  engine_pipe_signal (thread->wake[1]);
+  while (thread->running && thread->loops == loops)
+    pthread_cond_wait (&thread->quiet, &thread->lock);
+  pthread_mutex_unlock (&thread->lock);
+
+  close (session->epfd);
+  engine_pipe_close (session->notify);
+  pthread_mutex_destroy (&session->lock);
+  free (session);
+}
+
+/**
+ * proxy_curl_engine_multi:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Returns: The multi task of @session.
+ */
+MULTI_HANDLE
+proxy_curl_engine_multi (ENGINE_SESSION handle)
+{
+  CurlEngineSession * session = (CurlEngineSession *)handle;
+
+  p_return_val_if_fail (session != NULL, NULL);
+
+  return (MULTI_HANDLE)session->multi;
+}
+
+/**
+ * proxy_curl_engine_lock:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Keep the I/O thread off @session. The lock is held by the I/O thread
+ * while it drives @session, so the caller must hold it to touch the multi
+ * task, the single tasks or anything their callbacks touch.
+ */
+void
+proxy_curl_engine_lock (ENGINE_SESSION handle)
+{
+  CurlEngineSession * session = (CurlEngineSession *)handle;
+
+  p_return_if_fail (session != NULL);
+
+  pthread_mutex_lock (&session->lock);
+}
+
+/**
+ * proxy_curl_engine_unlock:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Let the I/O thread drive @session again.
+ */
+void
+proxy_curl_engine_unlock (ENGINE_SESSION handle)
+{
+  CurlEngineSession * session = (CurlEngineSession *)handle;
+
+  p_return_if_fail (session != NULL);
+
+  pthread_mutex_unlock (&session->lock);
+}
+
+/**
+ * proxy_curl_engine_fd:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Get the file descriptor becoming readable once the I/O thread has driven
+ * the transfers of @session, to wait on instead of their sockets.
+ *
+ * Returns: The file descriptor.
+ */
+int
+proxy_curl_engine_fd (ENGINE_SESSION handle)
+{
+  CurlEngineSession * session = (CurlEngineSession *)handle;
+
+  p_return_val_if_fail (session != NULL, -1);
+
+  return session->notify[0];
+}
+
+/**
+ * proxy_curl_engine_clear:
+ * @session: session got from @proxy_curl_engine_attach, locked
+ *
+ * Make the file descriptor of @session unreadable until the I/O thread
+ * drives its transfers again.
+ */
+void
+proxy_curl_engine_clear (ENGINE_SESSION handle)
+{
+  CurlEngineSession * session = (CurlEngineSession *)handle;
+
+  p_return_if_fail (session != NULL);
+
+  if (session->notified) {
+    engine_pipe_drain (session->notify[0]);
+    session->notified = FALSE;
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef __PROXY_CURL_ENGINE_H__
+#define __PROXY_CURL_ENGINE_H__
+
+#include <stdint.h>
+#include "proxycurlwrapper.h"
+
+#define CURL_ENGINE_THREAD_COUNT 2 /* I/O threads driving the transfers of all the sessions */
+#define CURL_ENGINE_MAX_THREAD_COUNT 16
+#define CURL_ENGINE_EVENT_COUNT 64 /* events taken by one wait of an I/O thread */
+
+typedef void* ENGINE_SESSION;
+
+/**
+ * proxy_curl_engine_start:
+ * @thread_count: I/O threads to start
+ *
+ * Start the I/O threads. Every session attached later is given to one of
+ * them, which waits on the sockets and timers of its transfers in a single
+ * epoll set with all the other sessions of the thread and drives them by
+ * curl_multi_socket_action.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on any error.
+ */
+int32_t
+proxy_curl_engine_start (uint32_t thread_count);
+
+/**
+ * proxy_curl_engine_stop:
+ *
+ * Stop the I/O threads, all the sessions must have been detached.
+ */
+void
+proxy_curl_engine_stop (void);
+
+/**
+ * proxy_curl_engine_attach:
+ *
+ * Create a session, a multi task driven by one of the I/O threads. Single
+ * tasks are added to and removed from the multi task as usual but never
+ * performed by the caller, the I/O thread runs their callbacks instead.
+ *
+ * Returns: The session, NULL on error.
+ */
+ENGINE_SESSION
+proxy_curl_engine_attach (void);
+
+/**
+ * proxy_curl_engine_detach:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Destroy the multi task of @session and the session itself, the single
+ * tasks must have been removed already. No callback of @session is running
+ * any more on return.
+ */
+void
+proxy_curl_engine_detach (ENGINE_SESSION session);
+
+/**
+ * proxy_curl_engine_multi:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Returns: The multi task of @session.
+ */
+MULTI_HANDLE
+proxy_curl_engine_multi (ENGINE_SESSION session);
+
+/**
+ * proxy_curl_engine_lock:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Keep the I/O thread off @session. The lock is held by the I/O thread
+ * while it drives @session, so the caller must hold it to touch the multi
+ * task, the single tasks or anything their callbacks touch.
+ */
+void
+proxy_curl_engine_lock (ENGINE_SESSION session);
+
+/**
+ * proxy_curl_engine_unlock:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Let the I/O thread drive @session again.
+ */
+void
+proxy_curl_engine_unlock (ENGINE_SESSION session);
+
+/**
+ * proxy_curl_engine_fd:
+ * @session: session got from @proxy_curl_engine_attach
+ *
+ * Get the file descriptor becoming readable once the I/O thread has driven
+ * the transfers of @session, to wait on instead of their sockets.
+ *
+ * Returns: The file descriptor.
+ */
+int
+proxy_curl_engine_fd (ENGINE_SESSION session);
+
+/**
+ * proxy_curl_engine_clear:
+ * @session: session got from @proxy_curl_engine_attach, locked
+ *
+ * Make the file descriptor of @session unreadable until the I/O thread
+ * drives its transfers again.
+ */
+void
+proxy_curl_engine_clear (ENGINE_SESSION session);
+
+#endif
@@ -1,36 +1,81 @@
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
 #include "curl.h"
 #include "proxycurlwrapper.h"
 #include "proxylog.h"
 
+/* DNS cache and TLS sessions shared by all the easy tasks of the process */
+static CURLSH * curl_share = NULL;
+static pthread_mutex_t curl_share_lock[CURL_LOCK_DATA_LAST];
+
+static void
+curl_share_lock_func (CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr)
+{
+  pthread_mutex_lock (&curl_share_lock[data]);
+}
+
+static void
+curl_share_unlock_func (CURL * handle, curl_lock_data data, void * userptr)
+{
+  pthread_mutex_unlock (&curl_share_lock[data]);
+}
+
 /**
- * proxy_curl_global_init
+ * proxy_curl_init:
  *
- * Global libcurl initialisation and internal initialize
+ * Global libcurl initialisation and internal initialize, must be called
+ * before any other thread is running.
  * 
  * Returns: CURL_SUCC on success or CURL_FAIL on any error.
  */
 int32_t
 proxy_curl_init ()
 {
+  int32_t i;
+
   if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
     pri_error ("curl global init failed\n");
     return CURL_FAIL;
   }
 
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init (&curl_share_lock[i], NULL);
+  }
+
+  if (!(curl_share = curl_share_init())) {
+    pri_error ("curl share init failed\n");
+    return CURL_FAIL;
+  }
+  curl_share_setopt (curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock_func);
+  curl_share_setopt (curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock_func);
+  curl_share_setopt (curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  /* Only honoured since libcurl 7.57, older ones keep a cache per multi task */
+  curl_share_setopt (curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
   return CURL_SUCC;
 }
 
 /**
- * proxy_curl_uninit
+ * proxy_curl_uninit:
  *
  * global libcurl cleanup and release resources internal
- * 
- * Returns: CURL_SUCC on success or CURL_FAIL on any error.
  */
 void
 proxy_curl_uninit ()
 {
+  int32_t i;
+
+  if (curl_share) {
+    curl_share_cleanup (curl_share);
+    curl_share = NULL;
+  }
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_destroy (&curl_share_lock[i]);
+  }
+
   curl_global_cleanup();
 }
 
@@ -120,14 +165,30 @@ proxy_curl_single_obtain_header (char * url, CurlTaskWrite func, void * data)
 /**
  * proxy_curl_single_task_create:
  *
- * Create a easy task, caller responsible for destroying the task
+ * Create a easy task, caller responsible for destroying the task. The
+ * task shares the DNS cache and TLS sessions of the whole process, and
+ * can be reused for many transfers by adding it again to a multi task.
  *
  * Returns: easy task handle
  */
 SINGLE_HANDLE
 proxy_curl_single_task_create ()
 {
-  return (SINGLE_HANDLE)curl_easy_init();
+  CURL * handle;
+
+  if (!(handle = curl_easy_init())) {
+    pri_error ("curl easy init failed\n");
+    return NULL;
+  }
+
+  /* Signals are not thread safe, every client is served by its own thread */
+  curl_easy_setopt (handle, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt (handle, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt (handle, CURLOPT_FOLLOWLOCATION, 1L);
+  if (curl_share)
+    curl_easy_setopt (handle, CURLOPT_SHARE, curl_share);
+
+  return (SINGLE_HANDLE)handle;
 }
 
 /**
@@ -294,6 +355,43 @@ proxy_curl_multi_perform_async (MULTI_HANDLE handle, int32_t * running_handles)
   return CURLM_OK;
 }
 
+/**
+ * proxy_curl_multi_info_read:
+ * @multi_handle: multi task handle
+ * @single_handle: where to store the single task which has finished
+ * @result: where to store the transfer result, CURL_SUCC or CURL_FAIL
+ *
+ * Ask the @multi_handle for a single task which has finished its transfer.
+ *
+ * Returns: CURL_SUCC if a finished single task is got or CURL_FAIL if there is none.
+ */
+int32_t
+proxy_curl_multi_info_read (MULTI_HANDLE multi_handle, SINGLE_HANDLE * single_handle,
+    int32_t * result)
+{
+  CURLMsg * msg;
+  int msgs_in_queue;
+
+  p_return_val_if_fail (multi_handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (single_handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (result != NULL, CURL_FAIL);
+
+  while ((msg = curl_multi_info_read ((CURLM *)multi_handle, &msgs_in_queue)) != NULL) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    if (msg->data.result != CURLE_OK) {
+      pri_warning ("Single task finished with error: %s\n", \
+          curl_easy_strerror (msg->data.result));
+    }
+    *single_handle = (SINGLE_HANDLE)msg->easy_handle;
+    *result = (msg->data.result == CURLE_OK) ? CURL_SUCC : CURL_FAIL;
+    return CURL_SUCC;
+  }
+
+  return CURL_FAIL;
+}
+
 /**
  * proxy_curl_multi_add_single:
  * @multi_handle: multi task handle
@@ -366,6 +464,33 @@ proxy_curl_multi_fdset (MULTI_HANDLE multi_handle,fd_set * read_fd_set,
   return CURL_SUCC;
 }
 
+/**
+ * proxy_curl_multi_timeout:
+ * @multi_handle: multi task handle
+ * @timeout_ms: where to store the milliseconds to wait, -1 if no timer is set
+ *
+ * Tell how long to wait for socket activity before performing @multi_handle
+ * again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_multi_timeout (MULTI_HANDLE multi_handle, int32_t * timeout_ms)
+{
+  long timeout;
+
+  p_return_val_if_fail (multi_handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (timeout_ms != NULL, CURL_FAIL);
+
+  if (CURLM_OK != curl_multi_timeout((CURLM *)multi_handle, &timeout)) {
+    pri_error ("curl multi timeout failed\n");
+    return CURL_FAIL;
+  }
+  *timeout_ms = (int32_t)timeout;
+
+  return CURL_SUCC;
+}
+
 /**
  * proxy_curl_single_set_url:
  * @handle:single task handle 
@@ -415,6 +540,129 @@ proxy_curl_single_opt_header (SINGLE_HANDLE handle, CurlTaskWrite func, void * d
   curl_easy_setopt ((CURL *)handle, CURLOPT_HEADERDATA, data);
 }
 
+/**
+ * proxy_curl_single_get_stats:
+ * @handle:single task handle 
+ * @stats: where to store the statistics
+ *
+ * Get the size and timing statistics of the last transfer done by @handle.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_get_stats (SINGLE_HANDLE handle, CurlTaskStats * stats)
+{
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (stats != NULL, CURL_FAIL);
+
+  if (curl_easy_getinfo ((CURL *)handle, CURLINFO_SIZE_DOWNLOAD, \
+      &stats->size) != CURLE_OK
+    || curl_easy_getinfo ((CURL *)handle, CURLINFO_TOTAL_TIME, \
+      &stats->total_time) != CURLE_OK
+    || curl_easy_getinfo ((CURL *)handle, CURLINFO_PRETRANSFER_TIME, \
+      &stats->pretransfer_time) != CURLE_OK
+    || curl_easy_getinfo ((CURL *)handle, CURLINFO_STARTTRANSFER_TIME, \
+      &stats->starttransfer_time) != CURLE_OK) {
+    pri_error ("curl easy getinfo failed\n");
+    return CURL_FAIL;
+  }
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_curl_single_pause:
+ * @handle:single task handle 
+ * @pause: nonzero to pause receiving, zero to go on
+ *
+ * Pause receiving data, or resume both directions. Once resumed the data
+ * held back by a write function returning CURL_WRITE_PAUSE is written again
+ * at once, and a read function returning CURL_READ_PAUSE is called again.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_pause (SINGLE_HANDLE handle, int32_t pause)
+{
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+
+  if (curl_easy_pause ((CURL *)handle, pause ? CURLPAUSE_RECV : CURLPAUSE_CONT) != CURLE_OK) {
+    pri_error ("curl easy pause failed\n");
+    return CURL_FAIL;
+  }
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_curl_single_get_url:
+ * @handle:single task handle 
+ * @url: where to store the url, owned by the task
+ *
+ * Get the url the transfer of @handle has ended at after following the redirects.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_get_url (SINGLE_HANDLE handle, char ** url)
+{
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (url != NULL, CURL_FAIL);
+
+  if (curl_easy_getinfo ((CURL *)handle, CURLINFO_EFFECTIVE_URL, url) != CURLE_OK
+      || *url == NULL) {
+    pri_error ("curl easy getinfo failed\n");
+    return CURL_FAIL;
+  }
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_curl_single_set_headers:
+ * @handle:single task handle 
+ * @headers: extra request headers, NULL for none
+ *
+ * Set the extra request headers of the single task, @headers must be kept
+ * until the transfer is done.
+ */
+void
+proxy_curl_single_set_headers (SINGLE_HANDLE handle, HEADER_LIST headers)
+{
+  p_return_if_fail (handle != NULL);
+
+  curl_easy_setopt ((CURL *)handle, CURLOPT_HTTPHEADER, (struct curl_slist *)headers);
+}
+
+/**
+ * proxy_curl_header_list_append:
+ * @headers: header list, NULL for a new one
+ * @header: the full header line without CRLF
+ *
+ * Append a header to a header list.
+ *
+ * Returns: The new header list, NULL on error.
+ */
+HEADER_LIST
+proxy_curl_header_list_append (HEADER_LIST headers, const char * header)
+{
+  p_return_val_if_fail (header != NULL, NULL);
+
+  return (HEADER_LIST)curl_slist_append ((struct curl_slist *)headers, header);
+}
+
+/**
+ * proxy_curl_header_list_free:
+ * @headers: header list
+ *
+ * Free a header list.
+ */
+void
+proxy_curl_header_list_free (HEADER_LIST headers)
+{
+  curl_slist_free_all ((struct curl_slist *)headers);
+}
+
 /**
  * proxy_curl_single_opt_body:
  * @handle:single task handle 
@@ -432,6 +680,60 @@ proxy_curl_single_opt_body (SINGLE_HANDLE handle, CurlTaskWrite func, void * dat
   curl_easy_setopt ((CURL *)handle, CURLOPT_WRITEDATA, data);
 }
 
+/**
+ * proxy_curl_single_opt_nobody:
+ * @handle:single task handle 
+ *
+ * Make the request a HEAD, only the header of the response is got.
+ */
+void
+proxy_curl_single_opt_nobody (SINGLE_HANDLE handle)
+{
+  p_return_if_fail (handle != NULL);
+
+  curl_easy_setopt ((CURL *)handle, CURLOPT_NOBODY, 1L);
+}
+
+/**
+ * proxy_curl_single_opt_upload:
+ * @handle:single task handle 
+ * @method: request method, NULL for POST
+ * @length: length of the request body, -1 if not known
+ * @func: function reading the request body
+ * @data: data pointer to pass to the read function
+ *
+ * Send a request body got from @func, in chunked encoding if its length is
+ * not known. Redirects are not followed, the body can not be sent again.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_opt_upload (SINGLE_HANDLE handle, const char * method, int64_t length,
+    CurlTaskRead func, void * data)
+{
+  CURL * curl = (CURL *)handle;
+
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (func != NULL, CURL_FAIL);
+
+  if (curl_easy_setopt (curl, CURLOPT_POST, 1L) != CURLE_OK
+      || curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)length) != CURLE_OK
+      || curl_easy_setopt (curl, CURLOPT_READFUNCTION, func) != CURLE_OK
+      || curl_easy_setopt (curl, CURLOPT_READDATA, data) != CURLE_OK
+      || curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 0L) != CURLE_OK) {
+    pri_error ("curl easy setopt upload failed\n");
+    return CURL_FAIL;
+  }
+
+  if (method != NULL && strcasecmp (method, "POST") != 0
+      && curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, method) != CURLE_OK) {
+    pri_error ("curl easy setopt method failed\n");
+    return CURL_FAIL;
+  }
+
+  return CURL_SUCC;
+}
+
 /**
  * proxy_curl_multi_task_create:
  * @handle: The task handle will be store.
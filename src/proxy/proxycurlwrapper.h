@@ -6,17 +6,22 @@
 
 typedef struct _CurlMultiTaskInfo CurlMultiTaskInfo;
 typedef struct _CurlRange CurlRange;
+typedef struct _CurlTaskStats CurlTaskStats;
 
 #define CURL_MAX_TASK_NUM  10
 #define CURL_MIN_TASK_NUM  1
 #define CURL_SUCC          0
 #define CURL_FAIL          -1
+#define CURL_WRITE_PAUSE   0x10000001 /* returned by a write function to pause the transfer */
+#define CURL_READ_PAUSE    0x10000001 /* returned by a read function to pause the upload */
 
 typedef void* MULTI_HANDLE;
 typedef void* SINGLE_HANDLE;
+typedef void* HEADER_LIST;
 typedef struct _CurlTaskHandle REGULAR_HANDLE;
 
 typedef uint32_t (*CurlTaskWrite) (void *content, uint32_t size, uint32_t nmemb, void *user_data);
+typedef uint32_t (*CurlTaskRead) (void *buffer, uint32_t size, uint32_t nitems, void *user_data);
 
 struct _CurlMultiTaskInfo {
   uint32_t count;
@@ -31,6 +36,13 @@ struct _CurlRange {
   double end;
 };
 
+struct _CurlTaskStats {
+  double size;                /* bytes downloaded */
+  double total_time;          /* seconds the whole transfer took */
+  double pretransfer_time;    /* seconds until the request was about to be sent */
+  double starttransfer_time;  /* seconds until the first byte was received */
+};
+
 struct _CurlTaskHandle {
   MULTI_HANDLE multi_handle;
 
@@ -38,6 +50,25 @@ struct _CurlTaskHandle {
   SINGLE_HANDLE single_handle[CURL_MAX_TASK_NUM];
 };
 
+/**
+ * proxy_curl_init:
+ *
+ * Global libcurl initialisation and internal initialize, must be called
+ * before any other thread is running.
+ * 
+ * Returns: CURL_SUCC on success or CURL_FAIL on any error.
+ */
+int32_t
+proxy_curl_init ();
+
+/**
+ * proxy_curl_uninit:
+ *
+ * global libcurl cleanup and release resources internal
+ */
+void
+proxy_curl_uninit ();
+
 /**
  * proxy_curl_get_download_size:
  * @url: The target address
@@ -65,7 +96,9 @@ proxy_curl_single_obtain_header (char * url, CurlTaskWrite func, void * data);
 /**
  * proxy_curl_single_task_create:
  *
- * Create a easy task, caller responsible for destroying the task
+ * Create a easy task, caller responsible for destroying the task. The
+ * task shares the DNS cache and TLS sessions of the whole process, and
+ * can be reused for many transfers by adding it again to a multi task.
  *
  * Returns: easy task handle
  */
@@ -141,6 +174,33 @@ proxy_curl_multi_fdset (MULTI_HANDLE multi_handle,fd_set * read_fd_set,
 int32_t
 proxy_curl_multi_perform_async (MULTI_HANDLE handle, int32_t * running_handles);
 
+/**
+ * proxy_curl_multi_timeout:
+ * @multi_handle: multi task handle
+ * @timeout_ms: where to store the milliseconds to wait, -1 if no timer is set
+ *
+ * Tell how long to wait for socket activity before performing @multi_handle
+ * again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_multi_timeout (MULTI_HANDLE multi_handle, int32_t * timeout_ms);
+
+/**
+ * proxy_curl_multi_info_read:
+ * @multi_handle: multi task handle
+ * @single_handle: where to store the single task which has finished
+ * @result: where to store the transfer result, CURL_SUCC or CURL_FAIL
+ *
+ * Ask the @multi_handle for a single task which has finished its transfer.
+ *
+ * Returns: CURL_SUCC if a finished single task is got or CURL_FAIL if there is none.
+ */
+int32_t
+proxy_curl_multi_info_read (MULTI_HANDLE multi_handle, SINGLE_HANDLE * single_handle,
+    int32_t * result);
+
 /**
  * proxy_curl_single_set_url:
  * @handle:single task handle 
@@ -172,6 +232,76 @@ proxy_curl_single_set_range (SINGLE_HANDLE handle, char * range);
 void
 proxy_curl_single_opt_header (SINGLE_HANDLE handle, CurlTaskWrite func, void * data);
 
+/**
+ * proxy_curl_single_get_stats:
+ * @handle:single task handle 
+ * @stats: where to store the statistics
+ *
+ * Get the size and timing statistics of the last transfer done by @handle.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_get_stats (SINGLE_HANDLE handle, CurlTaskStats * stats);
+
+/**
+ * proxy_curl_single_pause:
+ * @handle:single task handle 
+ * @pause: nonzero to pause receiving, zero to go on
+ *
+ * Pause receiving data, or resume both directions. Once resumed the data
+ * held back by a write function returning CURL_WRITE_PAUSE is written again
+ * at once, and a read function returning CURL_READ_PAUSE is called again.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_pause (SINGLE_HANDLE handle, int32_t pause);
+
+/**
+ * proxy_curl_single_get_url:
+ * @handle:single task handle 
+ * @url: where to store the url, owned by the task
+ *
+ * Get the url the transfer of @handle has ended at after following the redirects.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_get_url (SINGLE_HANDLE handle, char ** url);
+
+/**
+ * proxy_curl_single_set_headers:
+ * @handle:single task handle 
+ * @headers: extra request headers, NULL for none
+ *
+ * Set the extra request headers of the single task, @headers must be kept
+ * until the transfer is done.
+ */
+void
+proxy_curl_single_set_headers (SINGLE_HANDLE handle, HEADER_LIST headers);
+
+/**
+ * proxy_curl_header_list_append:
+ * @headers: header list, NULL for a new one
+ * @header: the full header line without CRLF
+ *
+ * Append a header to a header list.
+ *
+ * Returns: The new header list, NULL on error.
+ */
+HEADER_LIST
+proxy_curl_header_list_append (HEADER_LIST headers, const char * header);
+
+/**
+ * proxy_curl_header_list_free:
+ * @headers: header list
+ *
+ * Free a header list.
+ */
+void
+proxy_curl_header_list_free (HEADER_LIST headers);
+
 /**
  * proxy_curl_single_opt_body:
  * @handle:single task handle 
@@ -183,4 +313,30 @@ proxy_curl_single_opt_header (SINGLE_HANDLE handle, CurlTaskWrite func, void * d
 void
 proxy_curl_single_opt_body (SINGLE_HANDLE handle, CurlTaskWrite func, void * data);
 
+/**
+ * proxy_curl_single_opt_nobody:
+ * @handle:single task handle 
+ *
+ * Make the request a HEAD, only the header of the response is got.
+ */
+void
+proxy_curl_single_opt_nobody (SINGLE_HANDLE handle);
+
+/**
+ * proxy_curl_single_opt_upload:
+ * @handle:single task handle 
+ * @method: request method, NULL for POST
+ * @length: length of the request body, -1 if not known
+ * @func: function reading the request body
+ * @data: data pointer to pass to the read function
+ *
+ * Send a request body got from @func, in chunked encoding if its length is
+ * not known. Redirects are not followed, the body can not be sent again.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL on error.
+ */
+int32_t
+proxy_curl_single_opt_upload (SINGLE_HANDLE handle, const char * method, int64_t length,
+    CurlTaskRead func, void * data);
+
 #endif
@@ -0,0 +1,1158 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include "proxyqueue.h"
+#include "proxycurlwrapper.h"
+#include "proxycurlengine.h"
+#include "proxyfiledownload.h"
+#include "proxylog.h"
+
+/* settings of the downloads created from now on */
+static ProxyFileConfig filedownload_config;
+static pthread_mutex_t filedownload_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * filedownload_header_value:
+ * @line: a header line
+ * @name: header name
+ *
+ * Returns: the value of the header if @line is the header @name, NULL otherwise.
+ */
+static char *
+filedownload_header_value (char * line, const char * name)
+{
+  size_t name_len = strlen(name);
+  char * p;
+
+  if (strncasecmp (line, name, name_len) != 0 || line[name_len] != ':')
+    return NULL;
+
+  p = line + name_len + 1;
+  while (*p && isspace(*p)) p++;
+
+  return p;
+}
+
+/**
+ * filedownload_head_append:
+ * @download: the download handle
+ * @content: header data to append
+ * @length: length of @content
+ *
+ * Returns: TRUE if the whole @content fits in the head buffer, FALSE if it
+ * is left unchanged.
+ */
+static BOOL
+filedownload_head_append (ProxyFileDownload * download, const char * content, uint32_t length)
+{
+  if (length > FILE_HEAD_BUFFER_SIZE - download->head_len)
+    return FALSE;
+
+  memcpy (download->head + download->head_len, content, length);
+  download->head_len += length;
+
+  return TRUE;
+}
+
+static BOOL
+filedownload_write_all (int fd, const char * buf, uint32_t len, off_t offset)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = pwrite (fd, buf, len, offset);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return FALSE;
+    buf += ret;
+    len -= (uint32_t)ret;
+    offset += ret;
+  }
+
+  return TRUE;
+}
+
+static BOOL
+filedownload_piece_got (ProxyFileDownload * download, uint32_t piece)
+{
+  return (download->bitmap[piece/8] & (1 << (piece%8))) != 0;
+}
+
+/**
+ * filedownload_piece_done:
+ * @download: download handle
+ * @piece: the piece written to the file
+ *
+ * Mark @piece done in the progress map, on disk too so that it is not got
+ * again if the download is started over.
+ */
+static void
+filedownload_piece_done (ProxyFileDownload * download, uint32_t piece)
+{
+  uint32_t index = piece/8;
+
+  if (filedownload_piece_got (download, piece))
+    return;
+
+  download->bitmap[index] |= (uint8_t)(1 << (piece%8));
+  download->piece_done++;
+
+  if (download->map_fd >= 0 && !filedownload_write_all (download->map_fd, \
+      (char *)&download->bitmap[index], 1, sizeof(ProxyFileMapHeader) + index))
+    pri_warning ("Saving progress of %s failed: %s\n", download->url, strerror(errno));
+}
+
+/**
+ * filedownload_map_load:
+ * @download: download handle, its map file open
+ * @validator: validator of the content now
+ *
+ * Take the progress an earlier download of the same content has left.
+ *
+ * Returns: TRUE if the map is of the same content, FALSE otherwise.
+ */
+static BOOL
+filedownload_map_load (ProxyFileDownload * download, const char * validator)
+{
+  ProxyFileMapHeader header;
+  uint32_t map_len = (download->piece_count + 7)/8;
+  uint32_t piece;
+
+  if (pread (download->map_fd, &header, sizeof(header), 0) != sizeof(header))
+    return FALSE;
+  if (memcmp (header.magic, FILE_MAP_MAGIC, sizeof(FILE_MAP_MAGIC)) != 0
+      || header.content_length != download->content_length
+      || header.piece_size != FILE_PIECE_SIZE
+      || strncmp (header.validator, validator, sizeof(header.validator)) != 0)
+    return FALSE;
+
+  if (pread (download->map_fd, download->bitmap, map_len, sizeof(header)) != (ssize_t)map_len)
+    return FALSE;
+
+  download->piece_done = 0;
+  for (piece = 0; piece < download->piece_count; piece++) {
+    if (filedownload_piece_got (download, piece))
+      download->piece_done++;
+  }
+
+  return TRUE;
+}
+
+/**
+ * filedownload_map_new:
+ * @download: download handle, its files open
+ * @validator: validator of the content now
+ *
+ * Start the files over for the content now.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+filedownload_map_new (ProxyFileDownload * download, const char * validator)
+{
+  ProxyFileMapHeader header;
+  uint32_t map_len = (download->piece_count + 7)/8;
+
+  memset (&header, 0, sizeof(header));
+  memcpy (header.magic, FILE_MAP_MAGIC, sizeof(FILE_MAP_MAGIC));
+  header.content_length = download->content_length;
+  header.piece_size = FILE_PIECE_SIZE;
+  snprintf (header.validator, sizeof(header.validator), "%s", validator);
+
+  memset (download->bitmap, 0, map_len);
+  download->piece_done = 0;
+
+  /* The data file is sparse, the pieces fill it in any order */
+  if (ftruncate (download->data_fd, 0) != 0
+      || ftruncate (download->data_fd, (off_t)download->content_length) != 0
+      || ftruncate (download->map_fd, 0) != 0
+      || !filedownload_write_all (download->map_fd, (char *)&header, sizeof(header), 0)
+      || !filedownload_write_all (download->map_fd, (char *)download->bitmap, map_len, \
+          sizeof(header)))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * filedownload_path_make:
+ * @path: where to store the path, %FILE_PATH_SIZE bytes
+ * @directory: the download directory
+ * @name: file name
+ * @suffix: appended to @name
+ *
+ * Returns: TRUE on success, FALSE if the path does not fit in @path.
+ */
+static BOOL
+filedownload_path_make (char * path, const char * directory, const char * name, const char * suffix)
+{
+  int length = snprintf (path, FILE_PATH_SIZE, "%s/%s%s", directory, name, suffix);
+
+  return length > 0 && length < FILE_PATH_SIZE;
+}
+
+/**
+ * filedownload_file_private:
+ * @download: download handle
+ *
+ * Open a data file nobody else sees, for a content which cannot be got
+ * again the same. It is gone once closed.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+filedownload_file_private (ProxyFileDownload * download)
+{
+  if (download->map_fd >= 0) {
+    close (download->map_fd);
+    download->map_fd = -1;
+  }
+  if (download->data_fd >= 0) {
+    close (download->data_fd);
+    download->data_fd = -1;
+  }
+
+  if (!filedownload_path_make (download->data_path, download->config.directory, \
+      "download-XXXXXX", "")) {
+    pri_error ("Download directory %s too long\n", download->config.directory);
+    return FALSE;
+  }
+  if ((download->data_fd = mkstemp (download->data_path)) < 0) {
+    pri_error ("Creating %s failed: %s\n", download->data_path, strerror(errno));
+    return FALSE;
+  }
+  unlink (download->data_path);
+  memset (download->bitmap, 0, (download->piece_count + 7)/8);
+  download->piece_done = 0;
+
+  return TRUE;
+}
+
+/**
+ * filedownload_file_open:
+ * @download: download handle, the header got
+ *
+ * Open the data file and the progress map of the content, keyed by the
+ * hash of the url. A map left for the same length and validator is taken
+ * as it is, anything else starts over.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+filedownload_file_open (ProxyFileDownload * download)
+{
+  const char * validator = download->etag[0] ? download->etag : download->last_modified;
+  uint64_t hash = 14695981039346656037ULL;
+  char name[17];
+  const char * p;
+
+  if ((download->bitmap = calloc ((download->piece_count + 7)/8 + 1, 1)) == NULL) {
+    pri_error ("malloc progress map failed\n");
+    return FALSE;
+  }
+
+  /* Resuming needs the content to be known the same */
+  if (!download->ranged || validator[0] == '\0')
+    return filedownload_file_private (download);
+
+  for (p = download->url; *p; p++)
+    hash = (hash ^ (uint8_t)*p) * 1099511628211ULL;
+  snprintf (name, sizeof(name), "%016llx", (unsigned long long)hash);
+  if (!filedownload_path_make (download->data_path, download->config.directory, name, ".part")
+      || !filedownload_path_make (download->map_path, download->config.directory, name, ".map")) {
+    pri_error ("Download directory %s too long\n", download->config.directory);
+    return FALSE;
+  }
+
+  download->map_fd = open (download->map_path, O_RDWR | O_CREAT, 0600);
+  if (download->map_fd < 0) {
+    pri_error ("Opening %s failed: %s\n", download->map_path, strerror(errno));
+    return FALSE;
+  }
+  /* Two sessions would start over the map of each other */
+  if (flock (download->map_fd, LOCK_EX | LOCK_NB) != 0) {
+    pri_warning ("%s is being downloaded by another session\n", download->url);
+    return filedownload_file_private (download);
+  }
+
+  download->data_fd = open (download->data_path, O_RDWR | O_CREAT, 0600);
+  if (download->data_fd < 0) {
+    pri_error ("Opening %s failed: %s\n", download->data_path, strerror(errno));
+    return FALSE;
+  }
+
+  if (filedownload_map_load (download, validator)) {
+    pri_debug ("Resuming %s, %u of %u pieces on disk\n", download->url, \
+        download->piece_done, download->piece_count);
+    return TRUE;
+  }
+
+  if (!filedownload_map_new (download, validator)) {
+    pri_error ("Creating %s failed: %s\n", download->data_path, strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * filedownload_head_done:
+ * @download: download handle
+ *
+ * The header of the first piece is got, plan the pieces by what the origin
+ * really sends on it and open the files.
+ *
+ * Returns: TRUE on success and FALSE if the body cannot be handled.
+ */
+static BOOL
+filedownload_head_done (ProxyFileDownload * download)
+{
+  ProxyFileSingle * single = &download->singles[0];
+  char if_range[256];
+
+  download->ranged = (download->status == 206);
+
+  if (download->ranged) {
+    if (download->content_length == 0) {
+      pri_warning ("Unknown content length, aborting body\n");
+      return FALSE;
+    }
+    download->piece_count = (uint32_t)((download->content_length + FILE_PIECE_SIZE - 1) \
+        /FILE_PIECE_SIZE);
+    single->length = (download->content_length > FILE_PIECE_SIZE) ? \
+        FILE_PIECE_SIZE : (uint32_t)download->content_length;
+
+    /* The other pieces must get the same content */
+    if (download->etag[0] != '\0' || download->last_modified[0] != '\0') {
+      snprintf (if_range, sizeof(if_range), "If-Range: %s", \
+          download->etag[0] != '\0' ? download->etag : download->last_modified);
+      download->piece_headers = proxy_curl_header_list_append (NULL, if_range);
+    }
+  } else {
+    /* The origin ignores the range, the whole body comes on the first piece */
+    download->piece_count = 0;
+  }
+  download->piece_next = 1;
+
+  return filedownload_file_open (download);
+}
+
+/**
+ * filedownload_header_write:
+ *
+ * Header callback of the first piece. The header is handed to the client as
+ * the answer of a request for the whole content, so a partial content status
+ * is turned into 200 and the content length becomes the complete one. The
+ * headers of redirect responses are dropped.
+ */
+static uint32_t
+filedownload_header_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyFileDownload * download = user_data;
+  char line[1024];
+  char status_line[64];
+  char * value;
+  unsigned long long total;
+  uint32_t length = size*nmemb;
+  uint32_t line_length;
+
+  p_return_val_if_fail (content != NULL, 0);
+  p_return_val_if_fail (user_data != NULL, 0);
+
+  /* The header has already been got, the single task now carries other pieces */
+  if (download->data_fd >= 0)
+    return length;
+
+  line_length = (length < sizeof(line)) ? length : sizeof(line) - 1;
+  memcpy (line, content, line_length);
+  line[line_length] = '\0';
+
+  if (strncmp (line, "HTTP/", 5) == 0) {
+    /* A new response begins, forget the one redirected from */
+    download->head_len = 0;
+    download->status = 0;
+    download->redirect = FALSE;
+    download->content_length = 0;
+    download->etag[0] = '\0';
+    download->last_modified[0] = '\0';
+    sscanf (line, "%*s %u", &download->status);
+
+    if (download->status == 206) {
+      snprintf (status_line, sizeof(status_line), "%.*s 200 OK\r\n", \
+          (int)strcspn(line, " "), line);
+      if (!filedownload_head_append (download, status_line, (uint32_t)strlen(status_line)))
+        goto header_too_large;
+      return length;
+    }
+  } else if ((value = filedownload_header_value (line, "Content-Range")) != NULL) {
+    if (sscanf (value, "bytes %*[0-9]-%*[0-9]/%llu", &total) != 1)
+      total = 0;
+    download->content_length = total;
+    return length;
+  } else if ((value = filedownload_header_value (line, "Content-Length")) != NULL) {
+    if (download->status != 206 && sscanf (value, "%llu", &total) == 1)
+      download->content_length = total;
+    return length;
+  } else if (filedownload_header_value (line, "Transfer-Encoding") != NULL) {
+    /* Curl hands out the body decoded */
+    return length;
+  } else if (filedownload_header_value (line, "Location") != NULL) {
+    download->redirect = TRUE;
+  } else if ((value = filedownload_header_value (line, "ETag")) != NULL) {
+    /* A weak validator cannot be used for a range */
+    if (strncmp (value, "W/", 2) != 0)
+      snprintf (download->etag, sizeof(download->etag), "%.*s", \
+          (int)strcspn(value, "\r\n"), value);
+  } else if ((value = filedownload_header_value (line, "Last-Modified")) != NULL) {
+    snprintf (download->last_modified, sizeof(download->last_modified), "%.*s", \
+        (int)strcspn(value, "\r\n"), value);
+  }
+
+  if (length != 2 || strncmp (content, "\r\n", 2) != 0) {
+    if (!filedownload_head_append (download, content, length))
+      goto header_too_large;
+    return length;
+  }
+
+  /* The end of a redirect response, the followed one comes next */
+  if (download->redirect && download->status/100 == 3)
+    return length;
+
+  if (!filedownload_head_done (download)) {
+    download->failed = TRUE;
+    return 0;
+  }
+
+  /* Last line of the header, the client may have it from now on */
+  if (download->content_length > 0) {
+    snprintf (line, sizeof(line), "Content-Length: %llu\r\n", \
+        (unsigned long long)download->content_length);
+    if (!filedownload_head_append (download, line, (uint32_t)strlen(line)))
+      goto header_too_large;
+  }
+  if (!filedownload_head_append (download, content, length))
+    goto header_too_large;
+
+  return length;
+
+header_too_large:
+  pri_error ("Response header larger than %d bytes\n", FILE_HEAD_BUFFER_SIZE);
+  download->failed = TRUE;
+  return 0;
+}
+
+/**
+ * filedownload_piece_header:
+ *
+ * Header callback of the pieces, a piece is aborted unless it gets the
+ * range asked for.
+ */
+static uint32_t
+filedownload_piece_header (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyFileSingle * single = user_data;
+  uint32_t length = size*nmemb;
+  char line[64];
+  uint32_t line_length;
+
+  p_return_val_if_fail (content != NULL, 0);
+  p_return_val_if_fail (user_data != NULL, 0);
+
+  if (length > 5 && strncmp (content, "HTTP/", 5) == 0) {
+    line_length = (length < sizeof(line)) ? length : sizeof(line) - 1;
+    memcpy (line, content, line_length);
+    line[line_length] = '\0';
+    single->status = 0;
+    sscanf (line, "%*s %u", &single->status);
+  } else if (length == 2 && strncmp (content, "\r\n", 2) == 0) {
+    /* A redirect is followed, anything else but the range is not the content wanted */
+    if (single->status/100 != 3 && single->status != 206) {
+      pri_warning ("Piece got status %u instead of the range\n", single->status);
+      return 0;
+    }
+  }
+
+  return length;
+}
+
+/**
+ * filedownload_data_write:
+ *
+ * Write callback of the pieces, the data goes straight to its place in
+ * the file.
+ */
+static uint32_t
+filedownload_data_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyFileSingle * single = user_data;
+  ProxyFileDownload * download;
+  uint32_t length = size*nmemb;
+  uint32_t write_length = length;
+
+  p_return_val_if_fail (content != NULL, 0);
+  p_return_val_if_fail (user_data != NULL, 0);
+  download = single->download;
+
+  if (download->data_fd < 0) {
+    pri_error ("Body received before the header\n");
+    return 0;
+  }
+
+  if (download->ranged && write_length > single->length - single->received) {
+    pri_warning ("Piece longer than asked for, data will be cut off\n");
+    write_length = (uint32_t)(single->length - single->received);
+  }
+
+  if (!filedownload_write_all (download->data_fd, content, write_length, \
+      (off_t)(single->start + single->received))) {
+    pri_error ("Writing %s failed: %s\n", download->url, strerror(errno));
+    return 0;
+  }
+  single->received += write_length;
+
+  return (write_length == length) ? length : 0;
+}
+
+/**
+ * filedownload_single_start:
+ * @download: download handle
+ * @single: the idle single task to carry the piece
+ * @piece: index of the piece
+ *
+ * Start downloading @piece by @single.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+filedownload_single_start (ProxyFileDownload * download, ProxyFileSingle * single, uint32_t piece)
+{
+  char piece_range[64];
+
+  /* The single task is created once and then reused for every piece it carries */
+  if (single->single_handle == NULL) {
+    if ((single->single_handle = proxy_curl_single_task_create ()) == NULL) {
+      pri_error ("Creating single task failed\n");
+      return FALSE;
+    }
+    proxy_curl_single_opt_body (single->single_handle, filedownload_data_write, single);
+  }
+
+  single->start = (uint64_t)piece*FILE_PIECE_SIZE;
+  single->length = FILE_PIECE_SIZE;
+  if (download->content_length > 0 && download->content_length - single->start < FILE_PIECE_SIZE)
+    single->length = (uint32_t)(download->content_length - single->start);
+  single->received = 0;
+  single->status = 0;
+
+  snprintf (piece_range, sizeof(piece_range), "%llu-%llu", \
+      (unsigned long long)single->start, (unsigned long long)(single->start + single->length - 1));
+  pri_debug ("Piece %u range %s\n", piece, piece_range);
+
+  proxy_curl_single_set_url (single->single_handle, download->url);
+  proxy_curl_single_set_range (single->single_handle, piece_range);
+  proxy_curl_single_set_headers (single->single_handle, download->piece_headers);
+  if (piece == 0 && download->data_fd < 0)
+    proxy_curl_single_opt_header (single->single_handle, filedownload_header_write, download);
+  else
+    proxy_curl_single_opt_header (single->single_handle, filedownload_piece_header, single);
+
+  if (proxy_curl_multi_add_single (download->multi, single->single_handle) != CURL_SUCC) {
+    pri_error ("Adding single to multi failed\n");
+    return FALSE;
+  }
+  single->piece = piece;
+  download->single_count++;
+
+  return TRUE;
+}
+
+/**
+ * filedownload_single_release:
+ * @download: download handle
+ * @single: the single task done with its piece
+ *
+ * Take the single task out of the multi task and make it idle, keeping the
+ * single task and its connection for the next piece.
+ */
+static void
+filedownload_single_release (ProxyFileDownload * download, ProxyFileSingle * single)
+{
+  if (single->piece == FILE_PIECE_NONE)
+    return;
+
+  proxy_curl_multi_remove_single (download->multi, single->single_handle);
+  single->piece = FILE_PIECE_NONE;
+  download->single_count--;
+}
+
+/**
+ * filedownload_task_reap:
+ * @download: download handle
+ *
+ * Release the single tasks which have finished their pieces and mark the
+ * pieces done.
+ */
+static void
+filedownload_task_reap (ProxyFileDownload * download)
+{
+  SINGLE_HANDLE single_handle;
+  ProxyFileSingle * single;
+  int32_t result;
+  int32_t i;
+
+  while (proxy_curl_multi_info_read (download->multi, \
+      &single_handle, &result) == CURL_SUCC) {
+    for (i = 0; i < FILE_SINGLE_COUNT; i++) {
+      single = &download->singles[i];
+      if (single->piece != FILE_PIECE_NONE && single->single_handle == single_handle)
+        break;
+    }
+    if (i == FILE_SINGLE_COUNT) {
+      pri_warning ("Unknown single task finished\n");
+      continue;
+    }
+
+    if (download->data_fd < 0) {
+      pri_error ("The first piece finished without header\n");
+      download->failed = TRUE;
+    } else if (result != CURL_SUCC
+        || (download->ranged && single->received != single->length)) {
+      pri_error ("Piece %u not receive done, %llu of %u received.\n", \
+          single->piece, (unsigned long long)single->received, single->length);
+      download->failed = TRUE;
+    } else if (download->ranged) {
+      filedownload_piece_done (download, single->piece);
+    } else {
+      /* The whole body has come on the first piece */
+      download->content_length = single->received;
+    }
+    filedownload_single_release (download, single);
+  }
+}
+
+/**
+ * filedownload_task_schedule:
+ * @download: download handle
+ *
+ * Start the next pieces missing from the file on every idle single task,
+ * in content order so that the file is complete from the start as early
+ * as possible.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+filedownload_task_schedule (ProxyFileDownload * download)
+{
+  ProxyFileSingle * single;
+  int32_t i;
+
+  /* Nothing more can be scheduled before the first piece tells the content length */
+  if (download->data_fd < 0 || !download->ranged)
+    return TRUE;
+
+  for (i = 0; i < FILE_SINGLE_COUNT; i++) {
+    single = &download->singles[i];
+    if (single->piece != FILE_PIECE_NONE)
+      continue;
+
+    while (download->piece_next < download->piece_count
+        && filedownload_piece_got (download, download->piece_next))
+      download->piece_next++;
+    if (download->piece_next >= download->piece_count)
+      break;
+
+    if (!filedownload_single_start (download, single, download->piece_next))
+      return FALSE;
+    download->piece_next++;
+  }
+
+  return TRUE;
+}
+
+/**
+ * filedownload_ready:
+ * @download: download handle
+ *
+ * Returns: The bytes in the file from the read position on, with no hole.
+ */
+static uint64_t
+filedownload_ready (ProxyFileDownload * download)
+{
+  ProxyFileSingle * single;
+  uint32_t piece;
+  uint64_t end;
+  int32_t i;
+
+  if (download->data_fd < 0)
+    return 0;
+
+  if (!download->ranged)
+    return download->singles[0].received - download->read_pos;
+
+  if (download->read_pos >= download->content_length)
+    return 0;
+
+  piece = (uint32_t)(download->read_pos/FILE_PIECE_SIZE);
+  if (filedownload_piece_got (download, piece)) {
+    end = (uint64_t)(piece + 1)*FILE_PIECE_SIZE;
+    if (end > download->content_length)
+      end = download->content_length;
+    return end - download->read_pos;
+  }
+
+  /* The piece coming is written in order, its beginning can go */
+  for (i = 0; i < FILE_SINGLE_COUNT; i++) {
+    single = &download->singles[i];
+    if (single->piece == piece && single->start + single->received > download->read_pos)
+      return single->start + single->received - download->read_pos;
+  }
+
+  return 0;
+}
+
+/**
+ * filedownload_head_start:
+ * @download: download handle
+ *
+ * Request the first piece, the header comes with it.
+ *
+ * Returns: TRUE on success and FALSE on error.
+ */
+static BOOL
+filedownload_head_start (ProxyFileDownload * download)
+{
+  if (!filedownload_single_start (download, &download->singles[0], 0)) {
+    pri_error ("Start first piece failed\n");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * proxy_filedownload_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the file downloads, the downloads already created
+ * keep their settings.
+ */
+void
+proxy_filedownload_config_set (const ProxyFileConfig * config)
+{
+  p_return_if_fail (config != NULL);
+
+  pthread_mutex_lock (&filedownload_config_lock);
+  filedownload_config = *config;
+  pthread_mutex_unlock (&filedownload_config_lock);
+}
+
+/**
+ * proxy_filedownload_enabled:
+ *
+ * Returns: TRUE if a directory to keep the files in is set.
+ */
+BOOL
+proxy_filedownload_enabled (void)
+{
+  BOOL enabled;
+
+  pthread_mutex_lock (&filedownload_config_lock);
+  enabled = (filedownload_config.directory[0] != '\0');
+  pthread_mutex_unlock (&filedownload_config_lock);
+
+  return enabled;
+}
+
+/**
+ * proxy_filedownload_create:
+ * @url: The target address
+ *
+ * Start getting @url into a file, going on from what an earlier download
+ * of the same content has left.
+ *
+ * Returns: download handle, NULL on error.
+ */
+DOWNLOAD_HANDLE
+proxy_filedownload_create (char * url)
+{
+  ProxyFileDownload * download;
+  BOOL started;
+  int32_t i;
+
+  p_return_val_if_fail (url != NULL, NULL);
+
+  if ((download = calloc (1, sizeof(ProxyFileDownload))) == NULL) {
+    pri_error ("malloc file download failed\n");
+    return NULL;
+  }
+  download->data_fd = -1;
+  download->map_fd = -1;
+  for (i = 0; i < FILE_SINGLE_COUNT; i++) {
+    download->singles[i].download = download;
+    download->singles[i].piece = FILE_PIECE_NONE;
+  }
+
+  pthread_mutex_lock (&filedownload_config_lock);
+  download->config = filedownload_config;
+  pthread_mutex_unlock (&filedownload_config_lock);
+  if (download->config.directory[0] == '\0') {
+    pri_error ("No directory to download into\n");
+    goto download_create_failed;
+  }
+
+  download->url = strdup (url);
+  download->head = malloc (FILE_HEAD_BUFFER_SIZE);
+  download->read_buf = malloc (FILE_READ_BUFFER_SIZE);
+  if (download->url == NULL || download->head == NULL || download->read_buf == NULL) {
+    pri_error ("Allocating file download failed\n");
+    goto download_create_failed;
+  }
+
+  /* The transfers are driven by the engine I/O threads from now on */
+  if ((download->session = proxy_curl_engine_attach ()) == NULL) {
+    pri_error ("Attaching to engine failed\n");
+    goto download_create_failed;
+  }
+  download->multi = proxy_curl_engine_multi (download->session);
+
+  proxy_curl_engine_lock (download->session);
+  started = filedownload_head_start (download);
+  proxy_curl_engine_unlock (download->session);
+  if (!started)
+    goto download_create_failed;
+
+  return (DOWNLOAD_HANDLE)download;
+download_create_failed:
+  proxy_filedownload_destroy ((DOWNLOAD_HANDLE)download);
+  return NULL;
+}
+
+/**
+ * proxy_filedownload_destroy:
+ * @handle: download handle create by @proxy_filedownload_create
+ *
+ * Stop the transfers and destroy the download @handle, the file and its
+ * progress map stay for the next download of the same content.
+ */
+void
+proxy_filedownload_destroy (DOWNLOAD_HANDLE handle)
+{
+  ProxyFileDownload * download = (ProxyFileDownload *)handle;
+  ProxyFileSingle * single;
+  int32_t i;
+
+  p_return_if_fail (download != NULL);
+
+  /* No callback runs any more once detached, the files can be closed */
+  if (download->session != NULL) {
+    proxy_curl_engine_lock (download->session);
+    for (i = 0; i < FILE_SINGLE_COUNT; i++) {
+      single = &download->singles[i];
+      filedownload_single_release (download, single);
+      if (single->single_handle != NULL) {
+        proxy_curl_single_task_destroy (single->single_handle);
+        single->single_handle = NULL;
+      }
+    }
+    proxy_curl_engine_unlock (download->session);
+    proxy_curl_engine_detach (download->session);
+  }
+
+  /* Closing the map lets another session take it */
+  if (download->data_fd >= 0)
+    close (download->data_fd);
+  if (download->map_fd >= 0)
+    close (download->map_fd);
+
+  proxy_curl_header_list_free (download->piece_headers);
+  free (download->bitmap);
+  free (download->read_buf);
+  free (download->head);
+  free (download->url);
+
+  free (download);
+}
+
+/**
+ * filedownload_perform:
+ * @download: download handle, its engine session locked
+ *
+ * Returns: The same as @proxy_filedownload_perform.
+ */
+static int32_t
+filedownload_perform (ProxyFileDownload * download)
+{
+  if (download->failed)
+    return CURL_FAIL;
+
+  /* Whatever the engine does from now on wakes the caller up again */
+  proxy_curl_engine_clear (download->session);
+
+  filedownload_task_reap (download);
+  if (download->failed) {
+    pri_error ("Getting %s failed\n", download->url);
+    return CURL_FAIL;
+  }
+
+  if (!filedownload_task_schedule (download)) {
+    pri_error ("Schedule task failed\n");
+    return CURL_FAIL;
+  }
+
+  /* All the pieces are in the file, the reader goes on from it */
+  if (download->single_count == 0) {
+    pri_debug ("All content download done\n");
+    return 0;
+  }
+
+  return (int32_t)download->single_count;
+}
+
+/**
+ * proxy_filedownload_perform:
+ * @handle: download handle create by @proxy_filedownload_create
+ *
+ * Take what the engine has got for the transfers and start the next pieces.
+ *
+ * Returns: CURL_FAIL on error, positive value on total transfers on running,
+ * zero (0) if the whole content is in the file.
+ */
+int32_t
+proxy_filedownload_perform (DOWNLOAD_HANDLE handle)
+{
+  ProxyFileDownload * download = (ProxyFileDownload *)handle;
+  int32_t ret;
+
+  p_return_val_if_fail (download != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (download->session);
+  ret = filedownload_perform (download);
+  proxy_curl_engine_unlock (download->session);
+
+  return ret;
+}
+
+/**
+ * proxy_filedownload_fdset:
+ * @handle: download handle create by @proxy_filedownload_create
+ *
+ * Extracts the file descriptor becoming readable once the engine has got
+ * something for the transfers of @handle.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_filedownload_fdset (DOWNLOAD_HANDLE handle, fd_set * read_fd_set,
+    fd_set * write_fd_set, fd_set * exc_fd_set, int * max_fd)
+{
+  ProxyFileDownload * download = (ProxyFileDownload *)handle;
+  int fd;
+
+  p_return_val_if_fail (download != NULL, CURL_FAIL);
+  p_return_val_if_fail (read_fd_set != NULL, CURL_FAIL);
+  p_return_val_if_fail (max_fd != NULL, CURL_FAIL);
+
+  if ((fd = proxy_curl_engine_fd (download->session)) < 0)
+    return CURL_FAIL;
+
+  FD_SET (fd, read_fd_set);
+  if (fd > *max_fd)
+    *max_fd = fd;
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_filedownload_timeout:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_filedownload_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_filedownload_timeout (DOWNLOAD_HANDLE handle, int32_t * timeout_ms)
+{
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (timeout_ms != NULL, CURL_FAIL);
+
+  /* The engine runs the curl timers and wakes the reader up */
+  *timeout_ms = FILE_MAX_WAIT;
+
+  return CURL_SUCC;
+}
+
+/**
+ * filedownload_peek:
+ * @download: download handle, its engine session locked
+ *
+ * Returns: The same as @proxy_filedownload_peek.
+ */
+static int32_t
+filedownload_peek (ProxyFileDownload * download, struct iovec * iov, int32_t iov_count)
+{
+  uint64_t ready;
+  ssize_t ret;
+  int32_t count = 0;
+
+  if (download->data_fd < 0)
+    return download->failed ? CURL_FAIL : 0;
+
+  if (count < iov_count && download->head_sent < download->head_len) {
+    iov[count].iov_base = download->head + download->head_sent;
+    iov[count].iov_len = download->head_len - download->head_sent;
+    count++;
+  }
+
+  /* Read on from the file once the client has taken the last read */
+  if (download->read_offset >= download->read_len
+      && (ready = filedownload_ready (download)) > 0) {
+    if (ready > FILE_READ_BUFFER_SIZE)
+      ready = FILE_READ_BUFFER_SIZE;
+    do {
+      ret = pread (download->data_fd, download->read_buf, (size_t)ready, (off_t)download->read_pos);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+      pri_error ("Reading %s failed: %s\n", download->url, strerror(errno));
+      download->failed = TRUE;
+      return CURL_FAIL;
+    }
+    download->read_len = (uint32_t)ret;
+    download->read_offset = 0;
+    download->read_pos += (uint64_t)ret;
+  }
+
+  if (count < iov_count && download->read_offset < download->read_len) {
+    iov[count].iov_base = download->read_buf + download->read_offset;
+    iov[count].iov_len = download->read_len - download->read_offset;
+    count++;
+  }
+
+  /* No data available now, and none will come if the download failed */
+  if (count == 0 && download->failed)
+    return CURL_FAIL;
+
+  return count;
+}
+
+/**
+ * filedownload_consume:
+ * @download: download handle, its engine session locked
+ *
+ * Returns: The number of bytes consumed.
+ */
+static uint32_t
+filedownload_consume (ProxyFileDownload * download, uint32_t len)
+{
+  uint32_t consumed = 0;
+  uint32_t length;
+
+  if (download->data_fd < 0)
+    return 0;
+
+  length = download->head_len - download->head_sent;
+  if (length > len)
+    length = len;
+  download->head_sent += length;
+  consumed += length;
+
+  length = download->read_len - download->read_offset;
+  if (length > len - consumed)
+    length = len - consumed;
+  download->read_offset += length;
+  consumed += length;
+
+  return consumed;
+}
+
+/**
+ * proxy_filedownload_read:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @buf: pointer to buffer where data will be written, Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Read the header and the content complete so far.
+ *
+ * Returns: The number of bytes read, 0 if nothing is ready, -1 on error.
+ */
+int32_t
+proxy_filedownload_read (DOWNLOAD_HANDLE handle, char * buf, uint32_t len)
+{
+  ProxyFileDownload * download = (ProxyFileDownload *)handle;
+  struct iovec iov;
+  uint32_t read_length;
+  int32_t ret;
+
+  p_return_val_if_fail (download != NULL, CURL_FAIL);
+  p_return_val_if_fail (buf != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (download->session);
+  if ((ret = filedownload_peek (download, &iov, 1)) > 0) {
+    read_length = (iov.iov_len > len) ? len : (uint32_t)iov.iov_len;
+    memcpy (buf, iov.iov_base, read_length);
+    ret = (int32_t)filedownload_consume (download, read_length);
+  }
+  proxy_curl_engine_unlock (download->session);
+
+  return ret;
+}
+
+/**
+ * proxy_filedownload_peek:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order. The
+ * regions stay valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_filedownload_peek (DOWNLOAD_HANDLE handle, struct iovec * iov, int32_t iov_count)
+{
+  ProxyFileDownload * download = (ProxyFileDownload *)handle;
+  int32_t ret;
+
+  p_return_val_if_fail (download != NULL, CURL_FAIL);
+  p_return_val_if_fail (iov != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (download->session);
+  ret = filedownload_peek (download, iov, iov_count);
+  proxy_curl_engine_unlock (download->session);
+
+  return ret;
+}
+
+/**
+ * proxy_filedownload_consume:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @len: bytes used from the regions got by @proxy_filedownload_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_filedownload_consume (DOWNLOAD_HANDLE handle, uint32_t len)
+{
+  ProxyFileDownload * download = (ProxyFileDownload *)handle;
+  uint32_t consumed;
+
+  p_return_val_if_fail (download != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (download->session);
+  consumed = filedownload_consume (download, len);
+  proxy_curl_engine_unlock (download->session);
+
+  return (int32_t)consumed;
+}
@@ -0,0 +1,255 @@
+#ifndef __PROXY_FILE_DOWNLOAD_H__
+#define __PROXY_FILE_DOWNLOAD_H__
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+#define FILE_SINGLE_COUNT 4 /* pieces downloaded at the same time */
+#define FILE_PIECE_SIZE (1024*1024) /* size of each piece, the unit of the progress map */
+#define FILE_READ_BUFFER_SIZE (64*1024) /* file data read at a time for the client */
+#define FILE_HEAD_BUFFER_SIZE (32*1024) /* max length of the header handed to the client */
+#define FILE_MAX_WAIT 1000 /* max milliseconds to wait for the engine before performing again */
+#define FILE_PATH_SIZE 1024
+
+#define FILE_MAP_MAGIC "PXYMAP2"
+#define FILE_PIECE_NONE 0xFFFFFFFFU /* piece of an idle single task */
+
+typedef void* DOWNLOAD_HANDLE;
+
+typedef struct _ProxyFileConfig ProxyFileConfig;
+typedef struct _ProxyFileMapHeader ProxyFileMapHeader;
+typedef struct _ProxyFileSingle ProxyFileSingle;
+typedef struct _ProxyFileDownload ProxyFileDownload;
+
+/**
+ * ProxyFileConfig:
+ *
+ * Settings shared by all the file downloads, taken by each download on creation.
+ */
+struct _ProxyFileConfig {
+  char directory[FILE_PATH_SIZE]; /* where the files are kept, empty to disable the downloads */
+};
+
+/**
+ * ProxyFileMapHeader:
+ *
+ * Start of the progress map file, the bitmap of the pieces done follows.
+ * The map is only used again for the same content.
+ */
+struct _ProxyFileMapHeader {
+  char      magic[8];         /* FILE_MAP_MAGIC */
+  uint64_t  content_length;   /* length of the whole content */
+  uint32_t  piece_size;       /* size of each piece */
+  char      validator[128];   /* strong ETag or Last-Modified of the content */
+};
+
+/**
+ * ProxyFileSingle:
+ *
+ * Use as a callback param to the single task's data-write-function.
+ */
+struct _ProxyFileSingle {
+  void * single_handle;
+  ProxyFileDownload * download;
+
+  uint32_t  piece;            /* index of the piece, FILE_PIECE_NONE if idle */
+  uint64_t  start;            /* content position of the piece */
+  uint32_t  length;           /* length of the piece */
+  uint64_t  received;         /* bytes of the piece written to the file */
+  uint32_t  status;           /* status code of the response the piece is got from */
+};
+
+/**
+ * ProxyFileDownload:
+ *
+ * A large file got by parallel range requests into a sparse file on disk.
+ * The progress map is kept next to it, so that a download started again
+ * after a failure only gets the pieces missing. The file is handed to the
+ * client as far as it is complete from the start.
+ */
+struct _ProxyFileDownload {
+  /* the target url */
+  char * url;
+
+  /* validators of the content got from the first response, empty if none */
+  char etag[128];
+  char last_modified[64];
+
+  /* extra request headers making sure the pieces get the same content */
+  void * piece_headers;
+
+  /* content length, 0 if unknown */
+  uint64_t content_length;
+
+  /* status code of the response the header is being got from */
+  uint32_t status;
+
+  /* the response being got is a redirect */
+  BOOL redirect;
+
+  /* the origin sends ranges, the content is got by pieces */
+  BOOL ranged;
+
+  /* the header for the client, complete once @data_fd is open */
+  char * head;
+  uint32_t head_len;
+  uint32_t head_sent;
+
+  /* the data file and its progress map, -1 until the header is got */
+  int data_fd;
+  int map_fd;
+  char data_path[FILE_PATH_SIZE];
+  char map_path[FILE_PATH_SIZE];
+
+  /* the pieces done, one bit each */
+  uint8_t * bitmap;
+  uint32_t piece_count;
+  uint32_t piece_done;
+
+  /* first piece not assigned to a single task yet */
+  uint32_t piece_next;
+
+  /* file data read for the client and not consumed yet */
+  char * read_buf;
+  uint32_t read_len;
+  uint32_t read_offset;
+
+  /* content position of the end of @read_buf, read from the file so far */
+  uint64_t read_pos;
+
+  /* getting content failed, no more data will come */
+  BOOL failed;
+
+  /* engine session driving @multi, locked while touching anything above */
+  void * session;
+  void * multi;
+
+  /* running single task count */
+  uint32_t single_count;
+
+  /* all single task handle, the first one gets the header */
+  ProxyFileSingle singles[FILE_SINGLE_COUNT];
+
+  /* settings taken on creation */
+  ProxyFileConfig config;
+};
+
+/**
+ * proxy_filedownload_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the file downloads, the downloads already created
+ * keep their settings.
+ */
+void
+proxy_filedownload_config_set (const ProxyFileConfig * config);
+
+/**
+ * proxy_filedownload_enabled:
+ *
+ * Returns: TRUE if a directory to keep the files in is set.
+ */
+BOOL
+proxy_filedownload_enabled (void);
+
+/**
+ * proxy_filedownload_create:
+ * @url: The target address
+ *
+ * Start getting @url into a file, going on from what an earlier download
+ * of the same content has left.
+ *
+ * Returns: download handle, NULL on error.
+ */
+DOWNLOAD_HANDLE
+proxy_filedownload_create (char * url);
+
+/**
+ * proxy_filedownload_destroy:
+ * @handle: download handle create by @proxy_filedownload_create
+ *
+ * Stop the transfers and destroy the download @handle, the file and its
+ * progress map stay for the next download of the same content.
+ */
+void
+proxy_filedownload_destroy (DOWNLOAD_HANDLE handle);
+
+/**
+ * proxy_filedownload_perform:
+ * @handle: download handle create by @proxy_filedownload_create
+ *
+ * Take what the engine has got for the transfers and start the next pieces.
+ *
+ * Returns: CURL_FAIL on error, positive value on total transfers on running,
+ * zero (0) if the whole content is in the file.
+ */
+int32_t
+proxy_filedownload_perform (DOWNLOAD_HANDLE handle);
+
+/**
+ * proxy_filedownload_fdset:
+ * @handle: download handle create by @proxy_filedownload_create
+ *
+ * Extracts the file descriptor becoming readable once the engine has got
+ * something for the transfers of @handle.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_filedownload_fdset (DOWNLOAD_HANDLE handle, fd_set * read_fd_set,
+    fd_set * write_fd_set, fd_set * exc_fd_set, int * max_fd);
+
+/**
+ * proxy_filedownload_timeout:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_filedownload_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_filedownload_timeout (DOWNLOAD_HANDLE handle, int32_t * timeout_ms);
+
+/**
+ * proxy_filedownload_read:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @buf: pointer to buffer where data will be written, Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Read the header and the content complete so far.
+ *
+ * Returns: The number of bytes read, 0 if nothing is ready, -1 on error.
+ */
+int32_t
+proxy_filedownload_read (DOWNLOAD_HANDLE handle, char * buf, uint32_t len);
+
+/**
+ * proxy_filedownload_peek:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order. The
+ * regions stay valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_filedownload_peek (DOWNLOAD_HANDLE handle, struct iovec * iov, int32_t iov_count);
+
+/**
+ * proxy_filedownload_consume:
+ * @handle: download handle create by @proxy_filedownload_create
+ * @len: bytes used from the regions got by @proxy_filedownload_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_filedownload_consume (DOWNLOAD_HANDLE handle, uint32_t len);
+
+#endif
@@ -1,11 +1,20 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <strings.h>
 
 #include "proxyqueue.h"
 #include "proxyinterface.h"
+#include "proxycurlwrapper.h"
+#include "proxycurlengine.h"
+#include "proxypool.h"
+#include "proxycache.h"
 #include "proxyavprocess.h"
+#include "proxystream.h"
+#include "proxyfiledownload.h"
+#include "proxysocket.h"
 #include "proxylog.h"
-#include "project.h"
 
 typedef struct _ProxyInterface ProxyInterface;
 
@@ -19,38 +28,247 @@ struct _ProxyInterface {
   ProxyContentType content_type;
 
   union {
-    jb_socket fd;
+    void * sock;
     void * curl;
   }handle;
 };
 
+/* Extensions of the packages and images downloaded whole, worth keeping on disk */
+static const char * interface_download_extensions[] = {
+  "apk", "ipa", "zip", "rar", "7z", "gz", "tgz", "bz2", "xz", "tar", "iso",
+  "img", "bin", "exe", "msi", "dmg", "deb", "rpm", "obb", NULL
+};
+
+/* Extensions of the pages, scripts, images and playlists, usually small */
+static const char * interface_stream_extensions[] = {
+  "html", "htm", "shtml", "xhtml", "php", "asp", "aspx", "jsp", "cgi",
+  "js", "css", "json", "xml", "txt", "ico", "png", "jpg", "jpeg", "gif",
+  "bmp", "webp", "svg", "woff", "woff2", "ttf", "eot", "m3u8", "m3u",
+  "mpd", "f4m", NULL
+};
+
+/**
+ * interface_header_find:
+ * @headers: request headers, NULL terminated, NULL for none
+ * @name: header name
+ *
+ * Returns: The value of the header @name, NULL if it is not sent.
+ */
+static const char *
+interface_header_find (const char * const * headers, const char * name)
+{
+  size_t name_len = strlen(name);
+
+  for (; headers != NULL && *headers != NULL; headers++) {
+    if (strncasecmp (*headers, name, name_len) == 0 && (*headers)[name_len] == ':')
+      return *headers + name_len + 1;
+  }
+
+  return NULL;
+}
+
+static BOOL
+interface_extension_match (const char * ext, size_t ext_len, const char ** extensions)
+{
+  for (; *extensions != NULL; extensions++) {
+    if (strlen(*extensions) == ext_len && strncasecmp (ext, *extensions, ext_len) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
 /**
  * proxy_interface_url_parse
  * @url: The target address
  *
- * Parse the url to tell the content type.
+ * Parse the url to tell the content type by the extension of its path. The
+ * pages and the other small objects are streamed as they come, the range
+ * requests only pay off for large bodies. Packages are downloaded to disk
+ * when a download directory is set. A name without extension is mostly a
+ * page or an API call, it is streamed too. Those with an unknown extension
+ * are taken as media, a small body is got by the first request anyway.
  *
  * Returns: Content type.
  */
 static ProxyContentType
-interface_url_parse (char * url)
+interface_url_parse (const char * url)
 {
+  const char * path;
+  const char * end;
+  const char * name;
+  const char * ext;
+  size_t ext_len;
+
+  if ((path = strstr (url, "://")) != NULL)
+    url = path + 3;
+  if ((path = strchr (url, '/')) == NULL)
+    return PROXY_CONTENT_TYPE_STREAM;
+
+  end = path + strcspn (path, "?#");
+  for (name = end; name > path && name[-1] != '/'; name--)
+    ;
+
+  /* A directory, it is an index page */
+  if (name == end)
+    return PROXY_CONTENT_TYPE_STREAM;
+
+  for (ext = end; ext > name && ext[-1] != '.'; ext--)
+    ;
+  if (ext == name)
+    return PROXY_CONTENT_TYPE_STREAM;
+
+  ext_len = (size_t)(end - ext);
+  if (interface_extension_match (ext, ext_len, interface_stream_extensions))
+    return PROXY_CONTENT_TYPE_STREAM;
+  if (interface_extension_match (ext, ext_len, interface_download_extensions)
+      && proxy_filedownload_enabled ())
+    return PROXY_CONTENT_TYPE_FILE_NORMAL;
+
   return PROXY_CONTENT_TYPE_MEDIA;
 }
 
+/**
+ * proxy_interface_init:
+ *
+ * Initialize the proxy interface, must be called once before any other
+ * thread is running. No interface can be created before
+ * proxy_interface_start.
+ *
+ * Returns: 0 on success or -1 on error.
+ */
+int32_t
+proxy_interface_init (void)
+{
+  if (proxy_curl_init () != CURL_SUCC) {
+    pri_error ("curl init failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * proxy_interface_start:
+ *
+ * Start the I/O threads of the proxy interface, must be called once after
+ * proxy_interface_init and after daemonizing, threads don't survive a fork.
+ *
+ * Returns: 0 on success or -1 on error.
+ */
+int32_t
+proxy_interface_start (void)
+{
+  if (proxy_curl_engine_start (CURL_ENGINE_THREAD_COUNT) != CURL_SUCC) {
+    pri_error ("curl engine start failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * proxy_interface_uninit:
+ *
+ * Release the resources held by the proxy interface.
+ */
+void
+proxy_interface_uninit (void)
+{
+  proxy_curl_engine_stop ();
+  proxy_curl_uninit ();
+  proxy_pool_uninit ();
+}
+
+/**
+ * proxy_interface_config_set:
+ * @config: The new settings
+ *
+ * Change the settings of the proxy interfaces, can be called at any time.
+ * The interfaces already created keep the settings they were created with.
+ */
+void
+proxy_interface_config_set (const ProxyInterfaceConfig * config)
+{
+  ProxyAVConfig av_config;
+  ProxyPoolConfig pool_config;
+  ProxyFileConfig file_config;
+  ProxyCacheConfig cache_config;
+
+  p_return_if_fail (config != NULL);
+
+  av_config.ramp_first_size = config->media_first_window_size;
+  av_config.ramp_factor = config->media_window_growth;
+  av_config.read_ahead = config->media_read_ahead;
+  proxy_avprocess_config_set (&av_config);
+
+  pool_config.limit = config->media_memory_limit;
+  pool_config.prefault = (config->media_memory_prefault != 0);
+  pool_config.lock = (config->media_memory_lock != 0);
+  proxy_pool_config_set (&pool_config);
+
+  snprintf (file_config.directory, sizeof(file_config.directory), "%s", \
+      config->download_directory ? config->download_directory : "");
+  proxy_filedownload_config_set (&file_config);
+
+  snprintf (cache_config.directory, sizeof(cache_config.directory), "%s", \
+      config->media_cache_directory ? config->media_cache_directory : "");
+  cache_config.size_limit = config->media_cache_size;
+  proxy_cache_config_set (&cache_config);
+}
+
+/**
+ * proxy_interface_classify
+ * @request: The request of the client
+ *
+ * Tell how the content of @request will be got, so that the caller knows
+ * whether to connect the server itself before creating the interface.
+ *
+ * Returns: Content type.
+ */
+ProxyContentType
+proxy_interface_classify (const ProxyInterfaceRequest * request)
+{
+  ProxyContentType content_type;
+
+  p_return_val_if_fail (request != NULL, PROXY_CONTENT_TYPE_NONE);
+  p_return_val_if_fail (request->url != NULL, PROXY_CONTENT_TYPE_NONE);
+
+  /* Parse the url to get the content type if the actions did not tell,
+   * anything but GET is sent on as it is by a single request */
+  content_type = request->content_type;
+  if (content_type == PROXY_CONTENT_TYPE_NONE) {
+    if (request->method != NULL && strcasecmp (request->method, "GET") != 0)
+      content_type = PROXY_CONTENT_TYPE_STREAM;
+    else
+      content_type = interface_url_parse (request->url);
+  }
+  if (content_type == PROXY_CONTENT_TYPE_FILE_NORMAL && !proxy_filedownload_enabled ())
+    content_type = PROXY_CONTENT_TYPE_MEDIA;
+
+  return content_type;
+}
+
 /**
  * proxy_interface_create
- * @url: The target address
+ * @request: The request of the client
  *
- * Create a proxy interface via which can do read and write.
+ * Create a proxy interface via which can do read and write. Large media
+ * are got by parallel range requests, anything else by a single request
+ * streamed to the client. The response is relayed from the server socket
+ * of @request if one is given for a stream.
  *
  * Returns: The proxy interface handle.
  */
 PROXY_HANDLE
-proxy_interface_create (char * url)
+proxy_interface_create (const ProxyInterfaceRequest * request)
 {
   ProxyInterface * proxy = NULL;
   ProxyContentType content_type;
+  const char * range;
+
+  p_return_val_if_fail (request != NULL, 0);
+  p_return_val_if_fail (request->url != NULL, 0);
 
   proxy = (ProxyInterface *)malloc(sizeof(ProxyInterface));
   if (proxy == NULL) {
@@ -58,28 +276,53 @@ proxy_interface_create (char * url)
     return 0;
   }
 
-  /* Parse the url to get the content type if needed */
-  if ( url != NULL ) {
-    pri_debug ("Connecting server [%s] via curl\n", url);
-    content_type = interface_url_parse (url);   
-  }
+  content_type = proxy_interface_classify (request);
 
   /* Connect server by different way according to the content type */
+  if (content_type == PROXY_CONTENT_TYPE_STREAM && request->server_fd >= 0) {
+    pri_debug ("Relaying server [%s] from socket %d\n", request->url, request->server_fd);
+    proxy->handle.sock = proxy_socket_create (request->server_fd);
+    if (proxy->handle.sock == NULL) {
+      pri_error("create socket relay failed\n");
+      goto creating_failed;
+    }
+    proxy->handle_type = HANDLE_SOCKET;
+    proxy->content_type = PROXY_CONTENT_TYPE_STREAM;
+    return (PROXY_HANDLE)proxy;
+  }
+
+  pri_debug ("Connecting server [%s] via curl, content type %d\n", request->url, content_type);
   if (content_type == PROXY_CONTENT_TYPE_MEDIA) {
-    proxy->handle.curl = proxy_avprocess_create (url, NULL, NULL);
+    /* A player seeking asks for a range, one only valid for a copy of the
+     * client cannot be checked before the response and is not taken */
+    range = NULL;
+    if (interface_header_find (request->headers, "If-Range") == NULL)
+      range = interface_header_find (request->headers, "Range");
+    proxy->handle.curl = proxy_avprocess_create (request->url, range, NULL, NULL);
     if (proxy->handle.curl == NULL) {
       pri_error("create avprocess failed\n");
       goto creating_failed;
     }
     proxy->handle_type = HANDLE_CURL;
     proxy->content_type = PROXY_CONTENT_TYPE_MEDIA;
+  } else if (content_type == PROXY_CONTENT_TYPE_STREAM) {
+    proxy->handle.curl = proxy_stream_create (request->url, request->method, \
+        request->headers, request->body_length);
+    if (proxy->handle.curl == NULL) {
+      pri_error("create stream failed\n");
+      goto creating_failed;
+    }
+    proxy->handle_type = HANDLE_CURL;
+    proxy->content_type = PROXY_CONTENT_TYPE_STREAM;
   } else if (content_type == PROXY_CONTENT_TYPE_FILE_NORMAL) {
+    proxy->handle.curl = proxy_filedownload_create (request->url);
+    if (proxy->handle.curl == NULL) {
+      pri_error("create file download failed\n");
+      goto creating_failed;
+    }
     proxy->handle_type = HANDLE_CURL;
     proxy->content_type = PROXY_CONTENT_TYPE_FILE_NORMAL;
-    pri_warning("Not support now\n");
-    goto creating_failed;
   } else {
-    proxy->handle_type = HANDLE_SOCKET;
     pri_warning("Not support now\n");
     goto creating_failed;
   }
@@ -87,7 +330,7 @@ proxy_interface_create (char * url)
   return (PROXY_HANDLE)proxy;
   
 creating_failed:
-  if (!proxy) free(proxy);
+  free(proxy);
   return 0;
 }
 
@@ -108,11 +351,13 @@ proxy_interface_destroy (PROXY_HANDLE handle)
     if (proxy->handle.curl != 0) {
       if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
         proxy_avprocess_destroy(proxy->handle.curl);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        proxy_stream_destroy (proxy->handle.curl);
       else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
-        pri_warning("Not support now\n");
+        proxy_filedownload_destroy (proxy->handle.curl);
     }
-  } else {
-    pri_warning("Not support now\n");
+  } else if (proxy->handle.sock != NULL) {
+    proxy_socket_destroy (proxy->handle.sock);
   }
 
   free (proxy);
@@ -136,11 +381,13 @@ proxy_interface_perform (PROXY_HANDLE handle)
     if (proxy->handle.curl != 0) {
       if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
         return proxy_avprocess_perform (proxy->handle.curl);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        return proxy_stream_perform (proxy->handle.curl);
       else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
-        pri_warning("Not support now\n");
+        return proxy_filedownload_perform (proxy->handle.curl);
     }
-  } else {
-    pri_warning("Not support now\n");
+  } else if (proxy->handle.sock != NULL) {
+    return proxy_socket_perform (proxy->handle.sock);
   }
 
   return -1;
@@ -165,11 +412,47 @@ proxy_interface_fdset (PROXY_HANDLE handle,fd_set * read_fd_set,
       if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
         return proxy_avprocess_fdset (proxy->handle.curl,\
             read_fd_set, write_fd_set, exc_fd_set, max_fd);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        return proxy_stream_fdset (proxy->handle.curl,\
+            read_fd_set, write_fd_set, exc_fd_set, max_fd);
       else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
-        pri_warning("Not support now\n");
+        return proxy_filedownload_fdset (proxy->handle.curl,\
+            read_fd_set, write_fd_set, exc_fd_set, max_fd);
     }
-  } else {
-    pri_warning("Not support now\n");
+  } else if (proxy->handle.sock != NULL) {
+    return proxy_socket_fdset (proxy->handle.sock,\
+        read_fd_set, write_fd_set, exc_fd_set, max_fd);
+  }
+
+  return -1;
+}
+
+/**
+ * proxy_interface_timeout:
+ * @handle: The interface handle create by @proxy_interface_create
+ * @timeout_ms: where to store the milliseconds to wait
+ * 
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_interface_fdset before performing again anyway.
+ * 
+ * Returns: 0 on success or -1 error.
+ */
+int32_t
+proxy_interface_timeout (PROXY_HANDLE handle, int32_t * timeout_ms)
+{
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+  
+  if (proxy->handle_type == HANDLE_CURL) {
+    if (proxy->handle.curl != 0) {
+      if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
+        return proxy_avprocess_timeout (proxy->handle.curl, timeout_ms);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        return proxy_stream_timeout (proxy->handle.curl, timeout_ms);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
+        return proxy_filedownload_timeout (proxy->handle.curl, timeout_ms);
+    }
+  } else if (proxy->handle.sock != NULL) {
+    return proxy_socket_timeout (proxy->handle.sock, timeout_ms);
   }
 
   return -1;
@@ -199,29 +482,174 @@ proxy_interface_read (PROXY_HANDLE handle, char * buf, uint32_t len)
     if (proxy->handle.curl != 0) {
       if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
         return proxy_avprocess_read (proxy->handle.curl, buf, len);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        return proxy_stream_read (proxy->handle.curl, buf, len);
       else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
-        pri_warning("Not support now\n");
+        return proxy_filedownload_read (proxy->handle.curl, buf, len);
     }
-  } else {
-    pri_warning("Not support now\n");
+  } else if (proxy->handle.sock != NULL) {
+    return proxy_socket_read (proxy->handle.sock, buf, len);
+  }
+
+  return -1;
+}
+
+/**
+ * proxy_interface_peek
+ * @handle: The proxy interface handle
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order, so that
+ * it can be written out by writev(). The regions stay valid until the next
+ * call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready now, -1 on error.
+ */
+int32_t
+proxy_interface_peek (PROXY_HANDLE handle, struct iovec * iov, int32_t iov_count)
+{
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+  
+  p_return_val_if_fail (proxy != NULL, -1);
+  p_return_val_if_fail (iov != NULL, -1);
+  
+  if (proxy->handle_type == HANDLE_CURL) {
+    if (proxy->handle.curl != 0) {
+      if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
+        return proxy_avprocess_peek (proxy->handle.curl, iov, iov_count);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        return proxy_stream_peek (proxy->handle.curl, iov, iov_count);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
+        return proxy_filedownload_peek (proxy->handle.curl, iov, iov_count);
+    }
+  } else if (proxy->handle.sock != NULL) {
+    return proxy_socket_peek (proxy->handle.sock, iov, iov_count);
+  }
+
+  return -1;
+}
+
+/**
+ * proxy_interface_consume
+ * @handle: The proxy interface handle
+ * @len: bytes used from the regions got by @proxy_interface_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_interface_consume (PROXY_HANDLE handle, uint32_t len)
+{
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+  
+  p_return_val_if_fail (proxy != NULL, -1);
+  
+  if (proxy->handle_type == HANDLE_CURL) {
+    if (proxy->handle.curl != 0) {
+      if (proxy->content_type == PROXY_CONTENT_TYPE_MEDIA)
+        return proxy_avprocess_consume (proxy->handle.curl, len);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+        return proxy_stream_consume (proxy->handle.curl, len);
+      else if (proxy->content_type == PROXY_CONTENT_TYPE_FILE_NORMAL)
+        return proxy_filedownload_consume (proxy->handle.curl, len);
+    }
+  } else if (proxy->handle.sock != NULL) {
+    return proxy_socket_consume (proxy->handle.sock, len);
   }
 
   return -1;
 }
 
+/**
+ * proxy_interface_can_splice
+ * @handle: The proxy interface handle
+ *
+ * Returns: nonzero if the data of @handle can be moved by
+ * @proxy_interface_splice.
+ */
+int32_t
+proxy_interface_can_splice (PROXY_HANDLE handle)
+{
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+
+  p_return_val_if_fail (proxy != NULL, 0);
+
+  return proxy->handle_type == HANDLE_SOCKET;
+}
+
+/**
+ * proxy_interface_splice
+ * @handle: The proxy interface handle
+ * @out_fd: where to write the data
+ *
+ * Move the data ready to @out_fd inside the kernel, instead of peeking and
+ * writing it out. Only the interfaces relaying a server socket can do it.
+ *
+ * Returns: The number of bytes written to @out_fd, 0 if no data is ready
+ * now, -1 on error.
+ */
+int32_t
+proxy_interface_splice (PROXY_HANDLE handle, int out_fd)
+{
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+
+  p_return_val_if_fail (proxy != NULL, -1);
+
+  if (proxy->handle_type == HANDLE_SOCKET && proxy->handle.sock != NULL)
+    return proxy_socket_splice (proxy->handle.sock, out_fd);
+
+  pri_warning("Not support now\n");
+  return -1;
+}
+
+/**
+ * proxy_interface_write_space
+ * @handle: The proxy interface handle
+ *
+ * Tell how much of the request body @proxy_interface_write takes now, the
+ * upload is buffered up to a fixed size.
+ *
+ * Returns: The number of bytes, 0 if the buffer is full or there is no upload.
+ */
+uint32_t
+proxy_interface_write_space (PROXY_HANDLE handle)
+{
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+
+  p_return_val_if_fail (proxy != NULL, 0);
+
+  if (proxy->handle_type == HANDLE_CURL && proxy->handle.curl != 0
+      && proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+    return proxy_stream_write_space (proxy->handle.curl);
+
+  return 0;
+}
+
 /**
  * proxy_interface_write
  * @handle: The proxy interface handle
  * @buf: pointer to data to be written.
- * @len: length of data to be written to the interface.
+ * @len: length of data to be written to the interface, no more than
+ * @proxy_interface_write_space tells, zero to end a body of unknown length.
+ *
+ * Send the next part of the request body to the server.
  * 
  * Returns: 0 on success (entire buffer sent), nonzero on error.
  */
 int32_t
 proxy_interface_write (PROXY_HANDLE handle, const char * buf, uint32_t len)
 {
-  p_return_val_if_fail (handle != 0, -1);
+  ProxyInterface * proxy = (ProxyInterface *)handle;
+
+  p_return_val_if_fail (proxy != NULL, -1);
   p_return_val_if_fail (buf != NULL, -1);
 
-  return 0;
+  if (proxy->handle_type == HANDLE_CURL && proxy->handle.curl != 0
+      && proxy->content_type == PROXY_CONTENT_TYPE_STREAM)
+    return proxy_stream_write (proxy->handle.curl, buf, len);
+
+  pri_warning("Not support now\n");
+  return -1;
 }
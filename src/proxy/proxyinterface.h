@@ -2,6 +2,7 @@
 #define __PROXY_INTERFACE_H__
 
 #include <sys/select.h>
+#include <sys/uio.h>
 
 typedef void* PROXY_HANDLE;
 
@@ -9,18 +10,109 @@ typedef enum {
   PROXY_CONTENT_TYPE_NONE        = 0,
   PROXY_CONTENT_TYPE_MEDIA       = 1,
   PROXY_CONTENT_TYPE_FILE_NORMAL = 2,
+  PROXY_CONTENT_TYPE_STREAM      = 3,
 }ProxyContentType;
 
+typedef struct _ProxyInterfaceConfig ProxyInterfaceConfig;
+typedef struct _ProxyInterfaceRequest ProxyInterfaceRequest;
+
+/**
+ * ProxyInterfaceConfig:
+ *
+ * Settings of the proxy interfaces, usually taken from the config file.
+ */
+struct _ProxyInterfaceConfig {
+  uint32_t media_first_window_size; /* bytes of the first media window, 0 disables slow start */
+  uint32_t media_window_growth;     /* growth of each media window over the previous one */
+  uint32_t media_read_ahead;        /* bytes of media downloaded ahead of the client, 0 for no limit */
+  uint64_t media_memory_limit;      /* bytes of all the media buffers, 0 for no limit */
+  int32_t  media_memory_prefault;   /* nonzero to allocate the media buffers at once */
+  int32_t  media_memory_lock;       /* nonzero to lock the media buffers in memory */
+  const char * download_directory;  /* where the large downloads are kept, NULL to disable them */
+  const char * media_cache_directory; /* where the media contents are cached, NULL to disable the cache */
+  uint64_t media_cache_size;        /* bytes of the media cache on disk, 0 for no limit */
+};
+
+/**
+ * ProxyInterfaceRequest:
+ *
+ * What the client asks for, tells how to get the content.
+ */
+struct _ProxyInterfaceRequest {
+  char * url;                    /* the target address */
+  ProxyContentType content_type; /* forced by the actions, NONE to tell it by @url */
+  int server_fd;                 /* server socket the request has been sent to, -1 if none */
+  const char * method;           /* request method, NULL for GET */
+  const char * const * headers;  /* request headers of the client, NULL terminated, NULL for none */
+  int64_t body_length;           /* length of the request body, -1 if not known */
+};
+
+/**
+ * proxy_interface_init:
+ *
+ * Initialize the proxy interface, must be called once before any other
+ * thread is running. No interface can be created before
+ * proxy_interface_start.
+ *
+ * Returns: 0 on success or -1 on error.
+ */
+int32_t
+proxy_interface_init (void);
+
+/**
+ * proxy_interface_start:
+ *
+ * Start the I/O threads of the proxy interface, must be called once after
+ * proxy_interface_init and after daemonizing, threads don't survive a fork.
+ *
+ * Returns: 0 on success or -1 on error.
+ */
+int32_t
+proxy_interface_start (void);
+
+/**
+ * proxy_interface_uninit:
+ *
+ * Release the resources held by the proxy interface.
+ */
+void
+proxy_interface_uninit (void);
+
+/**
+ * proxy_interface_config_set:
+ * @config: The new settings
+ *
+ * Change the settings of the proxy interfaces, can be called at any time.
+ * The interfaces already created keep the settings they were created with.
+ */
+void
+proxy_interface_config_set (const ProxyInterfaceConfig * config);
+
+/**
+ * proxy_interface_classify
+ * @request: The request of the client
+ *
+ * Tell how the content of @request will be got, so that the caller knows
+ * whether to connect the server itself before creating the interface.
+ *
+ * Returns: Content type.
+ */
+ProxyContentType
+proxy_interface_classify (const ProxyInterfaceRequest * request);
+
 /**
  * proxy_interface_create
- * @url: The target address
+ * @request: The request of the client
  *
- * Create a proxy interface via which can do read and write.
+ * Create a proxy interface via which can do read and write. Large media
+ * are got by parallel range requests, anything else by a single request
+ * streamed to the client. The response is relayed from the server socket
+ * of @request if one is given for a stream.
  *
  * Returns: The proxy interface handle.
  */
 PROXY_HANDLE
-proxy_interface_create (char * url);
+proxy_interface_create (const ProxyInterfaceRequest * request);
 
 /**
  * proxy_interface_destroy
@@ -55,6 +147,19 @@ int32_t
 proxy_interface_fdset (PROXY_HANDLE handle,fd_set * read_fd_set,
     fd_set * write_fd_set,fd_set * exc_fd_set,int * max_fd);
 
+/**
+ * proxy_interface_timeout:
+ * @handle: The interface handle create by @proxy_interface_create
+ * @timeout_ms: where to store the milliseconds to wait
+ * 
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_interface_fdset before performing again anyway.
+ * 
+ * Returns: 0 on success or -1 error.
+ */
+int32_t
+proxy_interface_timeout (PROXY_HANDLE handle, int32_t * timeout_ms);
+
 /**
  * proxy_interface_read
  *
@@ -70,11 +175,78 @@ proxy_interface_fdset (PROXY_HANDLE handle,fd_set * read_fd_set,
 int32_t 
 proxy_interface_read (PROXY_HANDLE handle, char * buf, uint32_t len);
 
+/**
+ * proxy_interface_peek
+ * @handle: The proxy interface handle
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order, so that
+ * it can be written out by writev(). The regions stay valid until the next
+ * call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready now, -1 on error.
+ */
+int32_t
+proxy_interface_peek (PROXY_HANDLE handle, struct iovec * iov, int32_t iov_count);
+
+/**
+ * proxy_interface_consume
+ * @handle: The proxy interface handle
+ * @len: bytes used from the regions got by @proxy_interface_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_interface_consume (PROXY_HANDLE handle, uint32_t len);
+
+/**
+ * proxy_interface_can_splice
+ * @handle: The proxy interface handle
+ *
+ * Returns: nonzero if the data of @handle can be moved by
+ * @proxy_interface_splice.
+ */
+int32_t
+proxy_interface_can_splice (PROXY_HANDLE handle);
+
+/**
+ * proxy_interface_splice
+ * @handle: The proxy interface handle
+ * @out_fd: where to write the data
+ *
+ * Move the data ready to @out_fd inside the kernel, instead of peeking and
+ * writing it out. Only the interfaces relaying a server socket can do it.
+ *
+ * Returns: The number of bytes written to @out_fd, 0 if no data is ready
+ * now, -1 on error.
+ */
+int32_t
+proxy_interface_splice (PROXY_HANDLE handle, int out_fd);
+
+/**
+ * proxy_interface_write_space
+ * @handle: The proxy interface handle
+ *
+ * Tell how much of the request body @proxy_interface_write takes now, the
+ * upload is buffered up to a fixed size.
+ *
+ * Returns: The number of bytes, 0 if the buffer is full or there is no upload.
+ */
+uint32_t
+proxy_interface_write_space (PROXY_HANDLE handle);
+
+
 /**
  * proxy_interface_write
  * @handle: The proxy interface handle
  * @buf: pointer to data to be written.
- * @len: length of data to be written to the interface.
+ * @len: length of data to be written to the interface, no more than
+ * @proxy_interface_write_space tells, zero to end a body of unknown length.
+ *
+ * Send the next part of the request body to the server.
  * 
  * Returns: 0 on success (entire buffer sent), nonzero on error.
  */
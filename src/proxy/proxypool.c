@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "proxylog.h"
+#include "proxypool.h"
+
+#define POOL_CLASS_SIZE(class) ((uint32_t)POOL_MIN_BUFFER_SIZE << (class))
+
+static ProxyPoolConfig pool_config = {0, FALSE, FALSE};
+static char * pool_free_list[POOL_CLASS_COUNT]; /* free buffers of each class, linked through their first bytes */
+static uint64_t pool_total;     /* bytes of all the buffers, held or free */
+static uint64_t pool_used;      /* bytes of the buffers held by the users */
+static uint32_t pool_users;
+static BOOL pool_lock_failed;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * pool_class_get:
+ * @size: bytes needed
+ *
+ * Returns: The smallest buffer class holding @size bytes, -1 if none.
+ */
+static int32_t
+pool_class_get (uint32_t size)
+{
+  int32_t class;
+
+  for (class = 0; class < POOL_CLASS_COUNT; class++) {
+    if (size <= POOL_CLASS_SIZE(class))
+      return class;
+  }
+
+  return -1;
+}
+
+/**
+ * pool_buffer_new:
+ * @class: buffer class
+ *
+ * Allocate a new buffer from the system, the pool lock must be held.
+ *
+ * Returns: The buffer, NULL on error.
+ */
+static char *
+pool_buffer_new (int32_t class)
+{
+  uint32_t size = POOL_CLASS_SIZE(class);
+  char * buffer;
+
+  /* Zeroed so that no uninitialized memory is ever handed to mlock(), the
+   * pages of the large classes come from mmap() and stay untouched anyway */
+  if ((buffer = calloc (1, size)) == NULL) {
+    pri_error ("Malloc pool buffer failed\n");
+    return NULL;
+  }
+
+  if (pool_config.lock && mlock (buffer, size) != 0 && !pool_lock_failed) {
+    pri_warning ("Locking pool buffer failed: %s\n", strerror(errno));
+    pool_lock_failed = TRUE;
+  }
+  pool_total += size;
+
+  return buffer;
+}
+
+/**
+ * pool_buffer_delete:
+ * @buffer: the buffer
+ * @class: buffer class
+ *
+ * Give a buffer back to the system, the pool lock must be held.
+ */
+static void
+pool_buffer_delete (char * buffer, int32_t class)
+{
+  uint32_t size = POOL_CLASS_SIZE(class);
+
+  if (pool_config.lock)
+    munlock (buffer, size);
+  free (buffer);
+  pool_total -= size;
+}
+
+static char *
+pool_free_pop (int32_t class)
+{
+  char * buffer = pool_free_list[class];
+
+  if (buffer != NULL)
+    pool_free_list[class] = *(char **)buffer;
+
+  return buffer;
+}
+
+static void
+pool_free_push (char * buffer, int32_t class)
+{
+  *(char **)buffer = pool_free_list[class];
+  pool_free_list[class] = buffer;
+}
+
+/**
+ * pool_trim:
+ * @limit: bytes the pool may hold
+ *
+ * Give free buffers back to the system until the pool fits @limit, the
+ * pool lock must be held.
+ */
+static void
+pool_trim (uint64_t limit)
+{
+  char * buffer;
+  int32_t class;
+
+  for (class = 0; class < POOL_CLASS_COUNT && pool_total > limit; class++) {
+    while (pool_total > limit && (buffer = pool_free_pop (class)) != NULL)
+      pool_buffer_delete (buffer, class);
+  }
+}
+
+/**
+ * proxy_pool_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the pool. Buffers are allocated up to the limit
+ * at once if prefaulting, and free buffers beyond a lowered limit are
+ * given back to the system.
+ */
+void
+proxy_pool_config_set (const ProxyPoolConfig * config)
+{
+  int32_t class = pool_class_get (POOL_PREFAULT_BUFFER_SIZE);
+  char * buffer;
+
+  p_return_if_fail (config != NULL);
+
+  pthread_mutex_lock (&pool_lock);
+  pool_config = *config;
+  pool_lock_failed = FALSE;
+
+  if (pool_config.limit > 0)
+    pool_trim (pool_config.limit);
+
+  /* Touch every page now so that no session pays the page faults later */
+  if (pool_config.prefault && pool_config.limit > 0) {
+    while (pool_total + POOL_PREFAULT_BUFFER_SIZE <= pool_config.limit) {
+      if ((buffer = pool_buffer_new (class)) == NULL)
+        break;
+      memset (buffer, 0, POOL_PREFAULT_BUFFER_SIZE);
+      pool_free_push (buffer, class);
+    }
+    pri_debug ("Pool prefaulted, %llu bytes\n", (unsigned long long)pool_total);
+  }
+  pthread_mutex_unlock (&pool_lock);
+}
+
+/**
+ * proxy_pool_uninit:
+ *
+ * Give all the free buffers back to the system.
+ */
+void
+proxy_pool_uninit (void)
+{
+  pthread_mutex_lock (&pool_lock);
+  pool_trim (0);
+  pthread_mutex_unlock (&pool_lock);
+}
+
+/**
+ * proxy_pool_user_join:
+ * @user: the new user
+ *
+ * Start taking buffers from the pool.
+ */
+void
+proxy_pool_user_join (ProxyPoolUser * user)
+{
+  p_return_if_fail (user != NULL);
+
+  user->used = 0;
+
+  pthread_mutex_lock (&pool_lock);
+  pool_users++;
+  pthread_mutex_unlock (&pool_lock);
+}
+
+/**
+ * proxy_pool_user_leave:
+ * @user: the user, must hold no buffer any more
+ *
+ * Stop taking buffers from the pool.
+ */
+void
+proxy_pool_user_leave (ProxyPoolUser * user)
+{
+  p_return_if_fail (user != NULL);
+
+  if (user->used != 0)
+    pri_warning ("Pool user leaving with %llu bytes held\n", (unsigned long long)user->used);
+
+  pthread_mutex_lock (&pool_lock);
+  pool_users--;
+  pthread_mutex_unlock (&pool_lock);
+}
+
+/**
+ * proxy_pool_alloc:
+ * @user: the user taking the buffer
+ * @size: bytes needed
+ * @buffer_len: where to store the real length of the buffer, at least @size
+ *
+ * Take a buffer from the pool. Once the buffers held reach the limit, a
+ * user already holding buffers gets no more than its share of the limit.
+ *
+ * Returns: The buffer, NULL if the limit or the share of @user is reached.
+ */
+char *
+proxy_pool_alloc (ProxyPoolUser * user, uint32_t size, uint32_t * buffer_len)
+{
+  char * buffer = NULL;
+  int32_t class;
+  int32_t i;
+
+  p_return_val_if_fail (user != NULL, NULL);
+  p_return_val_if_fail (buffer_len != NULL, NULL);
+
+  if ((class = pool_class_get (size)) < 0) {
+    pri_error ("Buffer of %u bytes too large for the pool\n", size);
+    return NULL;
+  }
+
+  pthread_mutex_lock (&pool_lock);
+
+  /* The users share the limit fairly once it is reached. The first buffer
+   * is never refused for the share, every user can go on */
+  if (pool_config.limit > 0 && user->used > 0 && pool_users > 0
+      && pool_used + POOL_CLASS_SIZE(class) > pool_config.limit
+      && user->used + POOL_CLASS_SIZE(class) > pool_config.limit/pool_users)
+    goto pool_alloc_out;
+
+  /* Any free buffer large enough will do */
+  for (i = class; i < POOL_CLASS_COUNT && buffer == NULL; i++) {
+    if ((buffer = pool_free_pop (i)) != NULL)
+      class = i;
+  }
+
+  /* Make room from the free buffers of the other classes if needed */
+  if (buffer == NULL) {
+    if (pool_config.limit > 0 && pool_total + POOL_CLASS_SIZE(class) > pool_config.limit
+        && pool_config.limit >= POOL_CLASS_SIZE(class))
+      pool_trim (pool_config.limit - POOL_CLASS_SIZE(class));
+
+    if (pool_config.limit == 0 || pool_total + POOL_CLASS_SIZE(class) <= pool_config.limit)
+      buffer = pool_buffer_new (class);
+  }
+
+  if (buffer != NULL) {
+    *buffer_len = POOL_CLASS_SIZE(class);
+    user->used += *buffer_len;
+    pool_used += *buffer_len;
+  }
+
+pool_alloc_out:
+  pthread_mutex_unlock (&pool_lock);
+
+  return buffer;
+}
+
+/**
+ * proxy_pool_free:
+ * @user: the user holding the buffer
+ * @buffer: the buffer taken by @proxy_pool_alloc
+ * @buffer_len: the real length of the buffer
+ *
+ * Give a buffer back to the pool.
+ */
+void
+proxy_pool_free (ProxyPoolUser * user, char * buffer, uint32_t buffer_len)
+{
+  int32_t class;
+
+  p_return_if_fail (user != NULL);
+  p_return_if_fail (buffer != NULL);
+
+  if ((class = pool_class_get (buffer_len)) < 0 || POOL_CLASS_SIZE(class) != buffer_len) {
+    pri_error ("Buffer of %u bytes not from the pool\n", buffer_len);
+    return;
+  }
+
+  pthread_mutex_lock (&pool_lock);
+  user->used -= buffer_len;
+  pool_used -= buffer_len;
+
+  /* Keep it for the next user unless the limit has been lowered meanwhile */
+  if (pool_config.limit > 0 && pool_total > pool_config.limit)
+    pool_buffer_delete (buffer, class);
+  else
+    pool_free_push (buffer, class);
+  pthread_mutex_unlock (&pool_lock);
+}
+
+/**
+ * proxy_pool_hand_over:
+ * @from: the user holding the buffer
+ * @to: the user holding it from now on
+ * @buffer_len: the real length of the buffer
+ *
+ * Charge a buffer taken by @from to @to, for a buffer still used by others
+ * once @from is done with it. @to need not have joined the pool.
+ */
+void
+proxy_pool_hand_over (ProxyPoolUser * from, ProxyPoolUser * to, uint32_t buffer_len)
+{
+  p_return_if_fail (from != NULL);
+  p_return_if_fail (to != NULL);
+
+  pthread_mutex_lock (&pool_lock);
+  from->used -= buffer_len;
+  to->used += buffer_len;
+  pthread_mutex_unlock (&pool_lock);
+}
@@ -0,0 +1,109 @@
+#ifndef __PROXY_POOL_H__
+#define __PROXY_POOL_H__
+
+#include <stdint.h>
+#include "proxyqueue.h"
+
+#define POOL_MIN_BUFFER_SIZE (32*1024) /* size of the smallest buffer class */
+#define POOL_CLASS_COUNT 8 /* buffer classes, each twice as large as the previous one */
+#define POOL_PREFAULT_BUFFER_SIZE (1024*1024) /* size of the buffers allocated ahead */
+
+typedef struct _ProxyPoolConfig ProxyPoolConfig;
+typedef struct _ProxyPoolUser ProxyPoolUser;
+
+/**
+ * ProxyPoolConfig:
+ *
+ * Settings of the buffer pool shared by the whole process.
+ */
+struct _ProxyPoolConfig {
+  uint64_t  limit;          /* bytes of all the buffers, 0 for no limit */
+  BOOL      prefault;       /* allocate and touch buffers up to @limit ahead */
+  BOOL      lock;           /* lock the buffers allocated in memory */
+};
+
+/**
+ * ProxyPoolUser:
+ *
+ * A session taking buffers from the pool, the pool shares its limit fairly
+ * between the users.
+ */
+struct _ProxyPoolUser {
+  uint64_t  used;           /* bytes of the buffers held */
+};
+
+/**
+ * proxy_pool_config_set:
+ * @config: the new settings
+ *
+ * Change the settings of the pool. Buffers are allocated up to the limit
+ * at once if prefaulting, and free buffers beyond a lowered limit are
+ * given back to the system.
+ */
+void
+proxy_pool_config_set (const ProxyPoolConfig * config);
+
+/**
+ * proxy_pool_uninit:
+ *
+ * Give all the free buffers back to the system.
+ */
+void
+proxy_pool_uninit (void);
+
+/**
+ * proxy_pool_user_join:
+ * @user: the new user
+ *
+ * Start taking buffers from the pool.
+ */
+void
+proxy_pool_user_join (ProxyPoolUser * user);
+
+/**
+ * proxy_pool_user_leave:
+ * @user: the user, must hold no buffer any more
+ *
+ * Stop taking buffers from the pool.
+ */
+void
+proxy_pool_user_leave (ProxyPoolUser * user);
+
+/**
+ * proxy_pool_alloc:
+ * @user: the user taking the buffer
+ * @size: bytes needed
+ * @buffer_len: where to store the real length of the buffer, at least @size
+ *
+ * Take a buffer from the pool. Once the buffers held reach the limit, a
+ * user already holding buffers gets no more than its share of the limit.
+ *
+ * Returns: The buffer, NULL if the limit or the share of @user is reached.
+ */
+char *
+proxy_pool_alloc (ProxyPoolUser * user, uint32_t size, uint32_t * buffer_len);
+
+/**
+ * proxy_pool_free:
+ * @user: the user holding the buffer
+ * @buffer: the buffer taken by @proxy_pool_alloc
+ * @buffer_len: the real length of the buffer
+ *
+ * Give a buffer back to the pool.
+ */
+void
+proxy_pool_free (ProxyPoolUser * user, char * buffer, uint32_t buffer_len);
+
+/**
+ * proxy_pool_hand_over:
+ * @from: the user holding the buffer
+ * @to: the user holding it from now on
+ * @buffer_len: the real length of the buffer
+ *
+ * Charge a buffer taken by @from to @to, for a buffer still used by others
+ * once @from is done with it. @to need not have joined the pool.
+ */
+void
+proxy_pool_hand_over (ProxyPoolUser * from, ProxyPoolUser * to, uint32_t buffer_len);
+
+#endif
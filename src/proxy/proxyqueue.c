@@ -1,36 +1,57 @@
-#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 #include "proxylog.h"
-#include "proxylist.h"
 #include "proxyqueue.h"
 
-#define PROXY_QUEUE_GET_LOCK(queue) (&(((ProxyQueue *)queue)->lock))
-#define PROXY_QUEUE_LOCK(queue)   pthread_mutex_lock(PROXY_QUEUE_GET_LOCK(queue))
-#define PROXY_QUEUE_UNLOCK(queue) pthread_mutex_unlock(PROXY_QUEUE_GET_LOCK(queue))
+#define PROXY_QUEUE_LOAD(ptr)         __atomic_load_n ((ptr), __ATOMIC_ACQUIRE)
+#define PROXY_QUEUE_STORE(ptr, val)   __atomic_store_n ((ptr), (val), __ATOMIC_RELEASE)
+#define PROXY_QUEUE_PEEK(ptr)         __atomic_load_n ((ptr), __ATOMIC_RELAXED)
 
 /**
  * proxy_queue_new:
  *
- * Creates a new @ProxyQueue.
+ * Creates a new @ProxyQueue holding %PROXY_QUEUE_DEFAULT_SIZE elements.
  *
  * Returns: a newly allocated @ProxyQueue
  **/
 ProxyQueue *
 proxy_queue_new (void)
+{
+  return proxy_queue_new_full (PROXY_QUEUE_DEFAULT_SIZE);
+}
+
+/**
+ * proxy_queue_new_full:
+ * @size: the number of elements the queue holds, rounded up to a power of two
+ *
+ * Creates a new @ProxyQueue.
+ *
+ * Returns: a newly allocated @ProxyQueue
+ **/
+ProxyQueue *
+proxy_queue_new_full (uint32_t size)
 {
   ProxyQueue * queue;
+  uint32_t count = 1;
+
+  p_return_val_if_fail (size > 0 && size <= 0x80000000U, NULL);
 
-  queue = malloc (sizeof(ProxyQueue));
-  if (queue) {
-     pthread_mutex_init(&queue->lock, NULL);
-     PROXY_QUEUE_LOCK (queue);
-     queue->head = queue->tail = NULL;
-     queue->length = 0;
-     PROXY_QUEUE_UNLOCK (queue);
+  while (count < size)
+    count <<= 1;
+
+  queue = calloc (1, sizeof(ProxyQueue));
+  if (queue == NULL)
+    return NULL;
+
+  queue->slots = calloc (count, sizeof(void *));
+  if (queue->slots == NULL) {
+    free (queue);
+    return NULL;
   }
-  
+  queue->mask = count - 1;
+  queue->head = queue->tail = 0;
+
   return queue;
 }
 
@@ -47,52 +68,35 @@ proxy_queue_free (ProxyQueue *queue)
 {
   p_return_if_fail (queue != NULL);
 
-  PROXY_QUEUE_LOCK (queue);
-  proxy_list_free (queue->head);
-  PROXY_QUEUE_UNLOCK (queue);
-  
-  pthread_mutex_destroy (&queue->lock);
+  free (queue->slots);
   free (queue);
 }
 
-/**
- * proxy_queue_init:
- * @queue: an uninitialized #ProxyQueue
- *
- * A statically-allocated #ProxyQueue must be initialized with this function
- * before it can be used. 
- */
-void
-proxy_queue_init (ProxyQueue *queue)
-{
-  p_return_if_fail (queue != NULL);
-
-  PROXY_QUEUE_LOCK (queue);
-  queue->head = queue->tail = NULL;
-  queue->length = 0;
-  PROXY_QUEUE_UNLOCK (queue);
-}
-
 /**
  * proxy_queue_push_tail:
  * @queue: a #ProxyQueue
  * @data: the data for the new element
  *
  * Adds a new element at the tail of the queue.
+ *
+ * Returns: %TRUE on success, %FALSE if the queue is full
  */
-void
+BOOL
 proxy_queue_push_tail (ProxyQueue * queue, void * data)
 {
-  p_return_if_fail (queue != NULL);
+  uint32_t tail;
+
+  p_return_val_if_fail (queue != NULL, FALSE);
+
+  /* Only this thread moves the tail, the head only gets further */
+  tail = PROXY_QUEUE_PEEK (&queue->tail);
+  if (tail - PROXY_QUEUE_LOAD (&queue->head) > queue->mask)
+    return FALSE;
 
-  PROXY_QUEUE_LOCK (queue);
-  queue->tail = proxy_list_append (queue->tail, data);
-  if (queue->tail->next)
-    queue->tail = queue->tail->next;
-  else
-    queue->head = queue->tail;
-  queue->length++;
-  PROXY_QUEUE_UNLOCK (queue);
+  queue->slots[tail & queue->mask] = data;
+  PROXY_QUEUE_STORE (&queue->tail, tail + 1);
+
+  return TRUE;
 }
 
 /**
@@ -107,27 +111,45 @@ proxy_queue_push_tail (ProxyQueue * queue, void * data)
 void *
 proxy_queue_pop_head (ProxyQueue *queue)
 {
+  uint32_t head;
+  void * data;
+
   p_return_val_if_fail (queue != NULL, NULL);
 
-  PROXY_QUEUE_LOCK (queue);
-  if (queue->head) {
-    ProxyList *node = queue->head;
-    void * data = node->data;
-
-    queue->head = node->next;
-    if (queue->head)
-      queue->head->prev = NULL;
-    else
-      queue->tail = NULL;
-    proxy_list_free_1 (node);
-    queue->length--;
-    PROXY_QUEUE_UNLOCK (queue);
-    
-    return data;
-  }
-  PROXY_QUEUE_UNLOCK (queue);
+  /* Only this thread moves the head, the tail only gets further */
+  head = PROXY_QUEUE_PEEK (&queue->head);
+  if (head == PROXY_QUEUE_LOAD (&queue->tail))
+    return NULL;
+
+  data = queue->slots[head & queue->mask];
+  PROXY_QUEUE_STORE (&queue->head, head + 1);
+
+  return data;
+}
 
-  return NULL;
+/**
+ * proxy_queue_peek_nth:
+ * @queue: a #ProxyQueue
+ * @n: the position of the element
+ *
+ * Returns the @n'th element of @queue without removing it, only the
+ * consumer may call it.
+ *
+ * Returns: the data for the @n'th element of @queue,
+ *     or %NULL if @n is off the end of @queue
+ */
+void *
+proxy_queue_peek_nth (ProxyQueue *queue, uint32_t n)
+{
+  uint32_t head;
+
+  p_return_val_if_fail (queue != NULL, NULL);
+
+  head = PROXY_QUEUE_PEEK (&queue->head);
+  if (n >= PROXY_QUEUE_LOAD (&queue->tail) - head)
+    return NULL;
+
+  return queue->slots[(head + n) & queue->mask];
 }
 
 /**
@@ -141,6 +163,5 @@ proxy_queue_is_empty (ProxyQueue *queue)
 {
   p_return_val_if_fail (queue != NULL, TRUE);
 
-  return queue->head == NULL;
+  return PROXY_QUEUE_LOAD (&queue->head) == PROXY_QUEUE_LOAD (&queue->tail);
 }
-
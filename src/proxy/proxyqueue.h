@@ -2,8 +2,6 @@
 #define __PROXY_QUEUE_H__
 
 #include <stdint.h>
-#include <pthread.h>
-#include "proxylist.h"
 
 #ifndef BOOL
 typedef int BOOL;
@@ -17,32 +15,55 @@ typedef int BOOL;
 #define TRUE    1
 #endif
 
+#define PROXY_QUEUE_DEFAULT_SIZE 64 /* elements a queue from proxy_queue_new() holds */
+#define PROXY_QUEUE_CACHE_LINE 64   /* keeps the producer and consumer indexes apart */
+
 typedef struct _ProxyQueue ProxyQueue;
 
 /**
  * ProxyQueue:
- * @head: a pointer to the first element of the queue
- * @tail: a pointer to the last element of the queue
- * @length: the number of elements in the queue
+ * @slots: the ring of elements
+ * @mask: number of slots minus one
+ * @head: position of the first element, only moved by the consumer
+ * @tail: position after the last element, only moved by the producer
+ *
+ * A bounded ring queue for one thread pushing and one thread popping at a
+ * time, it takes no lock and nothing is allocated once it is created.
  */
 struct _ProxyQueue
 {
-  ProxyList *head;
-  ProxyList *tail;
-  uint32_t  length;
-  pthread_mutex_t lock;
+  void      **slots;
+  uint32_t  mask;
+  char      pad_head[PROXY_QUEUE_CACHE_LINE];
+
+  uint32_t  head;
+  char      pad_tail[PROXY_QUEUE_CACHE_LINE - sizeof(uint32_t)];
+
+  uint32_t  tail;
+  char      pad_end[PROXY_QUEUE_CACHE_LINE - sizeof(uint32_t)];
 };
 
 /**
  * proxy_queue_new:
  *
- * Creates a new @ProxyQueue.
+ * Creates a new @ProxyQueue holding %PROXY_QUEUE_DEFAULT_SIZE elements.
  *
  * Returns: a newly allocated @ProxyQueue
  **/
 ProxyQueue *
 proxy_queue_new (void);
 
+/**
+ * proxy_queue_new_full:
+ * @size: the number of elements the queue holds, rounded up to a power of two
+ *
+ * Creates a new @ProxyQueue.
+ *
+ * Returns: a newly allocated @ProxyQueue
+ **/
+ProxyQueue *
+proxy_queue_new_full (uint32_t size);
+
 /**
  * proxy_queue_free:
  * @queue: a #ProxyQueue
@@ -60,8 +81,10 @@ proxy_queue_free (ProxyQueue *queue);
  * @data: the data for the new element
  *
  * Adds a new element at the tail of the queue.
+ *
+ * Returns: %TRUE on success, %FALSE if the queue is full
  */
-void
+BOOL
 proxy_queue_push_tail (ProxyQueue * queue, void * data);
 
 /**
@@ -76,6 +99,20 @@ proxy_queue_push_tail (ProxyQueue * queue, void * data);
 void *
 proxy_queue_pop_head (ProxyQueue *queue);
 
+/**
+ * proxy_queue_peek_nth:
+ * @queue: a #ProxyQueue
+ * @n: the position of the element
+ *
+ * Returns the @n'th element of @queue without removing it, only the
+ * consumer may call it.
+ *
+ * Returns: the data for the @n'th element of @queue,
+ *     or %NULL if @n is off the end of @queue
+ */
+void *
+proxy_queue_peek_nth (ProxyQueue *queue, uint32_t n);
+
 /**
  * proxy_queue_is_empty:
  * @queue: a #ProxyQueue.
@@ -0,0 +1,408 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* splice() */
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "proxyqueue.h"
+#include "proxycurlwrapper.h"
+#include "proxysocket.h"
+#include "proxylog.h"
+
+/**
+ * socket_recv:
+ * @sock: socket handle
+ * @buf: where to store the data
+ * @len: maximum number of bytes to receive
+ *
+ * Receive what the server has sent without waiting, the end of the
+ * connection is noted in @sock.
+ *
+ * Returns: The number of bytes received, 0 if nothing is ready, -1 on error.
+ */
+static int32_t
+socket_recv (ProxySocket * sock, char * buf, uint32_t len)
+{
+  ssize_t n;
+
+  if (sock->done)
+    return sock->failed ? -1 : 0;
+
+  do {
+    n = recv (sock->fd, buf, len, 0);
+  } while (n < 0 && errno == EINTR);
+
+  if (n > 0)
+    return (int32_t)n;
+
+  if (n == 0) {
+    sock->done = TRUE;
+    return 0;
+  }
+
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return 0;
+
+  pri_error ("Receiving from the server failed: %s\n", strerror (errno));
+  sock->done = TRUE;
+  sock->failed = TRUE;
+  return -1;
+}
+
+/**
+ * socket_fill:
+ * @sock: socket handle
+ *
+ * Receive into the buffer of @sock once everything in it has been read.
+ *
+ * Returns: The number of bytes in the buffer not read yet, -1 on error.
+ */
+static int32_t
+socket_fill (ProxySocket * sock)
+{
+  int32_t n;
+
+  if (sock->offset < sock->data_len)
+    return (int32_t)(sock->data_len - sock->offset);
+
+  sock->data_len = 0;
+  sock->offset = 0;
+  if ((n = socket_recv (sock, sock->buffer, SOCKET_BUFFER_SIZE)) < 0)
+    return -1;
+  sock->data_len = (uint32_t)n;
+
+  return n;
+}
+
+/**
+ * socket_copy:
+ * @sock: socket handle
+ * @out_fd: where to write the data
+ *
+ * Write the buffered data to @out_fd, receiving some first if none is left.
+ *
+ * Returns: The number of bytes written, 0 if nothing is ready, -1 on error.
+ */
+static int32_t
+socket_copy (ProxySocket * sock, int out_fd)
+{
+  ssize_t n;
+
+  if (socket_fill (sock) <= 0)
+    return sock->failed ? -1 : 0;
+
+  do {
+    n = write (out_fd, sock->buffer + sock->offset, sock->data_len - sock->offset);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    pri_error ("Writing out the server data failed: %s\n", strerror (errno));
+    return -1;
+  }
+  sock->offset += (uint32_t)n;
+
+  return (int32_t)n;
+}
+
+/**
+ * proxy_socket_create:
+ * @fd: The server socket the request has been sent to
+ *
+ * Start relaying the response from @fd. The socket stays open when the
+ * handle is destroyed.
+ *
+ * Returns: socket handle, NULL on error.
+ */
+SOCKET_HANDLE
+proxy_socket_create (int fd)
+{
+  ProxySocket * sock;
+
+  p_return_val_if_fail (fd >= 0, NULL);
+
+  if ((sock = malloc (sizeof(ProxySocket))) == NULL) {
+    pri_error ("Socket malloc failed\n");
+    return NULL;
+  }
+  memset (sock, 0, sizeof(ProxySocket));
+  sock->fd = fd;
+  sock->pipe_fds[0] = -1;
+  sock->pipe_fds[1] = -1;
+
+  if ((sock->buffer = malloc (SOCKET_BUFFER_SIZE)) == NULL) {
+    pri_error ("Socket buffer malloc failed\n");
+    free (sock);
+    return NULL;
+  }
+
+  /* The loop of the caller waits in select(), never in recv() */
+  if ((sock->fd_flags = fcntl (fd, F_GETFL)) < 0
+      || fcntl (fd, F_SETFL, sock->fd_flags | O_NONBLOCK) < 0) {
+    pri_error ("Making the server socket non-blocking failed: %s\n", strerror (errno));
+    free (sock->buffer);
+    free (sock);
+    return NULL;
+  }
+
+  return (SOCKET_HANDLE)sock;
+}
+
+/**
+ * proxy_socket_destroy:
+ * @handle: socket handle create by @proxy_socket_create
+ *
+ * Destroy the socket @handle, the server socket gets its flags back.
+ */
+void
+proxy_socket_destroy (SOCKET_HANDLE handle)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+
+  p_return_if_fail (sock != NULL);
+
+  if (sock->pipe_fds[0] >= 0) {
+    close (sock->pipe_fds[0]);
+    close (sock->pipe_fds[1]);
+  }
+  fcntl (sock->fd, F_SETFL, sock->fd_flags);
+
+  free (sock->buffer);
+  free (sock);
+}
+
+/**
+ * proxy_socket_perform:
+ * @handle: socket handle create by @proxy_socket_create
+ *
+ * Tell the state of the server connection, the data is received when read.
+ *
+ * Returns: CURL_FAIL on error, 1 if the connection is open, zero (0) once
+ * the server has closed it.
+ */
+int32_t
+proxy_socket_perform (SOCKET_HANDLE handle)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+
+  p_return_val_if_fail (sock != NULL, CURL_FAIL);
+
+  if (sock->failed)
+    return CURL_FAIL;
+
+  return sock->done ? 0 : 1;
+}
+
+/**
+ * proxy_socket_fdset:
+ * @handle: socket handle create by @proxy_socket_create
+ *
+ * Extracts the server socket, if the server may still send something.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_socket_fdset (SOCKET_HANDLE handle, fd_set * read_fd_set,
+    fd_set * write_fd_set, fd_set * exc_fd_set, int * max_fd)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+
+  p_return_val_if_fail (sock != NULL, CURL_FAIL);
+  p_return_val_if_fail (read_fd_set != NULL, CURL_FAIL);
+  p_return_val_if_fail (max_fd != NULL, CURL_FAIL);
+
+  if (sock->done)
+    return CURL_SUCC;
+
+  FD_SET (sock->fd, read_fd_set);
+  if (sock->fd > *max_fd)
+    *max_fd = sock->fd;
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_socket_timeout:
+ * @handle: socket handle create by @proxy_socket_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_socket_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_socket_timeout (SOCKET_HANDLE handle, int32_t * timeout_ms)
+{
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (timeout_ms != NULL, CURL_FAIL);
+
+  *timeout_ms = SOCKET_MAX_WAIT;
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_socket_read:
+ * @handle: socket handle create by @proxy_socket_create
+ * @buf: pointer to buffer where data will be written, Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Read the response received so far.
+ *
+ * Returns: The number of bytes read, 0 if nothing is ready, -1 on error.
+ */
+int32_t
+proxy_socket_read (SOCKET_HANDLE handle, char * buf, uint32_t len)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+  uint32_t size;
+
+  p_return_val_if_fail (sock != NULL, -1);
+  p_return_val_if_fail (buf != NULL, -1);
+
+  /* Nothing left from the copying path, receive into @buf at once */
+  if (sock->offset == sock->data_len)
+    return socket_recv (sock, buf, len);
+
+  size = sock->data_len - sock->offset;
+  if (size > len)
+    size = len;
+  memcpy (buf, sock->buffer + sock->offset, size);
+  sock->offset += size;
+
+  return (int32_t)size;
+}
+
+/**
+ * proxy_socket_peek:
+ * @handle: socket handle create by @proxy_socket_create
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it again. The regions stay
+ * valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_socket_peek (SOCKET_HANDLE handle, struct iovec * iov, int32_t iov_count)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+  int32_t size;
+
+  p_return_val_if_fail (sock != NULL, -1);
+  p_return_val_if_fail (iov != NULL, -1);
+
+  if (iov_count <= 0)
+    return 0;
+
+  if ((size = socket_fill (sock)) <= 0)
+    return size;
+
+  iov[0].iov_base = sock->buffer + sock->offset;
+  iov[0].iov_len = (size_t)size;
+
+  return 1;
+}
+
+/**
+ * proxy_socket_consume:
+ * @handle: socket handle create by @proxy_socket_create
+ * @len: bytes used from the regions got by @proxy_socket_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_socket_consume (SOCKET_HANDLE handle, uint32_t len)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+
+  p_return_val_if_fail (sock != NULL, -1);
+
+  if (len > sock->data_len - sock->offset)
+    len = sock->data_len - sock->offset;
+  sock->offset += len;
+
+  return (int32_t)len;
+}
+
+/**
+ * proxy_socket_splice:
+ * @handle: socket handle create by @proxy_socket_create
+ * @out_fd: where to write the data, a blocking socket or pipe
+ *
+ * Move the data ready from the server socket to @out_fd inside the kernel,
+ * at most a pipe full at a time. The data is copied if splice() is not
+ * supported.
+ *
+ * Returns: The number of bytes written to @out_fd, 0 if nothing is ready,
+ * -1 on error.
+ */
+int32_t
+proxy_socket_splice (SOCKET_HANDLE handle, int out_fd)
+{
+  ProxySocket * sock = (ProxySocket *)handle;
+  int32_t moved = 0;
+  ssize_t n;
+
+  p_return_val_if_fail (sock != NULL, -1);
+  p_return_val_if_fail (out_fd >= 0, -1);
+
+  /* What the copying path has received goes out first */
+  if (sock->offset < sock->data_len || sock->no_splice)
+    return socket_copy (sock, out_fd);
+
+  if (sock->pipe_fds[0] < 0 && pipe (sock->pipe_fds) < 0) {
+    pri_warning ("Creating the splice pipe failed, copying instead: %s\n", strerror (errno));
+    sock->pipe_fds[0] = -1;
+    sock->pipe_fds[1] = -1;
+    sock->no_splice = TRUE;
+    return socket_copy (sock, out_fd);
+  }
+
+  if (sock->piped == 0 && !sock->done) {
+    do {
+      n = splice (sock->fd, NULL, sock->pipe_fds[1], NULL, SOCKET_BUFFER_SIZE,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+      sock->piped = (uint32_t)n;
+    } else if (n == 0) {
+      sock->done = TRUE;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    } else if (errno == EINVAL || errno == ENOSYS) {
+      pri_warning ("splice() is not supported, copying instead\n");
+      sock->no_splice = TRUE;
+      return socket_copy (sock, out_fd);
+    } else {
+      pri_error ("Splicing from the server failed: %s\n", strerror (errno));
+      sock->done = TRUE;
+      sock->failed = TRUE;
+      return -1;
+    }
+  }
+
+  while (sock->piped > 0) {
+    n = splice (sock->pipe_fds[0], NULL, out_fd, NULL, sock->piped, SPLICE_F_MOVE);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      pri_error ("Splicing to the client failed: %s\n", strerror (errno));
+      return -1;
+    }
+    sock->piped -= (uint32_t)n;
+    moved += (int32_t)n;
+  }
+
+  return moved;
+}
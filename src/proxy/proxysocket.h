@@ -0,0 +1,160 @@
+#ifndef __PROXY_SOCKET_H__
+#define __PROXY_SOCKET_H__
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+#define SOCKET_BUFFER_SIZE (64*1024) /* data received at a time by the copying path */
+#define SOCKET_MAX_WAIT 1000 /* max milliseconds to wait for the server before performing again */
+
+typedef void* SOCKET_HANDLE;
+
+typedef struct _ProxySocket ProxySocket;
+
+/**
+ * ProxySocket:
+ *
+ * A response relayed as it is from a server socket connected by the caller,
+ * for the contents not worth accelerating. The body is moved by splice()
+ * through a pipe, so it never has to be copied to the user space.
+ */
+struct _ProxySocket {
+  /* the server socket, owned by the caller */
+  int fd;
+
+  /* file status flags of @fd before it was made non-blocking */
+  int fd_flags;
+
+  /* data received by the copying path and not read yet */
+  char * buffer;
+  uint32_t data_len;
+  uint32_t offset;
+
+  /* the pipe the spliced data goes through, -1 until the first splice */
+  int pipe_fds[2];
+
+  /* bytes in the pipe not written out yet */
+  uint32_t piped;
+
+  /* splice() does not work here, the data is copied instead */
+  BOOL no_splice;
+
+  /* the server closed the connection, @failed tells how */
+  BOOL done;
+  BOOL failed;
+};
+
+/**
+ * proxy_socket_create:
+ * @fd: The server socket the request has been sent to
+ *
+ * Start relaying the response from @fd. The socket stays open when the
+ * handle is destroyed.
+ *
+ * Returns: socket handle, NULL on error.
+ */
+SOCKET_HANDLE
+proxy_socket_create (int fd);
+
+/**
+ * proxy_socket_destroy:
+ * @handle: socket handle create by @proxy_socket_create
+ *
+ * Destroy the socket @handle, the server socket gets its flags back.
+ */
+void
+proxy_socket_destroy (SOCKET_HANDLE handle);
+
+/**
+ * proxy_socket_perform:
+ * @handle: socket handle create by @proxy_socket_create
+ *
+ * Tell the state of the server connection, the data is received when read.
+ *
+ * Returns: CURL_FAIL on error, 1 if the connection is open, zero (0) once
+ * the server has closed it.
+ */
+int32_t
+proxy_socket_perform (SOCKET_HANDLE handle);
+
+/**
+ * proxy_socket_fdset:
+ * @handle: socket handle create by @proxy_socket_create
+ *
+ * Extracts the server socket, if the server may still send something.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_socket_fdset (SOCKET_HANDLE handle, fd_set * read_fd_set,
+    fd_set * write_fd_set, fd_set * exc_fd_set, int * max_fd);
+
+/**
+ * proxy_socket_timeout:
+ * @handle: socket handle create by @proxy_socket_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_socket_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_socket_timeout (SOCKET_HANDLE handle, int32_t * timeout_ms);
+
+/**
+ * proxy_socket_read:
+ * @handle: socket handle create by @proxy_socket_create
+ * @buf: pointer to buffer where data will be written, Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Read the response received so far.
+ *
+ * Returns: The number of bytes read, 0 if nothing is ready, -1 on error.
+ */
+int32_t
+proxy_socket_read (SOCKET_HANDLE handle, char * buf, uint32_t len);
+
+/**
+ * proxy_socket_peek:
+ * @handle: socket handle create by @proxy_socket_create
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it again. The regions stay
+ * valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_socket_peek (SOCKET_HANDLE handle, struct iovec * iov, int32_t iov_count);
+
+/**
+ * proxy_socket_consume:
+ * @handle: socket handle create by @proxy_socket_create
+ * @len: bytes used from the regions got by @proxy_socket_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_socket_consume (SOCKET_HANDLE handle, uint32_t len);
+
+/**
+ * proxy_socket_splice:
+ * @handle: socket handle create by @proxy_socket_create
+ * @out_fd: where to write the data, a blocking socket or pipe
+ *
+ * Move the data ready from the server socket to @out_fd inside the kernel,
+ * at most a pipe full at a time. The data is copied if splice() is not
+ * supported.
+ *
+ * Returns: The number of bytes written to @out_fd, 0 if nothing is ready,
+ * -1 on error.
+ */
+int32_t
+proxy_socket_splice (SOCKET_HANDLE handle, int out_fd);
+
+#endif
@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include "proxyqueue.h"
+#include "proxycurlwrapper.h"
+#include "proxycurlengine.h"
+#include "proxypool.h"
+#include "proxystream.h"
+#include "proxylog.h"
+
+/**
+ * stream_buffer_new:
+ * @stream: stream handle
+ * @size: bytes the buffer must hold
+ *
+ * Take a buffer from the pool and queue it for the reader.
+ *
+ * Returns: The buffer, NULL if none can be had now.
+ */
+static ProxyStreamBuffer *
+stream_buffer_new (ProxyStream * stream, uint32_t size)
+{
+  ProxyStreamBuffer * buffer;
+
+  if ((buffer = malloc (sizeof(ProxyStreamBuffer))) == NULL) {
+    pri_error ("Stream buffer malloc failed\n");
+    return NULL;
+  }
+
+  buffer->buffer = proxy_pool_alloc (&stream->pool_user, size, &buffer->buffer_len);
+  if (buffer->buffer == NULL) {
+    free (buffer);
+    return NULL;
+  }
+  buffer->data_len = 0;
+  buffer->offset = 0;
+
+  return buffer;
+}
+
+static void
+stream_buffer_free (ProxyStream * stream, ProxyStreamBuffer * buffer)
+{
+  p_return_if_fail (buffer != NULL);
+
+  if (buffer->buffer)
+    proxy_pool_free (&stream->pool_user, buffer->buffer, buffer->buffer_len);
+  free (buffer);
+}
+
+/**
+ * stream_buffer_append:
+ * @buffer: the buffer written
+ * @content: data to append
+ * @length: length of @content
+ *
+ * Returns: TRUE if the whole @content fits in @buffer, FALSE if it is
+ * left unchanged.
+ */
+static BOOL
+stream_buffer_append (ProxyStreamBuffer * buffer, const char * content, uint32_t length)
+{
+  if (length > buffer->buffer_len - buffer->data_len)
+    return FALSE;
+
+  memcpy (buffer->buffer + buffer->data_len, content, length);
+  buffer->data_len += length;
+
+  return TRUE;
+}
+
+/**
+ * stream_resume:
+ * @stream: stream handle, its engine session locked
+ *
+ * Resume the paused transfer once the reader has caught up. A transfer
+ * paused for want of memory is tried again the same way, it pauses
+ * itself again if there is still none.
+ */
+static void
+stream_resume (ProxyStream * stream)
+{
+  if (!stream->paused || stream->buffered >= STREAM_BUFFER_LIMIT/2)
+    return;
+
+  stream->paused = FALSE;
+  proxy_curl_single_pause (stream->single_handle, FALSE);
+}
+
+/* Client headers not sent on, curl makes its own for the connection and the body */
+static const char * stream_skipped_headers[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade",
+  "Transfer-Encoding", "Content-Length", "Expect", NULL
+};
+
+/**
+ * stream_header_value:
+ * @line: a header line
+ * @name: header name
+ *
+ * Returns: the value of the header if @line is the header @name, NULL otherwise.
+ */
+static char *
+stream_header_value (char * line, const char * name)
+{
+  size_t name_len = strlen(name);
+  char * p;
+
+  if (strncasecmp (line, name, name_len) != 0 || line[name_len] != ':')
+    return NULL;
+
+  p = line + name_len + 1;
+  while (*p && isspace(*p)) p++;
+
+  return p;
+}
+
+/**
+ * stream_header_write:
+ *
+ * Header callback of the request, the header of the response the redirects
+ * end at is handed to the reader as it is.
+ */
+static uint32_t
+stream_header_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyStream * stream = user_data;
+  ProxyStreamBuffer * buffer = stream->head_buf;
+  uint32_t length = size*nmemb;
+  uint32_t line_length;
+  char line[1024];
+
+  p_return_val_if_fail (content != NULL, 0);
+
+  if (buffer == NULL)
+    return length;
+
+  line_length = (length < sizeof(line)) ? length : sizeof(line) - 1;
+  memcpy (line, content, line_length);
+  line[line_length] = '\0';
+
+  if (strncmp (line, "HTTP/", 5) == 0) {
+    /* A new response begins, forget the one redirected from */
+    buffer->data_len = 0;
+    stream->status = 0;
+    stream->redirect = FALSE;
+    sscanf (line, "%*s %u", &stream->status);
+  } else if (stream_header_value (line, "Location") != NULL) {
+    stream->redirect = TRUE;
+  } else if (stream_header_value (line, "Transfer-Encoding") != NULL) {
+    /* Curl hands out the body decoded */
+    return length;
+  }
+
+  if (length != 2 || strncmp (content, "\r\n", 2) != 0) {
+    if (!stream_buffer_append (buffer, content, length)) {
+      pri_error ("Response header larger than %d bytes\n", STREAM_HEAD_BUFFER_SIZE);
+      stream->failed = TRUE;
+      return 0;
+    }
+    return length;
+  }
+
+  /* The end of a redirect response, the followed one comes next. The
+   * redirects of an upload are not followed, they go to the client. */
+  if (stream->redirect && stream->status/100 == 3 && stream->upload_buf == NULL)
+    return length;
+
+  if (!stream_buffer_append (buffer, content, length)) {
+    pri_error ("Response header larger than %d bytes\n", STREAM_HEAD_BUFFER_SIZE);
+    stream->failed = TRUE;
+    return 0;
+  }
+  if (!proxy_queue_push_tail (stream->data_queue, buffer)) {
+    pri_error ("Data queue full, cannot hand out the header\n");
+    stream->failed = TRUE;
+    return 0;
+  }
+  stream->buffered += buffer->data_len;
+  stream->head_buf = NULL;
+
+  return length;
+}
+
+/**
+ * stream_body_write:
+ *
+ * Write callback of the request. The transfer is paused while the reader is
+ * too far behind or no memory can be had, and resumed by @stream_resume.
+ */
+static uint32_t
+stream_body_write (void * content, uint32_t size, uint32_t nmemb, void * user_data)
+{
+  ProxyStream * stream = user_data;
+  ProxyStreamBuffer * buffer = stream->tail;
+  uint32_t length = size*nmemb;
+  uint32_t free_length;
+
+  p_return_val_if_fail (content != NULL, 0);
+
+  if (stream->head_buf != NULL) {
+    pri_error ("Body received before the header\n");
+    stream->failed = TRUE;
+    return 0;
+  }
+
+  /* All or nothing, curl hands the same data again once resumed */
+  if (stream->buffered >= STREAM_BUFFER_LIMIT) {
+    stream->paused = TRUE;
+    return CURL_WRITE_PAUSE;
+  }
+
+  free_length = (buffer != NULL) ? buffer->buffer_len - buffer->data_len : 0;
+  if (free_length < length) {
+    buffer = stream_buffer_new (stream, (length - free_length > STREAM_BUFFER_SIZE) ? \
+        length - free_length : STREAM_BUFFER_SIZE);
+    if (buffer == NULL) {
+      pri_debug ("No memory for the stream now, pausing\n");
+      stream->paused = TRUE;
+      return CURL_WRITE_PAUSE;
+    }
+    if (!proxy_queue_push_tail (stream->data_queue, buffer)) {
+      stream_buffer_free (stream, buffer);
+      stream->paused = TRUE;
+      return CURL_WRITE_PAUSE;
+    }
+    if (free_length > 0)
+      stream_buffer_append (stream->tail, content, free_length);
+    stream->tail = buffer;
+  } else {
+    free_length = 0;
+  }
+
+  stream_buffer_append (buffer, (char *)content + free_length, length - free_length);
+  stream->buffered += length;
+
+  return length;
+}
+
+/**
+ * stream_body_read:
+ *
+ * Read callback of the request body. The upload is paused while nothing
+ * is buffered, and resumed by @proxy_stream_write.
+ */
+static uint32_t
+stream_body_read (void * buffer, uint32_t size, uint32_t nitems, void * user_data)
+{
+  ProxyStream * stream = user_data;
+  uint32_t length = size*nitems;
+
+  p_return_val_if_fail (buffer != NULL, 0);
+
+  if (length > stream->upload_len - stream->upload_offset)
+    length = stream->upload_len - stream->upload_offset;
+
+  if (length == 0) {
+    if (stream->upload_done)
+      return 0;
+    stream->upload_paused = TRUE;
+    return CURL_READ_PAUSE;
+  }
+
+  memcpy (buffer, stream->upload_buf + stream->upload_offset, length);
+  stream->upload_offset += length;
+  if (stream->upload_offset == stream->upload_len) {
+    stream->upload_offset = 0;
+    stream->upload_len = 0;
+  }
+
+  return length;
+}
+
+/**
+ * stream_header_skipped:
+ * @header: a header line of the client
+ *
+ * Returns: TRUE if @header is not sent on.
+ */
+static BOOL
+stream_header_skipped (const char * header)
+{
+  const char ** name;
+
+  for (name = stream_skipped_headers; *name != NULL; name++) {
+    if (stream_header_value ((char *)header, *name) != NULL)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+ * stream_peek:
+ * @stream: stream handle, its engine session locked
+ *
+ * Returns: The same as @proxy_stream_peek.
+ */
+static int32_t
+stream_peek (ProxyStream * stream, struct iovec * iov, int32_t iov_count)
+{
+  ProxyStreamBuffer * buffer;
+  uint32_t index = 0;
+  int32_t count = 0;
+
+  while (count < iov_count
+      && (buffer = proxy_queue_peek_nth (stream->data_queue, index++)) != NULL) {
+    if (buffer->offset < buffer->data_len) {
+      iov[count].iov_base = buffer->buffer + buffer->offset;
+      iov[count].iov_len = buffer->data_len - buffer->offset;
+      count++;
+    }
+  }
+
+  /* No data available now, and none will come if the transfer failed */
+  if (count == 0 && stream->failed)
+    return CURL_FAIL;
+
+  return count;
+}
+
+/**
+ * stream_consume:
+ * @stream: stream handle, its engine session locked
+ *
+ * Returns: The number of bytes consumed.
+ */
+static uint32_t
+stream_consume (ProxyStream * stream, uint32_t len)
+{
+  ProxyStreamBuffer * buffer;
+  uint32_t consumed = 0;
+  uint32_t length;
+
+  while ((buffer = proxy_queue_peek_nth (stream->data_queue, 0)) != NULL) {
+    length = buffer->data_len - buffer->offset;
+    if (length > len - consumed)
+      length = len - consumed;
+    buffer->offset += length;
+    consumed += length;
+    stream->buffered -= length;
+
+    /* The buffer being written stays until it is full */
+    if (buffer->offset < buffer->data_len
+        || (buffer == stream->tail && buffer->data_len < buffer->buffer_len && !stream->done))
+      break;
+    proxy_queue_pop_head (stream->data_queue);
+    if (buffer == stream->tail)
+      stream->tail = NULL;
+    stream_buffer_free (stream, buffer);
+  }
+
+  stream_resume (stream);
+
+  return consumed;
+}
+
+/**
+ * proxy_stream_create:
+ * @url: The target address
+ * @method: request method, NULL for GET
+ * @headers: request headers of the client to send on, NULL terminated,
+ * NULL for none
+ * @body_length: length of the request body written by @proxy_stream_write,
+ * -1 if not known
+ *
+ * Start getting @url by a single request. Any method but GET and HEAD
+ * sends a request body, streamed while the caller writes it.
+ *
+ * Returns: stream handle, NULL on error.
+ */
+STREAM_HANDLE
+proxy_stream_create (char * url, const char * method, const char * const * headers,
+    int64_t body_length)
+{
+  ProxyStream * stream;
+  BOOL upload;
+  int32_t ret;
+
+  p_return_val_if_fail (url != NULL, NULL);
+
+  if ((stream = calloc (1, sizeof(ProxyStream))) == NULL) {
+    pri_error ("malloc stream failed\n");
+    return NULL;
+  }
+  proxy_pool_user_join (&stream->pool_user);
+
+  stream->url = strdup (url);
+  stream->data_queue = proxy_queue_new_full (STREAM_BUFFER_LIMIT/STREAM_BUFFER_SIZE + 4);
+  stream->head_buf = stream_buffer_new (stream, STREAM_HEAD_BUFFER_SIZE);
+  if (stream->url == NULL || stream->data_queue == NULL || stream->head_buf == NULL) {
+    pri_error ("Allocating stream failed\n");
+    goto stream_create_failed;
+  }
+
+  if ((stream->session = proxy_curl_engine_attach ()) == NULL) {
+    pri_error ("Attaching to engine failed\n");
+    goto stream_create_failed;
+  }
+  stream->multi = proxy_curl_engine_multi (stream->session);
+
+  if ((stream->single_handle = proxy_curl_single_task_create ()) == NULL) {
+    pri_error ("Creating single task failed\n");
+    goto stream_create_failed;
+  }
+  proxy_curl_single_set_url (stream->single_handle, stream->url);
+  proxy_curl_single_opt_header (stream->single_handle, stream_header_write, stream);
+  proxy_curl_single_opt_body (stream->single_handle, stream_body_write, stream);
+
+  upload = (method != NULL && strcasecmp (method, "GET") != 0 && strcasecmp (method, "HEAD") != 0);
+  if (method != NULL && strcasecmp (method, "HEAD") == 0)
+    proxy_curl_single_opt_nobody (stream->single_handle);
+
+  if (upload) {
+    if ((stream->upload_buf = malloc (STREAM_UPLOAD_BUFFER_SIZE)) == NULL
+        || proxy_curl_single_opt_upload (stream->single_handle, method, body_length, \
+            stream_body_read, stream) != CURL_SUCC) {
+      pri_error ("Setting the upload up failed\n");
+      goto stream_create_failed;
+    }
+    stream->upload_left = body_length;
+    stream->upload_done = (body_length == 0);
+  }
+
+  for (; headers != NULL && *headers != NULL; headers++) {
+    if (!stream_header_skipped (*headers))
+      stream->headers = proxy_curl_header_list_append (stream->headers, *headers);
+  }
+  /* The body is sent at once, without waiting for "100 Continue" */
+  if (upload)
+    stream->headers = proxy_curl_header_list_append (stream->headers, "Expect:");
+  proxy_curl_single_set_headers (stream->single_handle, stream->headers);
+
+  proxy_curl_engine_lock (stream->session);
+  ret = proxy_curl_multi_add_single (stream->multi, stream->single_handle);
+  proxy_curl_engine_unlock (stream->session);
+  if (ret != CURL_SUCC) {
+    pri_error ("Adding single to multi failed\n");
+    stream->done = TRUE;
+    goto stream_create_failed;
+  }
+
+  return (STREAM_HANDLE)stream;
+stream_create_failed:
+  stream->done = TRUE;
+  proxy_stream_destroy ((STREAM_HANDLE)stream);
+  return NULL;
+}
+
+/**
+ * proxy_stream_destroy:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Stop the transfer and destroy the stream @handle.
+ */
+void
+proxy_stream_destroy (STREAM_HANDLE handle)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  ProxyStreamBuffer * buffer;
+
+  p_return_if_fail (stream != NULL);
+
+  /* No callback runs any more once detached, the buffers can go */
+  if (stream->session != NULL) {
+    proxy_curl_engine_lock (stream->session);
+    if (!stream->done)
+      proxy_curl_multi_remove_single (stream->multi, stream->single_handle);
+    proxy_curl_engine_unlock (stream->session);
+    proxy_curl_engine_detach (stream->session);
+  }
+  if (stream->single_handle != NULL)
+    proxy_curl_single_task_destroy (stream->single_handle);
+  if (stream->headers != NULL)
+    proxy_curl_header_list_free (stream->headers);
+
+  if (stream->head_buf != NULL)
+    stream_buffer_free (stream, stream->head_buf);
+  if (stream->data_queue != NULL) {
+    while ((buffer = proxy_queue_pop_head (stream->data_queue)) != NULL)
+      stream_buffer_free (stream, buffer);
+    proxy_queue_free (stream->data_queue);
+  }
+  proxy_pool_user_leave (&stream->pool_user);
+  free (stream->upload_buf);
+  free (stream->url);
+
+  free (stream);
+}
+
+/**
+ * proxy_stream_perform:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Take what the engine has got for the transfer.
+ *
+ * Returns: CURL_FAIL on error, 1 if the transfer is running, zero (0) if
+ * the whole response has been received.
+ */
+int32_t
+proxy_stream_perform (STREAM_HANDLE handle)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  SINGLE_HANDLE single_handle;
+  int32_t result;
+  int32_t ret;
+
+  p_return_val_if_fail (stream != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (stream->session);
+
+  /* Whatever the engine does from now on wakes the caller up again */
+  proxy_curl_engine_clear (stream->session);
+
+  /* A pause for want of memory is not undone by the reader alone */
+  stream_resume (stream);
+
+  if (!stream->done && proxy_curl_multi_info_read (stream->multi, \
+      &single_handle, &result) == CURL_SUCC) {
+    proxy_curl_multi_remove_single (stream->multi, stream->single_handle);
+    stream->done = TRUE;
+    if (result != CURL_SUCC || stream->head_buf != NULL) {
+      pri_error ("Getting %s failed\n", stream->url);
+      stream->failed = TRUE;
+    }
+  }
+
+  if (stream->failed)
+    ret = CURL_FAIL;
+  else
+    ret = stream->done ? 0 : 1;
+  proxy_curl_engine_unlock (stream->session);
+
+  return ret;
+}
+
+/**
+ * proxy_stream_fdset:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Extracts the file descriptor becoming readable once the engine has got
+ * something for the transfer of @handle.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_stream_fdset (STREAM_HANDLE handle, fd_set * read_fd_set,
+    fd_set * write_fd_set, fd_set * exc_fd_set, int * max_fd)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  int fd;
+
+  p_return_val_if_fail (stream != NULL, CURL_FAIL);
+  p_return_val_if_fail (read_fd_set != NULL, CURL_FAIL);
+  p_return_val_if_fail (max_fd != NULL, CURL_FAIL);
+
+  if ((fd = proxy_curl_engine_fd (stream->session)) < 0)
+    return CURL_FAIL;
+
+  FD_SET (fd, read_fd_set);
+  if (fd > *max_fd)
+    *max_fd = fd;
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_stream_timeout:
+ * @handle: stream handle create by @proxy_stream_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_stream_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_stream_timeout (STREAM_HANDLE handle, int32_t * timeout_ms)
+{
+  p_return_val_if_fail (handle != NULL, CURL_FAIL);
+  p_return_val_if_fail (timeout_ms != NULL, CURL_FAIL);
+
+  /* The engine runs the curl timers and wakes the reader up */
+  *timeout_ms = STREAM_MAX_WAIT;
+
+  return CURL_SUCC;
+}
+
+/**
+ * proxy_stream_read:
+ * @handle: stream handle create by @proxy_stream_create
+ * @buf: pointer to buffer where data will be written, Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Read the response received so far.
+ *
+ * Returns: The number of bytes read, 0 if nothing is ready, -1 on error.
+ */
+int32_t
+proxy_stream_read (STREAM_HANDLE handle, char * buf, uint32_t len)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  struct iovec iov;
+  uint32_t read_length;
+  int32_t ret;
+
+  p_return_val_if_fail (stream != NULL, CURL_FAIL);
+  p_return_val_if_fail (buf != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (stream->session);
+  if ((ret = stream_peek (stream, &iov, 1)) > 0) {
+    read_length = (iov.iov_len > len) ? len : (uint32_t)iov.iov_len;
+    memcpy (buf, iov.iov_base, read_length);
+    ret = (int32_t)stream_consume (stream, read_length);
+  }
+  proxy_curl_engine_unlock (stream->session);
+
+  return ret;
+}
+
+/**
+ * proxy_stream_peek:
+ * @handle: stream handle create by @proxy_stream_create
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order. The
+ * regions stay valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_stream_peek (STREAM_HANDLE handle, struct iovec * iov, int32_t iov_count)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  int32_t ret;
+
+  p_return_val_if_fail (stream != NULL, CURL_FAIL);
+  p_return_val_if_fail (iov != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (stream->session);
+  ret = stream_peek (stream, iov, iov_count);
+  proxy_curl_engine_unlock (stream->session);
+
+  return ret;
+}
+
+/**
+ * proxy_stream_consume:
+ * @handle: stream handle create by @proxy_stream_create
+ * @len: bytes used from the regions got by @proxy_stream_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_stream_consume (STREAM_HANDLE handle, uint32_t len)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  uint32_t consumed;
+
+  p_return_val_if_fail (stream != NULL, CURL_FAIL);
+
+  proxy_curl_engine_lock (stream->session);
+  consumed = stream_consume (stream, len);
+  proxy_curl_engine_unlock (stream->session);
+
+  return (int32_t)consumed;
+}
+
+/**
+ * proxy_stream_write_space:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Returns: The number of bytes of the request body @proxy_stream_write
+ * takes now.
+ */
+uint32_t
+proxy_stream_write_space (STREAM_HANDLE handle)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  uint32_t space;
+
+  p_return_val_if_fail (stream != NULL, 0);
+
+  if (stream->upload_buf == NULL)
+    return 0;
+
+  proxy_curl_engine_lock (stream->session);
+  space = STREAM_UPLOAD_BUFFER_SIZE - (stream->upload_len - stream->upload_offset);
+  proxy_curl_engine_unlock (stream->session);
+
+  return space;
+}
+
+/**
+ * proxy_stream_write:
+ * @handle: stream handle create by @proxy_stream_create
+ * @buf: the next part of the request body
+ * @len: length of @buf, no more than @proxy_stream_write_space tells, zero
+ * to end a body of unknown length
+ *
+ * Hand a part of the request body to the upload. It is dropped if the
+ * transfer is over already.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_stream_write (STREAM_HANDLE handle, const char * buf, uint32_t len)
+{
+  ProxyStream * stream = (ProxyStream *)handle;
+  int32_t ret = CURL_SUCC;
+
+  p_return_val_if_fail (stream != NULL, CURL_FAIL);
+  p_return_val_if_fail (buf != NULL || len == 0, CURL_FAIL);
+
+  if (stream->upload_buf == NULL) {
+    pri_error ("The request of %s has no body\n", stream->url);
+    return CURL_FAIL;
+  }
+
+  proxy_curl_engine_lock (stream->session);
+  if (stream->done) {
+    /* Nobody reads the rest of the body any more */
+  } else if (len > STREAM_UPLOAD_BUFFER_SIZE - (stream->upload_len - stream->upload_offset)) {
+    pri_error ("Request body of %u bytes overflows the upload buffer\n", len);
+    ret = CURL_FAIL;
+  } else {
+    if (stream->upload_left >= 0 && len > stream->upload_left)
+      len = (uint32_t)stream->upload_left;
+
+    /* Move what is left to the front to make room at the end */
+    if (stream->upload_len + len > STREAM_UPLOAD_BUFFER_SIZE) {
+      memmove (stream->upload_buf, stream->upload_buf + stream->upload_offset, \
+          stream->upload_len - stream->upload_offset);
+      stream->upload_len -= stream->upload_offset;
+      stream->upload_offset = 0;
+    }
+    if (len > 0)
+      memcpy (stream->upload_buf + stream->upload_len, buf, len);
+    stream->upload_len += len;
+
+    if (stream->upload_left >= 0)
+      stream->upload_left -= len;
+    if (len == 0 || stream->upload_left == 0)
+      stream->upload_done = TRUE;
+
+    if (stream->upload_paused) {
+      stream->upload_paused = FALSE;
+      proxy_curl_single_pause (stream->single_handle, FALSE);
+    }
+  }
+  proxy_curl_engine_unlock (stream->session);
+
+  return ret;
+}
@@ -0,0 +1,222 @@
+#ifndef __PROXY_STREAM_H__
+#define __PROXY_STREAM_H__
+
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+#define STREAM_BUFFER_SIZE (64*1024) /* size of each buffer the body is written into */
+#define STREAM_BUFFER_LIMIT (1024*1024) /* bytes buffered ahead of the reader before pausing the transfer */
+#define STREAM_HEAD_BUFFER_SIZE (32*1024) /* max length of the header handed to the client */
+#define STREAM_MAX_WAIT 1000 /* max milliseconds to wait for the engine before performing again */
+#define STREAM_UPLOAD_BUFFER_SIZE (64*1024) /* bytes of the request body buffered ahead of the upload */
+
+typedef void* STREAM_HANDLE;
+
+typedef struct _ProxyStreamBuffer ProxyStreamBuffer;
+typedef struct _ProxyStream ProxyStream;
+
+/**
+ * ProxyStreamBuffer:
+ *
+ * A buffer taken from the pool holding a part of the response.
+ */
+struct _ProxyStreamBuffer {
+  char *    buffer;         /* start address of the buffer */
+  uint32_t  buffer_len;     /* length of the buffer */
+  uint32_t  data_len;       /* data written into the buffer */
+  uint32_t  offset;         /* data read from the buffer */
+};
+
+/**
+ * ProxyStream:
+ *
+ * A response got by a single request and handed to the reader while it is
+ * coming, for the small and non-media contents.
+ */
+struct _ProxyStream {
+  /* the target url */
+  char * url;
+
+  /* request headers of the client sent on */
+  void * headers;
+
+  /* engine session driving @multi, locked while touching anything below */
+  void * session;
+  void * multi;
+  void * single_handle;
+
+  /* the header being got, NULL once handed out */
+  ProxyStreamBuffer * head_buf;
+
+  /* the header and body buffers not read yet, in content order */
+  ProxyQueue * data_queue;
+
+  /* the last buffer of @data_queue, the body is written there */
+  ProxyStreamBuffer * tail;
+
+  /* bytes in @data_queue not read yet */
+  uint32_t buffered;
+
+  /* status code of the response the header is being got from */
+  uint32_t status;
+
+  /* the response being got is a redirect */
+  BOOL redirect;
+
+  /* the transfer is paused until the reader catches up */
+  BOOL paused;
+
+  /* the transfer is over, @failed tells how it ended */
+  BOOL done;
+  BOOL failed;
+
+  /* the buffers held from the process-wide pool */
+  ProxyPoolUser pool_user;
+
+  /* the request body written by the caller and not sent yet, NULL if
+   * the request has no body */
+  char * upload_buf;
+  uint32_t upload_len;
+  uint32_t upload_offset;
+
+  /* bytes of the request body not written yet, -1 if not known */
+  int64_t upload_left;
+
+  /* the upload waits for the caller to write more of the body */
+  BOOL upload_paused;
+
+  /* the whole request body has been written */
+  BOOL upload_done;
+};
+
+/**
+ * proxy_stream_create:
+ * @url: The target address
+ * @method: request method, NULL for GET
+ * @headers: request headers of the client to send on, NULL terminated,
+ * NULL for none
+ * @body_length: length of the request body written by @proxy_stream_write,
+ * -1 if not known
+ *
+ * Start getting @url by a single request. Any method but GET and HEAD
+ * sends a request body, streamed while the caller writes it.
+ *
+ * Returns: stream handle, NULL on error.
+ */
+STREAM_HANDLE
+proxy_stream_create (char * url, const char * method, const char * const * headers,
+    int64_t body_length);
+
+/**
+ * proxy_stream_destroy:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Stop the transfer and destroy the stream @handle.
+ */
+void
+proxy_stream_destroy (STREAM_HANDLE handle);
+
+/**
+ * proxy_stream_perform:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Take what the engine has got for the transfer.
+ *
+ * Returns: CURL_FAIL on error, 1 if the transfer is running, zero (0) if
+ * the whole response has been received.
+ */
+int32_t
+proxy_stream_perform (STREAM_HANDLE handle);
+
+/**
+ * proxy_stream_fdset:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Extracts the file descriptor becoming readable once the engine has got
+ * something for the transfer of @handle.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_stream_fdset (STREAM_HANDLE handle, fd_set * read_fd_set,
+    fd_set * write_fd_set, fd_set * exc_fd_set, int * max_fd);
+
+/**
+ * proxy_stream_timeout:
+ * @handle: stream handle create by @proxy_stream_create
+ * @timeout_ms: where to store the milliseconds to wait
+ *
+ * Tell how long to wait for activity on the file descriptors got from
+ * @proxy_stream_fdset before performing again anyway.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_stream_timeout (STREAM_HANDLE handle, int32_t * timeout_ms);
+
+/**
+ * proxy_stream_read:
+ * @handle: stream handle create by @proxy_stream_create
+ * @buf: pointer to buffer where data will be written, Must be >= len bytes long
+ * @len: maximum number of bytes to read
+ *
+ * Read the response received so far.
+ *
+ * Returns: The number of bytes read, 0 if nothing is ready, -1 on error.
+ */
+int32_t
+proxy_stream_read (STREAM_HANDLE handle, char * buf, uint32_t len);
+
+/**
+ * proxy_stream_peek:
+ * @handle: stream handle create by @proxy_stream_create
+ * @iov: where to store the regions of data ready
+ * @iov_count: max number of regions to store
+ *
+ * Get the data ready to read without copying it, in content order. The
+ * regions stay valid until the next call on @handle other than this one.
+ *
+ * Returns: The number of regions stored, 0 if no data is ready, -1 on error.
+ */
+int32_t
+proxy_stream_peek (STREAM_HANDLE handle, struct iovec * iov, int32_t iov_count);
+
+/**
+ * proxy_stream_consume:
+ * @handle: stream handle create by @proxy_stream_create
+ * @len: bytes used from the regions got by @proxy_stream_peek
+ *
+ * Advance the file position by @len bytes, as if they were read.
+ *
+ * Returns: The number of bytes consumed, -1 on error.
+ */
+int32_t
+proxy_stream_consume (STREAM_HANDLE handle, uint32_t len);
+
+/**
+ * proxy_stream_write_space:
+ * @handle: stream handle create by @proxy_stream_create
+ *
+ * Returns: The number of bytes of the request body @proxy_stream_write
+ * takes now.
+ */
+uint32_t
+proxy_stream_write_space (STREAM_HANDLE handle);
+
+/**
+ * proxy_stream_write:
+ * @handle: stream handle create by @proxy_stream_create
+ * @buf: the next part of the request body
+ * @len: length of @buf, no more than @proxy_stream_write_space tells, zero
+ * to end a body of unknown length
+ *
+ * Hand a part of the request body to the upload. It is dropped if the
+ * transfer is over already.
+ *
+ * Returns: CURL_SUCC on success or CURL_FAIL error.
+ */
+int32_t
+proxy_stream_write (STREAM_HANDLE handle, const char * buf, uint32_t len);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * chunked_post: send chunked POST bodies through the proxy and check that
+ * the origin gets each of them whole.
+ *
+ * Usage: chunked_post [-x host:port] [-p port]
+ *
+ * Runs its own origin on 127.0.0.1:@port (8081 by default), which decodes
+ * the body it gets and answers with its length and hash. Each case writes
+ * the request to the proxy given by -x in a different way, without -x it
+ * goes to the origin directly to check the tool itself. A case fails if
+ * the answer doesn't match the body sent or doesn't come within
+ * ANSWER_TIMEOUT, which is how an upload the proxy stopped reading shows.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+#define HEAD_SIZE	8192
+#define ANSWER_SIZE	1024
+#define ANSWER_TIMEOUT	10000	/* ms */
+#define SEGMENT_DELAY	200000	/* us between the writes of a case */
+#define BODY_SIZE	(300*1024)
+
+typedef struct {
+	const char *name;
+	int empty_first;	/* the headers go alone, the body only later */
+	size_t chunk_size;	/* bytes of each chunk */
+	int split;		/* each chunk goes in two writes, cut inside its size line */
+	int together;		/* the whole request in one write */
+} PostCase;
+
+static const PostCase post_cases[] = {
+	{ "headers alone, then the chunks", 1, 16384, 0, 0 },
+	{ "headers alone, then split chunks", 1, 65536, 1, 0 },
+	{ "headers and body together", 0, 4096, 0, 1 },
+	{ "first chunk with the headers", 0, 32768, 0, 0 },
+};
+
+static int origin_port = 8081;
+static char body[BODY_SIZE];
+
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+
+static unsigned int fnv_hash(const char *buf, size_t len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len-- > 0)
+		hash = (hash ^ (unsigned char)*buf++) * 16777619U;
+	return hash;
+}
+
+
+/*
+ * Decode the chunked body in @buf as far as it goes. Returns 1 once the
+ * last chunk is in, 0 if more is needed, -1 if it isn't validly chunked.
+ */
+static int chunked_decode(const char *buf, size_t len, char *out, size_t *out_len)
+{
+	size_t pos = 0, size;
+	const char *line_end;
+	char *end;
+
+	*out_len = 0;
+	for (;;) {
+		line_end = memchr(buf + pos, '\n', len - pos);
+		if (line_end == NULL)
+			return 0;
+		size = strtoul(buf + pos, &end, 16);
+		if (end == buf + pos)
+			return -1;
+		pos = (size_t)(line_end - buf) + 1;
+		if (size == 0)
+			return (len - pos >= 2) ? 1 : 0;
+		if (len - pos < size + 2)
+			return 0;
+		if (*out_len + size > BODY_SIZE)
+			return -1;
+		memcpy(out + *out_len, buf + pos, size);
+		*out_len += size;
+		pos += size + 2;
+	}
+}
+
+
+static void serve_upload(int fd)
+{
+	static char got[BODY_SIZE + HEAD_SIZE], decoded[BODY_SIZE];
+	char head[HEAD_SIZE + 1], answer[ANSWER_SIZE];
+	size_t used = 0, got_len = 0, decoded_len = 0, length = 0;
+	const char *value;
+	char *end;
+	int chunked, state = 0, len;
+	ssize_t n;
+
+	/* The head first, what follows it is the start of the body */
+	for (;;) {
+		head[used] = '\0';
+		if ((end = strstr(head, "\r\n\r\n")) != NULL)
+			break;
+		if (used == HEAD_SIZE)
+			return;
+		n = read(fd, head + used, HEAD_SIZE - used);
+		if (n <= 0)
+			return;
+		used += (size_t)n;
+	}
+	end += 4;
+	got_len = used - (size_t)(end - head);
+	memcpy(got, end, got_len);
+	end[-2] = '\0';
+
+	value = strcasestr(head, "\r\nTransfer-Encoding:");
+	chunked = (value != NULL && strcasestr(value, "chunked") != NULL);
+	if (!chunked && (value = strcasestr(head, "\r\nContent-Length:")) != NULL)
+		length = strtoul(value + 17, NULL, 10);
+
+	for (;;) {
+		if (chunked) {
+			state = chunked_decode(got, got_len, decoded, &decoded_len);
+			if (state != 0)
+				break;
+		} else if (got_len >= length) {
+			memcpy(decoded, got, length);
+			decoded_len = length;
+			state = 1;
+			break;
+		}
+		if (got_len == sizeof(got)) {
+			state = -1;
+			break;
+		}
+		n = read(fd, got + got_len, sizeof(got) - got_len);
+		if (n <= 0)
+			return;
+		got_len += (size_t)n;
+	}
+
+	if (state < 0)
+		len = snprintf(answer, sizeof(answer), "bad body");
+	else
+		len = snprintf(answer, sizeof(answer), "len=%zu hash=%08x",
+			decoded_len, fnv_hash(decoded, decoded_len));
+	dprintf(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+		"Content-Length: %d\r\nConnection: close\r\n\r\n%s", len, answer);
+}
+
+
+static void *origin_run(void *arg)
+{
+	int listen_fd = (int)(long)arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("error: accept failed: %s\n", strerror(errno));
+			return NULL;
+		}
+		serve_upload(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+
+static int connect_to(const char *host, int port)
+{
+	struct sockaddr_in addr;
+	int fd, on = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+		return -1;
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	/* Each write must leave as a segment of its own */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static int send_segment(int fd, const char *buf, size_t len, int delay)
+{
+	if (delay)
+		usleep(SEGMENT_DELAY);
+	return write_all(fd, buf, len);
+}
+
+
+static int run_case(const PostCase *post, const char *proxy_host, int proxy_port)
+{
+	static char request[BODY_SIZE + HEAD_SIZE];
+	char answer[ANSWER_SIZE + HEAD_SIZE + 1], expected[ANSWER_SIZE];
+	char target[64];
+	size_t used = 0, pos, size;
+	struct pollfd pfd;
+	int fd, len, cut;
+	ssize_t n;
+
+	if (proxy_host)
+		fd = connect_to(proxy_host, proxy_port);
+	else
+		fd = connect_to("127.0.0.1", origin_port);
+	if (fd < 0) {
+		printf("FAIL %s: cannot connect: %s\n", post->name, strerror(errno));
+		return -1;
+	}
+
+	/* A proxy gets the absolute URL, the origin only the path */
+	if (proxy_host)
+		snprintf(target, sizeof(target), "http://127.0.0.1:%d/upload", origin_port);
+	else
+		snprintf(target, sizeof(target), "/upload");
+	len = snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\n"
+		"Host: 127.0.0.1:%d\r\nContent-Type: application/octet-stream\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n", target, origin_port);
+	used = (size_t)len;
+	if (post->empty_first) {
+		if (send_segment(fd, request, used, 0) != 0)
+			goto write_failed;
+		used = 0;
+	}
+
+	for (pos = 0; pos < BODY_SIZE; pos += size) {
+		size = (BODY_SIZE - pos < post->chunk_size) ? BODY_SIZE - pos : post->chunk_size;
+		len = sprintf(request + used, "%zx\r\n", size);
+		cut = post->split ? len - 2 : 0;
+		memcpy(request + used + len, body + pos, size);
+		used += (size_t)len + size;
+		memcpy(request + used, "\r\n", 2);
+		used += 2;
+		if (post->together)
+			continue;
+		if (cut && (send_segment(fd, request, (size_t)cut, 1) != 0
+		    || send_segment(fd, request + cut, used - (size_t)cut, 1) != 0))
+			goto write_failed;
+		if (!cut && send_segment(fd, request, used, pos > 0 || post->empty_first) != 0)
+			goto write_failed;
+		used = 0;
+	}
+	memcpy(request + used, "0\r\n\r\n", 5);
+	used += 5;
+	if (send_segment(fd, request, used, !post->together) != 0)
+		goto write_failed;
+
+	/* The answer ends with the connection */
+	used = 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (used < sizeof(answer) - 1) {
+		if (poll(&pfd, 1, ANSWER_TIMEOUT) <= 0) {
+			printf("FAIL %s: no answer within %d ms\n", post->name, ANSWER_TIMEOUT);
+			close(fd);
+			return -1;
+		}
+		n = read(fd, answer + used, sizeof(answer) - 1 - used);
+		if (n <= 0)
+			break;
+		used += (size_t)n;
+	}
+	answer[used] = '\0';
+	close(fd);
+
+	snprintf(expected, sizeof(expected), "\r\n\r\nlen=%d hash=%08x",
+		BODY_SIZE, fnv_hash(body, BODY_SIZE));
+	if (strncmp(answer, "HTTP/1.", 7) != 0 || strstr(answer, expected) == NULL) {
+		printf("FAIL %s: answer '%.*s'\n", post->name, (int)strcspn(answer, "\r\n"), answer);
+		return -1;
+	}
+	printf("ok   %s\n", post->name);
+	return 0;
+
+write_failed:
+	printf("FAIL %s: writing the request failed: %s\n", post->name, strerror(errno));
+	close(fd);
+	return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	pthread_t thread;
+	char *proxy_host = NULL, *colon;
+	int proxy_port = 8118;
+	int opt, listen_fd, on = 1, failed = 0;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "x:p:")) != -1) {
+		switch (opt) {
+		case 'x':
+			proxy_host = optarg;
+			if ((colon = strchr(optarg, ':')) != NULL) {
+				*colon = '\0';
+				proxy_port = atoi(colon + 1);
+			}
+			break;
+		case 'p':
+			origin_port = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-x host:port] [-p port]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < BODY_SIZE; i++)
+		body[i] = (char)(i * 7 + i / 251);
+
+	signal(SIGPIPE, SIG_IGN);
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)origin_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(listen_fd, 16) != 0) {
+		printf("error: cannot listen on port %d: %s\n", origin_port, strerror(errno));
+		return 1;
+	}
+	if (pthread_create(&thread, NULL, origin_run, (void *)(long)listen_fd) != 0) {
+		printf("error: cannot start the origin\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(post_cases) / sizeof(post_cases[0]); i++) {
+		if (run_case(&post_cases[i], proxy_host, proxy_port) != 0)
+			failed = 1;
+	}
+
+	return failed;
+}
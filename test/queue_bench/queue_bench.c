@@ -0,0 +1,264 @@
+/*
+ * queue_bench: time the ring ProxyQueue against the mutex and list queue
+ * it replaced.
+ *
+ * Usage: queue_bench [-n count] [-d depth]
+ *
+ * Two runs for each queue: one thread pushing @depth elements then popping
+ * them again, @count elements in all, and a producer thread handing @count
+ * elements over to a consumer thread, both yielding while the queue is full
+ * or empty. The consumer checks that every element comes once and in order.
+ * The list queue is the one from before the ring, kept here as it was.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "proxylist.h"
+#include "proxyqueue.h"
+
+
+#define DEFAULT_COUNT	10000000
+#define DEFAULT_DEPTH	8
+#define LIST_QUEUE_MAX	PROXY_QUEUE_DEFAULT_SIZE	/* the list queue is never full, bound it like the ring */
+
+typedef struct {
+	ProxyList *head;
+	ProxyList *tail;
+	uint32_t length;
+	pthread_mutex_t lock;
+} ListQueue;
+
+typedef struct {
+	const char *name;
+	void *(*create)(void);
+	void (*destroy)(void *queue);
+	int (*push)(void *queue, void *data);
+	void *(*pop)(void *queue);
+} QueueOps;
+
+typedef struct {
+	const QueueOps *ops;
+	void *queue;
+	unsigned long count;
+	unsigned long errors;
+} RunArg;
+
+
+static void *list_queue_create(void)
+{
+	ListQueue *queue = malloc(sizeof(ListQueue));
+
+	if (queue) {
+		pthread_mutex_init(&queue->lock, NULL);
+		queue->head = queue->tail = NULL;
+		queue->length = 0;
+	}
+	return queue;
+}
+
+static void list_queue_destroy(void *data)
+{
+	ListQueue *queue = data;
+
+	proxy_list_free(queue->head);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+static int list_queue_push(void *data_queue, void *data)
+{
+	ListQueue *queue = data_queue;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->length >= LIST_QUEUE_MAX) {
+		pthread_mutex_unlock(&queue->lock);
+		return 0;
+	}
+	queue->tail = proxy_list_append(queue->tail, data);
+	if (queue->tail->next)
+		queue->tail = queue->tail->next;
+	else
+		queue->head = queue->tail;
+	queue->length++;
+	pthread_mutex_unlock(&queue->lock);
+
+	return 1;
+}
+
+static void *list_queue_pop(void *data_queue)
+{
+	ListQueue *queue = data_queue;
+	ProxyList *node;
+	void *data = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if ((node = queue->head) != NULL) {
+		data = node->data;
+		queue->head = node->next;
+		if (queue->head)
+			queue->head->prev = NULL;
+		else
+			queue->tail = NULL;
+		proxy_list_free_1(node);
+		queue->length--;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return data;
+}
+
+static void *ring_queue_create(void)
+{
+	return proxy_queue_new();
+}
+
+static void ring_queue_destroy(void *queue)
+{
+	proxy_queue_free(queue);
+}
+
+static int ring_queue_push(void *queue, void *data)
+{
+	return proxy_queue_push_tail(queue, data);
+}
+
+static void *ring_queue_pop(void *queue)
+{
+	return proxy_queue_pop_head(queue);
+}
+
+static const QueueOps queue_ops[] = {
+	{ "list+mutex", list_queue_create, list_queue_destroy, list_queue_push, list_queue_pop },
+	{ "ring", ring_queue_create, ring_queue_destroy, ring_queue_push, ring_queue_pop },
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Elements are the numbers 1.. so that NULL still means empty */
+static double run_single(const QueueOps *ops, unsigned long count, unsigned long depth)
+{
+	void *queue = ops->create();
+	unsigned long done, i;
+	double start;
+
+	if (queue == NULL) {
+		printf("error: cannot create the %s queue\n", ops->name);
+		exit(1);
+	}
+
+	start = now();
+	for (done = 0; done < count; done += depth) {
+		for (i = 1; i <= depth; i++)
+			ops->push(queue, (void *)i);
+		for (i = 1; i <= depth; i++)
+			ops->pop(queue);
+	}
+	start = now() - start;
+
+	ops->destroy(queue);
+	return start * 1e9 / done;
+}
+
+static void *producer(void *data)
+{
+	RunArg *arg = data;
+	unsigned long i;
+
+	for (i = 1; i <= arg->count; i++) {
+		while (!arg->ops->push(arg->queue, (void *)i))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *consumer(void *data)
+{
+	RunArg *arg = data;
+	unsigned long i;
+	void *element;
+
+	for (i = 1; i <= arg->count; i++) {
+		while ((element = arg->ops->pop(arg->queue)) == NULL)
+			sched_yield();
+		if ((unsigned long)element != i)
+			arg->errors++;
+	}
+	return NULL;
+}
+
+static double run_threads(const QueueOps *ops, unsigned long count, unsigned long *errors)
+{
+	RunArg arg = { ops, ops->create(), count, 0 };
+	pthread_t threads[2];
+	double start;
+
+	if (arg.queue == NULL) {
+		printf("error: cannot create the %s queue\n", ops->name);
+		exit(1);
+	}
+
+	start = now();
+	pthread_create(&threads[0], NULL, producer, &arg);
+	pthread_create(&threads[1], NULL, consumer, &arg);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	start = now() - start;
+
+	ops->destroy(arg.queue);
+	*errors = arg.errors;
+	return start * 1e9 / count;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long count = DEFAULT_COUNT;
+	unsigned long depth = DEFAULT_DEPTH;
+	unsigned long errors;
+	unsigned int i;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			printf("usage: %s [-n count] [-d depth]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (count == 0 || depth == 0 || depth > PROXY_QUEUE_DEFAULT_SIZE) {
+		printf("error: count must be positive, depth 1 to %d\n", PROXY_QUEUE_DEFAULT_SIZE);
+		return 1;
+	}
+
+	printf("%-12s %16s %16s\n", "queue", "1 thread ns/el", "2 threads ns/el");
+	for (i = 0; i < sizeof(queue_ops) / sizeof(queue_ops[0]); i++) {
+		double single = run_single(&queue_ops[i], count, depth);
+		double threads = run_threads(&queue_ops[i], count, &errors);
+
+		printf("%-12s %16.1f %16.1f\n", queue_ops[i].name, single, threads);
+		if (errors) {
+			printf("error: %s queue lost or reordered %lu elements\n", queue_ops[i].name, errors);
+			failed = 1;
+		}
+	}
+
+	return failed;
+}
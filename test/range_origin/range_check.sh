@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# range_check.sh: fetch ranges across the 4 GB boundary through the proxy
+# and check the position marks range_origin writes at every MB.
+#
+# Usage: range_check.sh [-x proxy] [-p port] [-u path]
+#
+# Starts range_origin with a sparse content of 4 GB + 8 MB and asks the
+# proxy (127.0.0.1:8118 by default) for ranges below, across and above
+# 4 GB. The path (/range.mp4 by default) picks how the proxy handles it.
+# Needs curl and a built range_origin next to this script.
+
+PROXY=127.0.0.1:8118
+PORT=8080
+URL_PATH=/range.mp4
+MB=1048576
+GB4=4294967296
+SIZE=$((GB4 + 8*MB))
+MARK_SIZE=21
+
+while getopts x:p:u: opt; do
+	case $opt in
+	x) PROXY=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	u) URL_PATH=$OPTARG ;;
+	*) echo "usage: $0 [-x proxy] [-p port] [-u path]"; exit 1 ;;
+	esac
+done
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d) || exit 1
+ORIGIN_PID=
+
+cleanup() {
+	[ -n "$ORIGIN_PID" ] && kill "$ORIGIN_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+"$DIR/range_origin" -p "$PORT" -s "$SIZE" "$WORK/content" > "$WORK/origin.log" 2>&1 &
+ORIGIN_PID=$!
+sleep 1
+if ! kill -0 "$ORIGIN_PID" 2>/dev/null; then
+	echo "error: range_origin did not start"
+	cat "$WORK/origin.log"
+	exit 1
+fi
+
+FAILED=0
+
+# check_range start end: fetch start-end, end empty for the rest
+check_range() {
+	start=$1
+	end=${2:-$((SIZE - 1))}
+	out="$WORK/body"
+
+	if ! curl -s -f -x "$PROXY" -r "$1-$2" -o "$out" "http://127.0.0.1:$PORT$URL_PATH"; then
+		echo "FAIL $1-$2: request failed"
+		FAILED=1
+		return
+	fi
+
+	length=$(wc -c < "$out")
+	if [ "$length" -ne $((end - start + 1)) ]; then
+		echo "FAIL $1-$2: got $length bytes, expected $((end - start + 1))"
+		FAILED=1
+		return
+	fi
+
+	# Every mark fully inside the range must tell its own position
+	pos=$(( (start + MB - 1) / MB * MB ))
+	marks=0
+	while [ $((pos + MARK_SIZE - 1)) -le "$end" ]; do
+		mark=$(dd if="$out" bs=1 skip=$((pos - start)) count=20 2>/dev/null)
+		if [ "$mark" != "$(printf '%020d' "$pos")" ]; then
+			echo "FAIL $1-$2: mark at $pos reads '$mark'"
+			FAILED=1
+			return
+		fi
+		pos=$((pos + MB))
+		marks=$((marks + 1))
+	done
+
+	echo "ok   $1-$2: $length bytes, $marks marks"
+}
+
+check_range $((GB4 - 4*MB)) $((GB4 - MB - 1))
+check_range $((GB4 - 2*MB)) $((GB4 + 2*MB - 1))
+check_range $((GB4 - 10)) $((GB4 + 30))
+check_range $GB4 $((GB4 + MARK_SIZE - 1))
+check_range $((GB4 + 3*MB + 100)) $((GB4 + 6*MB))
+check_range $((GB4 + 5*MB))
+
+exit $FAILED
@@ -0,0 +1,310 @@
+/*
+ * range_origin: a minimal HTTP origin serving one file with byte ranges.
+ *
+ * Usage: range_origin [-p port] [-s size] file
+ *
+ * With -s the file is created sparse, @size bytes long, so a content of
+ * several GB costs no disk. The decimal content position is written at the
+ * start of every MB (MARK_SPACING) so that a client can check each part of
+ * the content came from the right place, past the 4 GB boundary too.
+ * Every path serves the file, GET and HEAD only, single ranges only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#define MARK_SPACING	(1024*1024)
+#define MARK_SIZE	21		/* "%020llu\n" */
+#define HEAD_SIZE	8192
+#define SEND_CHUNK	(1024*1024)
+
+static int data_fd = -1;
+static unsigned long long data_size;
+static char data_etag[64];
+
+
+static int make_sparse(const char *path, unsigned long long size)
+{
+	char mark[MARK_SIZE + 1];
+	unsigned long long pos;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("error: cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)size) != 0) {
+		printf("error: cannot size %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	for (pos = 0; pos + MARK_SIZE <= size; pos += MARK_SPACING) {
+		snprintf(mark, sizeof(mark), "%020llu\n", pos);
+		if (pwrite(fd, mark, MARK_SIZE, (off_t)pos) != MARK_SIZE) {
+			printf("error: cannot write %s: %s\n", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+
+static int send_body(int fd, unsigned long long start, unsigned long long length)
+{
+	off_t offset = (off_t)start;
+	ssize_t n;
+
+	while (length > 0) {
+		n = sendfile(fd, data_fd, &offset, length > SEND_CHUNK ? SEND_CHUNK : (size_t)length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		length -= (unsigned long long)n;
+	}
+	return 0;
+}
+
+
+static const char *header_value(const char *head, const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *line;
+
+	for (line = strstr(head, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+			line += name_len + 1;
+			while (*line == ' ' || *line == '\t')
+				line++;
+			return line;
+		}
+	}
+	return NULL;
+}
+
+
+/* Returns 1 for a range, 0 for the whole file, -1 if not satisfiable */
+static int parse_range(const char *value, unsigned long long *start, unsigned long long *end)
+{
+	unsigned long long a, b;
+
+	if (value == NULL || strncmp(value, "bytes=", 6) != 0)
+		return 0;
+	value += 6;
+
+	if (*value == '-') {
+		if (sscanf(value + 1, "%llu", &b) != 1 || b == 0)
+			return -1;
+		*start = (b < data_size) ? data_size - b : 0;
+		*end = data_size - 1;
+	} else if (sscanf(value, "%llu-%llu", &a, &b) == 2) {
+		if (a > b || a >= data_size)
+			return -1;
+		*start = a;
+		*end = (b < data_size) ? b : data_size - 1;
+	} else if (sscanf(value, "%llu-", &a) == 1) {
+		if (a >= data_size)
+			return -1;
+		*start = a;
+		*end = data_size - 1;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Returns 0 to keep the connection, -1 to close it */
+static int serve_request(int fd, char *head)
+{
+	char reply[1024];
+	unsigned long long start = 0, end = data_size - 1;
+	const char *value;
+	int head_only, keep_alive, ranged;
+	int len;
+
+	head_only = (strncmp(head, "HEAD ", 5) == 0);
+	if (!head_only && strncmp(head, "GET ", 4) != 0) {
+		len = snprintf(reply, sizeof(reply), "HTTP/1.1 405 Method Not Allowed\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n");
+		write_all(fd, reply, (size_t)len);
+		return -1;
+	}
+
+	value = header_value(head, "Connection");
+	keep_alive = (strstr(head, "HTTP/1.1\r\n") != NULL)
+		&& !(value != NULL && strncasecmp(value, "close", 5) == 0);
+
+	ranged = parse_range(header_value(head, "Range"), &start, &end);
+	value = header_value(head, "If-Range");
+	if (ranged > 0 && value != NULL && strncmp(value, data_etag, strlen(data_etag)) != 0) {
+		ranged = 0;
+		start = 0;
+		end = data_size - 1;
+	}
+
+	if (ranged < 0) {
+		len = snprintf(reply, sizeof(reply), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+			"Content-Range: bytes */%llu\r\nContent-Length: 0\r\n%s\r\n",
+			data_size, keep_alive ? "" : "Connection: close\r\n");
+		return (write_all(fd, reply, (size_t)len) == 0 && keep_alive) ? 0 : -1;
+	}
+
+	len = snprintf(reply, sizeof(reply), "HTTP/1.1 %s\r\n"
+		"Content-Type: video/mp4\r\nAccept-Ranges: bytes\r\nETag: %s\r\n",
+		ranged ? "206 Partial Content" : "200 OK", data_etag);
+	if (ranged)
+		len += snprintf(reply + len, sizeof(reply) - (size_t)len,
+			"Content-Range: bytes %llu-%llu/%llu\r\n", start, end, data_size);
+	len += snprintf(reply + len, sizeof(reply) - (size_t)len,
+		"Content-Length: %llu\r\n%s\r\n", end - start + 1,
+		keep_alive ? "" : "Connection: close\r\n");
+
+	if (write_all(fd, reply, (size_t)len) != 0)
+		return -1;
+	if (!head_only && send_body(fd, start, end - start + 1) != 0)
+		return -1;
+
+	return keep_alive ? 0 : -1;
+}
+
+
+static void *serve_connection(void *arg)
+{
+	int fd = (int)(long)arg;
+	char head[HEAD_SIZE + 1];
+	size_t used = 0, head_len;
+	char *end;
+	ssize_t n;
+
+	for (;;) {
+		head[used] = '\0';
+		end = strstr(head, "\r\n\r\n");
+		if (end == NULL) {
+			if (used == HEAD_SIZE)
+				break;
+			n = read(fd, head + used, HEAD_SIZE - used);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			used += (size_t)n;
+			continue;
+		}
+
+		/* The requests have no body, a pipelined one may follow */
+		head_len = (size_t)(end - head) + 4;
+		end[2] = '\0';
+		if (serve_request(fd, head) != 0)
+			break;
+		memmove(head, head + head_len, used - head_len);
+		used -= head_len;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct stat st;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned long long size = 0;
+	int port = 8080;
+	int opt, listen_fd, fd, on = 1;
+
+	while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			printf("usage: %s [-p port] [-s size] file\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		printf("usage: %s [-p port] [-s size] file\n", argv[0]);
+		return 1;
+	}
+
+	if (size > 0 && make_sparse(argv[optind], size) != 0)
+		return 1;
+	data_fd = open(argv[optind], O_RDONLY);
+	if (data_fd < 0 || fstat(data_fd, &st) != 0 || st.st_size == 0) {
+		printf("error: cannot serve %s\n", argv[optind]);
+		return 1;
+	}
+	data_size = (unsigned long long)st.st_size;
+	snprintf(data_etag, sizeof(data_etag), "\"%llx-%lx\"", data_size, (long)st.st_mtime);
+
+	signal(SIGPIPE, SIG_IGN);
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(listen_fd, 64) != 0) {
+		printf("error: cannot listen on port %d: %s\n", port, strerror(errno));
+		return 1;
+	}
+	printf("serving %s, %llu bytes, on 127.0.0.1:%d\n", argv[optind], data_size, port);
+	fflush(stdout);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("error: accept failed: %s\n", strerror(errno));
+			return 1;
+		}
+		if (pthread_create(&thread, &attr, serve_connection, (void *)(long)fd) != 0)
+			close(fd);
+	}
+	return 0;
+}